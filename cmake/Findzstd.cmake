@@ -0,0 +1,35 @@
+#Findzstd.cmake
+#
+# Finds the zstd library
+#
+# from https://facebook.github.io/zstd/
+#
+# This will define the following variables
+#
+#    ZSTD_FOUND
+#    ZSTD_INCLUDE_DIR
+#    ZSTD_LIBRARY
+#
+# and the following imported targets
+#
+#     zstd::zstd
+#
+
+find_path(ZSTD_INCLUDE_DIR zstd.h)
+find_library(ZSTD_LIBRARY NAMES zstd zstd_static)
+
+mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(zstd
+  FOUND_VAR ZSTD_FOUND
+  REQUIRED_VARS ZSTD_LIBRARY ZSTD_INCLUDE_DIR
+)
+
+if(ZSTD_FOUND AND NOT TARGET zstd::zstd)
+  add_library(zstd::zstd UNKNOWN IMPORTED)
+  set_target_properties(zstd::zstd PROPERTIES
+    IMPORTED_LOCATION "${ZSTD_LIBRARY}"
+    INTERFACE_INCLUDE_DIRECTORIES "${ZSTD_INCLUDE_DIR}"
+  )
+endif()
@@ -7,6 +7,7 @@
 #include "crow/socket_adaptors.h"
 #include "crow/json.h"
 #include "crow/mustache.h"
+#include "crow/ring_buffer.h"
 #include "crow/logging.h"
 #include "crow/task_timer.h"
 #include "crow/utility.h"
@@ -16,10 +17,14 @@
 #include "crow/parser.h"
 #include "crow/http_response.h"
 #include "crow/multipart.h"
+#include "crow/metrics.h"
+#include "crow/access_log.h"
+#include "crow/proxy_protocol.h"
 #include "crow/routing.h"
 #include "crow/middleware.h"
 #include "crow/middleware_context.h"
 #include "crow/compression.h"
+#include "crow/static_file_cache.h"
 #include "crow/http_connection.h"
 #include "crow/http_server.h"
 #include "crow/app.h"
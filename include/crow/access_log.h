@@ -0,0 +1,272 @@
+#pragma once
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "crow/common.h"
+#include "crow/ring_buffer.h"
+
+namespace crow
+{
+    /// An access log that records a fixed size binary entry per request, and formats them on a background thread.
+
+    ///
+    /// Every worker has its own ring buffer, so recording an entry doesn't format anything nor wait on other workers.<br>
+    /// Entries that don't fit in a full buffer are dropped and counted.
+    class access_log
+    {
+    public:
+        enum class format
+        {
+            text, ///< `<time> <peer> <method> <route> <status> <request body bytes> <response body bytes> <latency in microseconds> <worker>`
+            json, ///< One JSON object per line.
+        };
+
+        /// What's recorded for every request.
+        struct entry
+        {
+            int64_t timestamp_us; ///< Microseconds since the UNIX epoch.
+            uint64_t bytes_in;    ///< Request body bytes.
+            uint64_t bytes_out;   ///< Response body bytes.
+            uint32_t latency_us;
+            uint32_t route_id; ///< Index in the route names the log was constructed with, 0 if no route matched.
+            uint16_t worker;
+            uint16_t status;
+            uint16_t peer_port;
+            uint8_t method;      ///< An `HTTPMethod`.
+            uint8_t peer_family; ///< 4 or 6, 0 if the peer is unknown.
+            uint8_t peer_address[16];
+        };
+
+        /// \param routes The name of every route id, the first one is used for requests that didn't match a route.
+        /// \param workers The number of ring buffers to use, entries recorded by worker `n` go to buffer `n % workers`.
+        /// \param capacity How many entries each ring buffer can hold (rounded up to a power of 2).
+        access_log(std::ostream& out, format fmt, std::vector<std::string> routes, unsigned workers = 1, size_t capacity = 4096):
+          out_(out), format_(fmt), routes_(std::move(routes))
+        {
+            if (routes_.empty())
+                routes_.emplace_back();
+            for (unsigned i = 0; i < (workers ? workers : 1); i++)
+                buffers_.emplace_back(new detail::mpsc_ring_buffer<entry>(capacity));
+
+            writer_ = std::thread([this] {
+                write_loop();
+            });
+        }
+
+        /// Write the remaining entries and stop the background thread.
+        ~access_log()
+        {
+            stopping_.store(true, std::memory_order_release);
+            wakeup_.notify_one();
+            writer_.join();
+        }
+
+        /// Store the peer's address in an entry.
+        static void set_peer(entry& e, const asio::ip::tcp::endpoint& endpoint)
+        {
+            asio::ip::address address = endpoint.address();
+            if (address.is_v4())
+            {
+                auto bytes = address.to_v4().to_bytes();
+                std::memcpy(e.peer_address, bytes.data(), bytes.size());
+                e.peer_family = 4;
+            }
+            else
+            {
+                auto bytes = address.to_v6().to_bytes();
+                std::memcpy(e.peer_address, bytes.data(), bytes.size());
+                e.peer_family = 6;
+            }
+            e.peer_port = endpoint.port();
+        }
+
+        /// Queue an entry from the current worker's thread.
+        void record(entry e)
+        {
+            unsigned worker = detail::this_thread_worker();
+            e.worker = static_cast<uint16_t>(worker);
+            if (!buffers_[worker % buffers_.size()]->try_push(e))
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /// Wait until every entry recorded before this call is written.
+        void flush()
+        {
+            size_t target = 0;
+            for (auto& buffer : buffers_)
+                target += buffer->push_count();
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (written_.load(std::memory_order_acquire) < target)
+            {
+                wakeup_.notify_one();
+                flushed_.wait_for(lock, std::chrono::milliseconds(10));
+            }
+        }
+
+        /// The number of entries dropped because their worker's buffer was full.
+        uint64_t dropped() const
+        {
+            return dropped_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        /// Format an entry as a single line (including the line break).
+        void format_entry(const entry& e, std::string& line)
+        {
+            time_t seconds = static_cast<time_t>(e.timestamp_us / 1000000);
+            if (seconds != timestamp_seconds_ || timestamp_.empty())
+            {
+                // Only format the date again when the second changes
+                tm my_tm;
+#if defined(_MSC_VER) || defined(__MINGW32__)
+                gmtime_s(&my_tm, &seconds);
+#else
+                gmtime_r(&seconds, &my_tm);
+#endif
+                char date[32];
+                size_t sz = strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &my_tm);
+                timestamp_.assign(date, sz);
+                timestamp_seconds_ = seconds;
+            }
+            char fraction[16];
+            snprintf(fraction, sizeof(fraction), ".%06uZ", static_cast<unsigned>(e.timestamp_us % 1000000));
+
+            const std::string& route = e.route_id < routes_.size() ? routes_[e.route_id] : routes_[0];
+            const std::string method = method_name(static_cast<HTTPMethod>(e.method));
+
+            if (format_ == format::text)
+            {
+                line += timestamp_;
+                line += fraction;
+                line += ' ';
+                append_peer(e, line);
+                line += ' ';
+                line += method;
+                line += ' ';
+                line += route.empty() ? "-" : route;
+                line += ' ' + std::to_string(e.status) + ' ' + std::to_string(e.bytes_in) + ' ' + std::to_string(e.bytes_out) + ' ' + std::to_string(e.latency_us) + ' ' + std::to_string(e.worker) + '\n';
+            }
+            else
+            {
+                line += "{\"time\":\"";
+                line += timestamp_;
+                line += fraction;
+                line += "\",\"peer\":\"";
+                append_peer(e, line);
+                line += "\",\"method\":\"";
+                line += method;
+                line += "\",\"route\":";
+                if (route.empty())
+                {
+                    line += "null";
+                }
+                else
+                {
+                    line += '"';
+                    for (char c : route)
+                    {
+                        if (c == '"' || c == '\\')
+                            line += '\\';
+                        line += c;
+                    }
+                    line += '"';
+                }
+                line += ",\"status\":" + std::to_string(e.status) + ",\"bytes_in\":" + std::to_string(e.bytes_in) + ",\"bytes_out\":" + std::to_string(e.bytes_out) + ",\"latency_us\":" + std::to_string(e.latency_us) + ",\"worker\":" + std::to_string(e.worker) + "}\n";
+            }
+        }
+
+        static void append_peer(const entry& e, std::string& line)
+        {
+            if (e.peer_family == 4)
+            {
+                asio::ip::address_v4::bytes_type bytes;
+                std::memcpy(bytes.data(), e.peer_address, bytes.size());
+                line += asio::ip::address_v4(bytes).to_string() + ':' + std::to_string(e.peer_port);
+            }
+            else if (e.peer_family == 6)
+            {
+                asio::ip::address_v6::bytes_type bytes;
+                std::memcpy(bytes.data(), e.peer_address, bytes.size());
+                line += '[' + asio::ip::address_v6(bytes).to_string() + "]:" + std::to_string(e.peer_port);
+            }
+            else
+            {
+                line += '-';
+            }
+        }
+
+        void write_loop()
+        {
+            std::string batch;
+            size_t written = 0;
+            entry e;
+
+            while (true)
+            {
+                bool stopping = stopping_.load(std::memory_order_acquire);
+
+                batch.clear();
+                for (auto& buffer : buffers_)
+                {
+                    while (buffer->try_pop(e))
+                    {
+                        format_entry(e, batch);
+                        written++;
+                    }
+                }
+
+                if (!batch.empty())
+                {
+                    out_.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+                    out_.flush();
+                }
+
+                std::unique_lock<std::mutex> lock(mutex_);
+                written_.store(written, std::memory_order_release);
+                flushed_.notify_all();
+
+                if (batch.empty())
+                {
+                    if (stopping)
+                        break;
+                    // Workers never wake this thread up, entries are picked up every few milliseconds instead
+                    wakeup_.wait_for(lock, std::chrono::milliseconds(10));
+                }
+            }
+        }
+
+        std::ostream& out_;
+        format format_;
+        std::vector<std::string> routes_;
+        std::vector<std::unique_ptr<detail::mpsc_ring_buffer<entry>>> buffers_;
+
+        std::string timestamp_;
+        time_t timestamp_seconds_{};
+
+        std::atomic<size_t> written_{0};
+        std::atomic<uint64_t> dropped_{0};
+        std::atomic<bool> stopping_{false};
+        std::mutex mutex_;
+        std::condition_variable wakeup_;
+        std::condition_variable flushed_;
+        std::thread writer_;
+    };
+} // namespace crow
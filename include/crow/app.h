@@ -9,6 +9,7 @@
 #include <type_traits>
 #include <thread>
 #include <condition_variable>
+#include <sstream>
 
 #include "crow/version.h"
 #include "crow/settings.h"
@@ -20,6 +21,8 @@
 #include "crow/http_server.h"
 #include "crow/task_timer.h"
 #include "crow/websocket.h"
+#include "crow/metrics.h"
+#include "crow/access_log.h"
 #ifdef CROW_ENABLE_COMPRESSION
 #include "crow/compression.h"
 #endif
@@ -246,6 +249,42 @@ namespace crow
             return res_stream_threshold_;
         }
 
+        /// Set the size limits requests are held to while they're read (routes can have their own header and body limits)
+        self_t& limits(const request_limits& limits)
+        {
+            limits_ = limits;
+            return *this;
+        }
+
+        const request_limits& limits() const
+        {
+            return limits_;
+        }
+
+        /// The limits a route set for the requests routed to it, `nullptr` if it uses the app's
+        const request_limits* route_limits(const routing_handle_result& found) const
+        {
+            return router_.rule_limits(found);
+        }
+
+        /// Decide whether requests sent with `Expect: 100-continue` should send their body, before it's read (routes can have their own handler)
+
+        ///
+        /// Without a handler, the client is always told to send the body.
+        self_t& expect_continue(expectation_handler handler)
+        {
+            expect_continue_ = std::move(handler);
+            return *this;
+        }
+
+        /// The handler deciding whether a request sent with `Expect: 100-continue` should send its body, `nullptr` if it always should
+        const expectation_handler* expect_continue_handler(const routing_handle_result& found) const
+        {
+            if (const expectation_handler* handler = router_.rule_expect_continue(found))
+                return handler;
+            return expect_continue_ ? &expect_continue_ : nullptr;
+        }
+
         self_t& register_blueprint(Blueprint& blueprint)
         {
             router_.register_blueprint(blueprint);
@@ -262,16 +301,53 @@ namespace crow
         }
 
 #ifdef CROW_ENABLE_COMPRESSION
-        self_t& use_compression(compression::algorithm algorithm)
+        /// Compress responses using the given algorithm, when the client accepts it
+        self_t& use_compression(compression::algorithm algorithm, compression::options options = compression::options())
+        {
+            return use_compression(std::vector<compression::algorithm>{algorithm}, std::move(options));
+        }
+
+        /// Compress responses using the algorithm the client prefers among `algorithms` (ties go to the first one listed)
+        self_t& use_compression(std::vector<compression::algorithm> algorithms, compression::options options = compression::options())
         {
-            comp_algorithm_ = algorithm;
+            if (algorithms.empty())
+                throw std::runtime_error("use_compression needs at least one algorithm");
+            comp_algorithms_ = std::move(algorithms);
+            comp_options_ = std::move(options);
             compression_used_ = true;
             return *this;
         }
 
+        /// Inflate gzip and deflate compressed request bodies while they're read, so handlers get the original body
+
+        ///
+        /// \param max_size The largest body (once inflated) accepted, larger ones are rejected with `413 Payload Too Large`.
+        self_t& use_request_decompression(size_t max_size = 10485760)
+        {
+            request_decompression_limit_ = max_size;
+            return *this;
+        }
+
+        /// The largest inflated request body accepted, 0 if request bodies aren't inflated
+        size_t request_decompression_limit() const
+        {
+            return request_decompression_limit_;
+        }
+
+        /// The app's preferred compression algorithm
         compression::algorithm compression_algorithm()
         {
-            return comp_algorithm_;
+            return comp_algorithms_.front();
+        }
+
+        const std::vector<compression::algorithm>& compression_algorithms() const
+        {
+            return comp_algorithms_;
+        }
+
+        const compression::options& compression_options() const
+        {
+            return comp_options_;
         }
 
         bool compression_used() const
@@ -279,6 +355,155 @@ namespace crow
             return compression_used_;
         }
 #endif
+        /// Serve a precompressed sibling of static files (`app.js.gz` for `app.js`) to clients that accept its encoding
+
+        ///
+        /// \param encodings `gzip` (`.gz`), `br` (`.br`) or `zstd` (`.zst`), in order of preference.
+        self_t& use_precompressed_static(std::vector<std::string> encodings = {"gzip"})
+        {
+            precompressed_static_.clear();
+            for (auto& encoding : encodings)
+            {
+                if (encoding == "gzip")
+                    precompressed_static_.emplace_back(std::move(encoding), ".gz");
+                else if (encoding == "br")
+                    precompressed_static_.emplace_back(std::move(encoding), ".br");
+                else if (encoding == "zstd")
+                    precompressed_static_.emplace_back(std::move(encoding), ".zst");
+                else
+                    throw std::runtime_error("unsupported precompressed static encoding: " + encoding);
+            }
+            return *this;
+        }
+
+        /// The encodings and file suffixes of precompressed static files, in order of preference
+        const std::vector<std::pair<std::string, std::string>>& precompressed_static() const
+        {
+            return precompressed_static_;
+        }
+
+        /// Keep recently served static files (from the static directories) in memory
+
+        ///
+        /// \param max_bytes The total size of the files kept in memory, the least recently used ones are evicted first.
+        /// \param max_file_size Larger files are always read from disk.
+        /// \param revalidate_interval How long a file is served from memory before checking whether it changed on disk.
+        self_t& use_static_cache(size_t max_bytes = 67108864, size_t max_file_size = 1048576, std::chrono::milliseconds revalidate_interval = std::chrono::seconds(1))
+        {
+            static_cache_.reset(new crow::static_file_cache(max_bytes, max_file_size, revalidate_interval));
+            return *this;
+        }
+
+        /// The static file cache (`nullptr` unless `use_static_cache()` was called)
+        crow::static_file_cache* static_cache()
+        {
+            return static_cache_.get();
+        }
+
+        /// Give dynamic responses a weak `ETag` computed from their body
+
+        ///
+        /// Clients sending it back in `If-None-Match` get a `304 Not Modified` without the body. The handler still runs, only the transfer is saved.
+        self_t& use_dynamic_etags(bool enabled = true)
+        {
+            dynamic_etags_used_ = enabled;
+            return *this;
+        }
+
+        bool dynamic_etags_used() const
+        {
+            return dynamic_etags_used_;
+        }
+
+        /// Expect every connection to start with a PROXY protocol (v1 or v2) header, sent by a load balancer in front of the app
+
+        ///
+        /// The header is read before anything else (including the TLS handshake), and the client address it carries becomes the connection's. Connections without a valid header are closed.
+        self_t& use_proxy_protocol(bool enabled = true)
+        {
+            proxy_protocol_used_ = enabled;
+            return *this;
+        }
+
+        bool proxy_protocol_used() const
+        {
+            return proxy_protocol_used_;
+        }
+
+        /// Make a response send a file, from the static file cache if it's used
+        void set_static_file(response& res, const std::string& path)
+        {
+            std::shared_ptr<const crow::static_file_cache::entry> cached;
+            if (static_cache_ && (cached = static_cache_->get(path)))
+                res.set_static_file_info_cached(path, *cached);
+            else
+                res.set_static_file_info_unsafe(path);
+        }
+
+        /// Collect metrics for every route (requests, status classes, body bytes and latency) and for the server's connections
+        self_t& use_metrics()
+        {
+            metrics_used_ = true;
+            return *this;
+        }
+
+        bool metrics_used() const
+        {
+            return metrics_used_;
+        }
+
+        /// Serve the collected metrics in the Prometheus text format on `url` (also enables metrics)
+        self_t& metrics_endpoint(std::string url = "/metrics")
+        {
+            metrics_endpoint_ = std::move(url);
+            return use_metrics();
+        }
+
+        /// Get a snapshot of the metrics collected for every route
+        std::vector<metrics::route_snapshot> route_metrics()
+        {
+            return router_.metrics_snapshot();
+        }
+
+        /// Get a snapshot of the server's connection metrics
+        metrics::server_snapshot server_metrics()
+        {
+            metrics::server_snapshot snapshot = server_metrics_.snapshot();
+            if (server_)
+                snapshot.active_connections = server_->active_connections();
+#ifdef CROW_ENABLE_SSL
+            if (ssl_server_)
+                snapshot.active_connections = ssl_server_->active_connections();
+#endif
+            return snapshot;
+        }
+
+        /// Where the server and its connections record their metrics (`nullptr` unless metrics are used)
+        metrics::server_metrics* server_metrics_collector()
+        {
+            return metrics_used_ ? &server_metrics_ : nullptr;
+        }
+
+        /// Record every request in an access log written to `out` (entries are formatted and written on a background thread)
+        self_t& use_access_log(std::ostream& out, crow::access_log::format format = crow::access_log::format::text)
+        {
+            access_log_out_ = &out;
+            access_log_format_ = format;
+            return *this;
+        }
+
+        /// The access log requests are recorded in (`nullptr` unless `use_access_log()` was called)
+        crow::access_log* access_logger()
+        {
+            return access_log_.get();
+        }
+
+        /// Get the id of the route a request was routed to, as used by the access log
+        uint32_t route_id(const routing_handle_result& found) const
+        {
+            return router_.rule_id(found);
+        }
+
         /// A wrapper for `validate()` in the router
 
         ///
@@ -296,9 +521,9 @@ namespace crow
                 if (static_dir_[static_dir_.length() - 1] != '/')
                     static_dir_ += '/';
 
-                route<crow::black_magic::get_parameter_tag(CROW_STATIC_ENDPOINT)>(CROW_STATIC_ENDPOINT)([static_dir_](crow::response& res, std::string file_path_partial) {
+                route<crow::black_magic::get_parameter_tag(CROW_STATIC_ENDPOINT)>(CROW_STATIC_ENDPOINT)([this, static_dir_](crow::response& res, std::string file_path_partial) {
                     utility::sanitize_filename(file_path_partial);
-                    res.set_static_file_info_unsafe(static_dir_ + file_path_partial);
+                    set_static_file(res, static_dir_ + file_path_partial);
                     res.end();
                 });
 
@@ -316,9 +541,9 @@ namespace crow
                             if (static_dir_[static_dir_.length() - 1] != '/')
                                 static_dir_ += '/';
 
-                            bp->new_rule_tagged<crow::black_magic::get_parameter_tag(CROW_STATIC_ENDPOINT)>(CROW_STATIC_ENDPOINT)([static_dir_](crow::response& res, std::string file_path_partial) {
+                            bp->new_rule_tagged<crow::black_magic::get_parameter_tag(CROW_STATIC_ENDPOINT)>(CROW_STATIC_ENDPOINT)([this, static_dir_](crow::response& res, std::string file_path_partial) {
                                 utility::sanitize_filename(file_path_partial);
-                                res.set_static_file_info_unsafe(static_dir_ + file_path_partial);
+                                set_static_file(res, static_dir_ + file_path_partial);
                                 res.end();
                             });
                         }
@@ -326,7 +551,28 @@ namespace crow
                 }
 #endif
 
+                if (!metrics_endpoint_.empty())
+                {
+                    route_dynamic(std::string(metrics_endpoint_))([this](const crow::request&, crow::response& res) {
+                        std::ostringstream out;
+                        metrics::write_prometheus(out, server_metrics());
+                        metrics::write_prometheus(out, route_metrics());
+                        res.set_header(known_header::content_type, "text/plain; version=0.0.4; charset=utf-8");
+                        res.body = out.str();
+                        res.end();
+                    });
+                }
+
+                router_.middleware_dispatch_table(detail::middleware_dispatch_table<self_t>());
                 router_.validate();
+                if (metrics_used_)
+                {
+                    // one shard per worker thread
+                    router_.enable_metrics(concurrency_ - 1);
+                    server_metrics_.shards(concurrency_ - 1);
+                }
+                if (access_log_out_)
+                    access_log_.reset(new crow::access_log(*access_log_out_, access_log_format_, router_.rule_names(), concurrency_ - 1));
                 validated_ = true;
             }
         }
@@ -567,12 +813,26 @@ namespace crow
         std::string server_name_ = std::string("Crow/") + VERSION;
         std::string bindaddr_ = "0.0.0.0";
         size_t res_stream_threshold_ = 1048576;
+        request_limits limits_;
+        expectation_handler expect_continue_;
+        bool metrics_used_{false};
+        std::string metrics_endpoint_;
+        metrics::server_metrics server_metrics_;
+        std::ostream* access_log_out_{};
+        crow::access_log::format access_log_format_;
+        std::unique_ptr<crow::access_log> access_log_;
         Router router_;
 
 #ifdef CROW_ENABLE_COMPRESSION
-        compression::algorithm comp_algorithm_;
+        std::vector<compression::algorithm> comp_algorithms_;
+        compression::options comp_options_;
         bool compression_used_{false};
+        size_t request_decompression_limit_{0};
 #endif
+        std::vector<std::pair<std::string, std::string>> precompressed_static_;
+        std::unique_ptr<crow::static_file_cache> static_cache_;
+        bool dynamic_etags_used_ = false;
+        bool proxy_protocol_used_ = false;
 
         std::chrono::milliseconds tick_interval_;
         std::function<void()> tick_function_;
@@ -1,34 +1,45 @@
 #pragma once
 
-#include <locale>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <initializer_list>
+#include <string>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include "crow/utility.h"
 
 namespace crow
 {
-    /// Hashing function for ci_map (unordered_multimap).
+    /// Hashing function for case insensitive maps.
+
+    ///
+    /// Every byte is hashed with its 0x20 bit set, which folds ASCII letters to lowercase.
+    /// Some other bytes collide as well (e.g. `@` and `` ` ``), ci_key_eq still tells those apart.
     struct ci_hash
     {
         size_t operator()(const std::string& key) const
         {
-            std::size_t seed = 0;
-            std::locale locale;
-
-            for (auto c : key)
-                hash_combine(seed, std::toupper(c, locale));
-
-            return seed;
+            return hash(key.data(), key.size());
         }
 
-    private:
-        static inline void hash_combine(std::size_t& seed, char v)
+        static inline uint32_t hash(const char* data, size_t size)
         {
-            std::hash<char> hasher;
-            seed ^= hasher(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            // FNV-1a over every byte ORed with 0x20, so "A" and "a" hash alike without a branch
+            uint32_t seed = 2166136261u;
+            for (size_t i = 0; i < size; i++)
+            {
+                seed ^= static_cast<unsigned char>(data[i]) | 0x20;
+                seed *= 16777619u;
+            }
+            return seed;
         }
     };
 
-    /// Equals function for ci_map (unordered_multimap).
+    /// Equals function for case insensitive maps.
     struct ci_key_eq
     {
         bool operator()(const std::string& l, const std::string& r) const
@@ -37,5 +48,437 @@ namespace crow
         }
     };
 
-    using ci_map = std::unordered_multimap<std::string, std::string, ci_hash, ci_key_eq>;
+    /// Headers the framework looks up often, a \ref ci_map finds them without hashing or comparing their name.
+    enum class known_header : uint8_t
+    {
+        accept_encoding,
+        accept_ranges,
+        allow,
+        connection,
+        content_encoding,
+        content_length,
+        content_range,
+        content_type,
+        cookie,
+        date,
+        etag,
+        expect,
+        host,
+        if_modified_since,
+        if_none_match,
+        if_range,
+        last_modified,
+        location,
+        range,
+        sec_websocket_key,
+        server,
+        set_cookie,
+        transfer_encoding,
+        upgrade,
+        vary,
+
+        count ///< The number of known headers, not a header.
+    };
+
+    /// The canonical name of a known header (`Content-Type` for example).
+    inline const char* known_header_name(known_header name)
+    {
+        static const char* const names[] = {
+          "Accept-Encoding", "Accept-Ranges", "Allow", "Connection", "Content-Encoding", "Content-Length", "Content-Range", "Content-Type", "Cookie",
+          "Date", "ETag", "Expect", "Host", "If-Modified-Since", "If-None-Match", "If-Range", "Last-Modified", "Location", "Range",
+          "Sec-WebSocket-Key", "Server", "Set-Cookie", "Transfer-Encoding", "Upgrade", "Vary"};
+        static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(known_header::count), "every known header needs a name");
+        return names[static_cast<size_t>(name)];
+    }
+
+    /// A case insensitive multimap for HTTP headers.
+
+    ///
+    /// Headers are kept in a flat vector in the order they were added, and looked up by comparing a cached hash of every key before the key itself.<br>
+    /// Clearing the map keeps its strings, so a map reused for the next request or response doesn't allocate again for keys and values that fit in them.<br>
+    /// Names are matched against the \ref known_header "known headers" when they're added, so those can be found directly by their enum value.
+    class ci_map
+    {
+        /// Goes through the headers with the same name as the one it starts at, skipping the others.
+        template<typename Map, typename Value>
+        class match_iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = typename std::remove_const<Value>::type;
+            using difference_type = std::ptrdiff_t;
+            using pointer = Value*;
+            using reference = Value&;
+
+            match_iterator(Map* map, size_t index, size_t first):
+              map_(map), index_(index), first_(first)
+            {}
+
+            reference operator*() const
+            {
+                return map_->entries_[index_];
+            }
+
+            pointer operator->() const
+            {
+                return &map_->entries_[index_];
+            }
+
+            match_iterator& operator++()
+            {
+                index_ = map_->next_match(first_, index_ + 1);
+                return *this;
+            }
+
+            match_iterator operator++(int)
+            {
+                match_iterator previous = *this;
+                ++*this;
+                return previous;
+            }
+
+            bool operator==(const match_iterator& other) const
+            {
+                return index_ == other.index_;
+            }
+
+            bool operator!=(const match_iterator& other) const
+            {
+                return index_ != other.index_;
+            }
+
+        private:
+            Map* map_;
+            size_t index_;
+            size_t first_; ///< The first match, the others are compared with it.
+        };
+
+    public:
+        using key_type = std::string;
+        using mapped_type = std::string;
+        using value_type = std::pair<std::string, std::string>;
+        using size_type = size_t;
+        using iterator = std::vector<value_type>::iterator;
+        using const_iterator = std::vector<value_type>::const_iterator;
+        using range_iterator = match_iterator<ci_map, value_type>;
+        using const_range_iterator = match_iterator<const ci_map, const value_type>;
+
+        ci_map() = default;
+        ci_map(const ci_map&) = default;
+        ci_map& operator=(const ci_map&) = default;
+
+        ci_map(ci_map&& other) noexcept:
+          entries_(std::move(other.entries_)), hashes_(std::move(other.hashes_)), ids_(std::move(other.ids_)), size_(other.size_)
+        {
+            std::copy(std::begin(other.known_), std::end(other.known_), std::begin(known_));
+            other.entries_.clear();
+            other.hashes_.clear();
+            other.ids_.clear();
+            other.clear();
+        }
+
+        ci_map& operator=(ci_map&& other) noexcept
+        {
+            entries_ = std::move(other.entries_);
+            hashes_ = std::move(other.hashes_);
+            ids_ = std::move(other.ids_);
+            size_ = other.size_;
+            std::copy(std::begin(other.known_), std::end(other.known_), std::begin(known_));
+            other.entries_.clear();
+            other.hashes_.clear();
+            other.ids_.clear();
+            other.clear();
+            return *this;
+        }
+
+        ci_map(std::initializer_list<value_type> values)
+        {
+            for (const auto& value : values)
+                emplace(value.first, value.second);
+        }
+
+        iterator begin()
+        {
+            return entries_.begin();
+        }
+
+        iterator end()
+        {
+            return entries_.begin() + size_;
+        }
+
+        const_iterator begin() const
+        {
+            return entries_.begin();
+        }
+
+        const_iterator end() const
+        {
+            return entries_.begin() + size_;
+        }
+
+        const_iterator cbegin() const
+        {
+            return begin();
+        }
+
+        const_iterator cend() const
+        {
+            return end();
+        }
+
+        size_t size() const
+        {
+            return size_;
+        }
+
+        bool empty() const
+        {
+            return size_ == 0;
+        }
+
+        /// Remove every header, their strings are kept to be reused.
+        void clear()
+        {
+            size_ = 0;
+            std::fill(std::begin(known_), std::end(known_), 0);
+        }
+
+        template<typename Key, typename Value>
+        iterator emplace(Key&& key, Value&& value)
+        {
+            if (size_ == entries_.size())
+            {
+                entries_.emplace_back();
+                hashes_.emplace_back();
+                ids_.emplace_back();
+            }
+            value_type& entry = entries_[size_];
+            entry.first = std::forward<Key>(key);
+            entry.second = std::forward<Value>(value);
+            hashes_[size_] = hash(entry.first);
+            ids_[size_] = recognize(hashes_[size_], entry.first);
+            if (ids_[size_] != unknown && !known_[ids_[size_]])
+                known_[ids_[size_]] = static_cast<uint32_t>(size_ + 1);
+            return begin() + size_++;
+        }
+
+        iterator insert(const value_type& value)
+        {
+            return emplace(value.first, value.second);
+        }
+
+        /// The first header with this name.
+        iterator find(const std::string& key)
+        {
+            return begin() + index_of(key, hash(key), 0);
+        }
+
+        const_iterator find(const std::string& key) const
+        {
+            return begin() + index_of(key, hash(key), 0);
+        }
+
+        /// The first header with this name.
+        iterator find(known_header name)
+        {
+            return begin() + index_of(name);
+        }
+
+        const_iterator find(known_header name) const
+        {
+            return begin() + index_of(name);
+        }
+
+        size_t count(known_header name) const
+        {
+            size_t count = 0;
+            for (size_t i = index_of(name); i < size_; i++)
+                count += ids_[i] == static_cast<uint8_t>(name);
+            return count;
+        }
+
+        /// Every header with this name, in the order they were added.
+        std::pair<range_iterator, range_iterator> equal_range(const std::string& key)
+        {
+            size_t first = index_of(key, hash(key), 0);
+            return {range_iterator(this, first, first), range_iterator(this, size_, first)};
+        }
+
+        std::pair<const_range_iterator, const_range_iterator> equal_range(const std::string& key) const
+        {
+            size_t first = index_of(key, hash(key), 0);
+            return {const_range_iterator(this, first, first), const_range_iterator(this, size_, first)};
+        }
+
+        /// Every header with this name, in the order they were added.
+        std::pair<range_iterator, range_iterator> equal_range(known_header name)
+        {
+            size_t first = index_of(name);
+            return {range_iterator(this, first, first), range_iterator(this, size_, first)};
+        }
+
+        std::pair<const_range_iterator, const_range_iterator> equal_range(known_header name) const
+        {
+            size_t first = index_of(name);
+            return {const_range_iterator(this, first, first), const_range_iterator(this, size_, first)};
+        }
+
+        /// Replace every header with this name by a single one (the first one keeps its position).
+        template<typename Value>
+        iterator set(known_header name, Value&& value)
+        {
+            size_t index = index_of(name);
+            if (index == size_)
+                return emplace(known_header_name(name), std::forward<Value>(value));
+            entries_[index].second = std::forward<Value>(value);
+            for (size_t i = index + 1; i < size_;)
+            {
+                if (ids_[i] == static_cast<uint8_t>(name))
+                    erase(cbegin() + i);
+                else
+                    i++;
+            }
+            return begin() + index;
+        }
+
+        /// Replace every header with this name by a single one (the first one keeps its position).
+        template<typename Key, typename Value>
+        iterator set(Key&& key, Value&& value)
+        {
+            const std::string& name = key;
+            uint32_t key_hash = hash(name);
+            size_t index = index_of(name, key_hash, 0);
+            if (index == size_)
+                return emplace(std::forward<Key>(key), std::forward<Value>(value));
+            entries_[index].second = std::forward<Value>(value);
+            for (size_t i = index_of(name, key_hash, index + 1); i < size_; i = index_of(name, key_hash, i))
+                erase(cbegin() + i);
+            return begin() + index;
+        }
+
+        size_t count(const std::string& key) const
+        {
+            size_t count = 0;
+            uint32_t key_hash = hash(key);
+            for (size_t i = index_of(key, key_hash, 0); i < size_; i = index_of(key, key_hash, i + 1))
+                count++;
+            return count;
+        }
+
+        /// Remove a header, the ones after it keep their order.
+        iterator erase(const_iterator position)
+        {
+            size_t index = static_cast<size_t>(position - cbegin());
+            // The removed entry's strings move past the end to be reused
+            std::rotate(entries_.begin() + index, entries_.begin() + index + 1, entries_.begin() + size_);
+            std::rotate(hashes_.begin() + index, hashes_.begin() + index + 1, hashes_.begin() + size_);
+            std::rotate(ids_.begin() + index, ids_.begin() + index + 1, ids_.begin() + size_);
+            size_--;
+
+            // Known headers after the removed one moved back
+            std::fill(std::begin(known_), std::end(known_), 0);
+            for (size_t i = size_; i > 0; i--)
+            {
+                if (ids_[i - 1] != unknown)
+                    known_[ids_[i - 1]] = static_cast<uint32_t>(i);
+            }
+            return begin() + index;
+        }
+
+        /// Remove every header with this name.
+        size_t erase(known_header name)
+        {
+            size_t erased = 0;
+            for (size_t i = index_of(name); i < size_; i = index_of(name))
+            {
+                erase(cbegin() + i);
+                erased++;
+            }
+            return erased;
+        }
+
+        /// Remove every header with this name.
+        size_t erase(const std::string& key)
+        {
+            size_t erased = 0;
+            uint32_t key_hash = hash(key);
+            for (size_t i = index_of(key, key_hash, 0); i < size_; i = index_of(key, key_hash, i))
+            {
+                erase(cbegin() + i);
+                erased++;
+            }
+            return erased;
+        }
+
+    private:
+        static constexpr uint8_t unknown = static_cast<uint8_t>(known_header::count);
+
+        static uint32_t hash(const std::string& key)
+        {
+            return ci_hash::hash(key.data(), key.size());
+        }
+
+        /// The known header a name is, `unknown` if it isn't one.
+        static uint8_t recognize(uint32_t key_hash, const std::string& key)
+        {
+            struct known_hashes
+            {
+                uint32_t values[static_cast<size_t>(known_header::count)];
+                known_hashes()
+                {
+                    for (size_t i = 0; i < static_cast<size_t>(known_header::count); i++)
+                    {
+                        const char* name = known_header_name(static_cast<known_header>(i));
+                        values[i] = ci_hash::hash(name, strlen(name));
+                    }
+                }
+            };
+            static const known_hashes known;
+
+            for (size_t i = 0; i < static_cast<size_t>(known_header::count); i++)
+            {
+                if (known.values[i] == key_hash && utility::string_equals(key, known_header_name(static_cast<known_header>(i))))
+                    return static_cast<uint8_t>(i);
+            }
+            return unknown;
+        }
+
+        size_t index_of(known_header name) const
+        {
+            uint32_t position = known_[static_cast<size_t>(name)];
+            return position ? position - 1 : size_;
+        }
+
+        size_t index_of(const std::string& key, uint32_t key_hash, size_t from) const
+        {
+            for (size_t i = from; i < size_; i++)
+            {
+                if (hashes_[i] == key_hash && utility::string_equals(entries_[i].first, key))
+                    return i;
+            }
+            return size_;
+        }
+
+        /// The next header from `from` with the same name as the one at `first`.
+        size_t next_match(size_t first, size_t from) const
+        {
+            if (ids_[first] != unknown)
+            {
+                for (size_t i = from; i < size_; i++)
+                {
+                    if (ids_[i] == ids_[first])
+                        return i;
+                }
+                return size_;
+            }
+            return index_of(entries_[first].first, hashes_[first], from);
+        }
+
+        std::vector<value_type> entries_;
+        std::vector<uint32_t> hashes_;
+        std::vector<uint8_t> ids_; ///< The known header every entry is, or `unknown`.
+        uint32_t known_[static_cast<size_t>(known_header::count)]{}; ///< The position + 1 of the first entry of every known header, 0 if there's none.
+        size_t size_ = 0;
+    };
 } // namespace crow
@@ -5,6 +5,9 @@
 #include <stdexcept>
 #include <iostream>
 #include "crow/utility.h"
+#ifdef CROW_CAN_USE_CPP17
+#include <string_view>
+#endif
 
 namespace crow
 {
@@ -194,11 +197,13 @@ namespace crow
         CONFLICT                      = 409,
         GONE                          = 410,
         PAYLOAD_TOO_LARGE             = 413,
+        URI_TOO_LONG                  = 414,
         UNSUPPORTED_MEDIA_TYPE        = 415,
         RANGE_NOT_SATISFIABLE         = 416,
         EXPECTATION_FAILED            = 417,
         PRECONDITION_REQUIRED         = 428,
         TOO_MANY_REQUESTS             = 429,
+        REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
         UNAVAILABLE_FOR_LEGAL_REASONS = 451,
 
         INTERNAL_SERVER_ERROR         = 500,
@@ -211,6 +216,18 @@ namespace crow
 
     // clang-format on
 
+    /// Limits on the size of a request, enforced while it's read (0 means no limit).
+
+    ///
+    /// A request over one of them is answered right away, and the connection is closed without reading the rest of it.
+    struct request_limits
+    {
+        size_t max_url_size = 16384;     ///< Longer URLs get `414 URI Too Long`.
+        size_t max_header_count = 100;   ///< More headers get `431 Request Header Fields Too Large`.
+        size_t max_header_bytes = 32768; ///< The total size of the header names and values, larger headers get `431 Request Header Fields Too Large`.
+        size_t max_body_size = 0;        ///< Larger bodies get `413 Payload Too Large`, before any of the body is read if the request has a `Content-Length`.
+    };
+
     enum class ParamType : char
     {
         INT,
@@ -228,7 +245,11 @@ namespace crow
         std::vector<int64_t> int_params;
         std::vector<uint64_t> uint_params;
         std::vector<double> double_params;
+#ifdef CROW_CAN_USE_CPP17
+        std::vector<std::string_view> string_params; ///< Views into the URL that was routed, no copies are made. They're only valid until the connection reads its next request (which reuses `request::url`).
+#else
         std::vector<std::string> string_params;
+#endif
 
         void debug_print() const
         {
@@ -271,9 +292,17 @@ namespace crow
 
     template<>
     inline std::string routing_params::get<std::string>(unsigned index) const
+    {
+        return std::string(string_params[index]);
+    }
+
+#ifdef CROW_CAN_USE_CPP17
+    template<>
+    inline std::string_view routing_params::get<std::string_view>(unsigned index) const
     {
         return string_params[index];
     }
+#endif
     /// @endcond
 
     struct routing_handle_result
@@ -281,21 +310,31 @@ namespace crow
         uint16_t rule_index;
         std::vector<uint16_t> blueprint_indices;
         routing_params r_params;
-        HTTPMethod method;
+        HTTPMethod method{HTTPMethod::InternalMethodCount};
 
         routing_handle_result() {}
 
         routing_handle_result(uint16_t rule_index_, std::vector<uint16_t> blueprint_indices_, routing_params r_params_):
           rule_index(rule_index_),
-          blueprint_indices(blueprint_indices_),
-          r_params(r_params_) {}
+          blueprint_indices(std::move(blueprint_indices_)),
+          r_params(std::move(r_params_)) {}
 
         routing_handle_result(uint16_t rule_index_, std::vector<uint16_t> blueprint_indices_, routing_params r_params_, HTTPMethod method_):
           rule_index(rule_index_),
-          blueprint_indices(blueprint_indices_),
-          r_params(r_params_),
+          blueprint_indices(std::move(blueprint_indices_)),
+          r_params(std::move(r_params_)),
           method(method_) {}
     };
+
+    namespace detail
+    {
+        /// The index of the server worker running on the current thread (0 for threads that aren't workers).
+        inline unsigned& this_thread_worker()
+        {
+            static thread_local unsigned worker = 0;
+            return worker;
+        }
+    } // namespace detail
 } // namespace crow
 
 // clang-format off
@@ -1,8 +1,19 @@
 #ifdef CROW_ENABLE_COMPRESSION
 #pragma once
 
+#include <cctype>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <vector>
+#include <sys/stat.h>
 #include <zlib.h>
+#ifdef CROW_ENABLE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "crow/mime_types.h"
+#include "crow/utility.h"
 
 // http://zlib.net/manual.html
 namespace crow
@@ -17,45 +28,464 @@ namespace crow
             // windowBits can also be greater than 15 for optional gzip encoding.
             // Add 16 to windowBits to write a simple gzip header and trailer around the compressed data instead of a zlib wrapper.
             GZIP = 15 | 16,
+#ifdef CROW_ENABLE_ZSTD
+            // Not a windowBits value, zstd doesn't go through zlib
+            ZSTD = 0,
+#endif
         };
 
-        inline std::string compress_string(std::string const& str, algorithm algo)
+        /// The content coding of an algorithm, as used in `Accept-Encoding` and `Content-Encoding` headers.
+        inline const char* encoding_name(algorithm algo)
+        {
+            switch (algo)
+            {
+                case GZIP:
+                    return "gzip";
+#ifdef CROW_ENABLE_ZSTD
+                case ZSTD:
+                    return "zstd";
+#endif
+                default:
+                    return "deflate";
+            }
+        }
+
+        /// Pick the algorithm to compress a response with, among the ones `available`.
+
+        ///
+        /// The client's preference (the highest `q` value) comes first, the order of `available` breaks ties.
+        /// `chosen` is always set, to the first of `available` (or `DEFLATE` if it's empty) when nothing is accepted.
+        /// \return false if the client doesn't accept any of them.
+        inline bool negotiate(const utility::accept_encoding& accepted, const std::vector<algorithm>& available, algorithm& chosen)
+        {
+            chosen = available.empty() ? DEFLATE : available.front();
+            float best = 0;
+            for (algorithm algo : available)
+            {
+                float q = accepted.quality(encoding_name(algo));
+                if (q > best)
+                {
+                    best = q;
+                    chosen = algo;
+                }
+            }
+            return best > 0;
+        }
+
+        /// How responses are compressed, and which ones are.
+        struct options
+        {
+            int level = Z_DEFAULT_COMPRESSION; ///< From 1 (fastest) to 9 (smallest output), or `Z_DEFAULT_COMPRESSION`.
+            int mem_level = 8;                 ///< From 1 to 9, higher values use more memory for better speed and output.
+            int strategy = Z_DEFAULT_STRATEGY; ///< `Z_FILTERED`, `Z_HUFFMAN_ONLY`, `Z_RLE`, `Z_FIXED` or `Z_DEFAULT_STRATEGY`.
+            size_t min_size = 0;               ///< Bodies smaller than this are sent as they are.
+#ifdef CROW_ENABLE_ZSTD
+            int zstd_level = 3; ///< The zstd compression level, from 1 (fastest) to 19 (smallest output).
+#endif
+
+            /// If not empty, only responses with one of these content types are compressed (`type/*` matches every subtype).
+            std::vector<std::string> allowed_types;
+            /// Responses with one of these content types are never compressed, since their body is already compressed.
+            std::vector<std::string> denied_types = {
+              "image/png", "image/jpeg", "image/gif", "image/webp", "image/avif",
+              "video/*", "audio/*", "font/woff", "font/woff2",
+              "application/zip", "application/gzip", "application/x-gzip", "application/x-bzip2",
+              "application/x-7z-compressed", "application/x-rar-compressed", "application/zstd"};
+        };
+
+        /// Whether a content type matches a pattern from `options`, ignoring case and parameters (`; charset=...`).
+        inline bool content_type_matches(const std::string& content_type, const std::string& pattern)
+        {
+            size_t length = content_type.find(';');
+            if (length == std::string::npos)
+                length = content_type.size();
+            while (length > 0 && content_type[length - 1] == ' ')
+                length--;
+
+            bool wildcard = pattern.size() >= 2 && pattern.compare(pattern.size() - 2, 2, "/*") == 0;
+            size_t pattern_length = wildcard ? pattern.size() - 1 : pattern.size();
+            if (wildcard ? length < pattern_length : length != pattern_length)
+                return false;
+            for (size_t i = 0; i < pattern_length; i++)
+            {
+                if (std::tolower(static_cast<unsigned char>(content_type[i])) != std::tolower(static_cast<unsigned char>(pattern[i])))
+                    return false;
+            }
+            return true;
+        }
+
+        /// Whether a response with this content type and body size should be compressed.
+        inline bool should_compress(const std::string& content_type, size_t size, const options& opts)
+        {
+            if (size == 0 || size < opts.min_size)
+                return false;
+            if (!opts.allowed_types.empty())
+            {
+                bool allowed = false;
+                for (const auto& pattern : opts.allowed_types)
+                    allowed = allowed || content_type_matches(content_type, pattern);
+                if (!allowed)
+                    return false;
+            }
+            for (const auto& pattern : opts.denied_types)
+            {
+                if (content_type_matches(content_type, pattern))
+                    return false;
+            }
+            return true;
+        }
+
+        /// A deflate stream that's initialized once and reset for every body it compresses.
+
+        ///
+        /// `deflateInit2` allocates (and `deflateEnd` frees) a few hundred kilobytes, `deflateReset` only clears the state.<br>
+        /// The stream is only initialized again when the algorithm or one of the options it was created with changes.
+        class deflater
         {
-            std::string compressed_str;
-            z_stream stream{};
-            // Initialize with the default values
-            if (::deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, algo, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+        public:
+            deflater() = default;
+            deflater(const deflater&) = delete;
+            deflater& operator=(const deflater&) = delete;
+
+            ~deflater()
             {
-                char buffer[8192];
+                if (initialized_)
+                    ::deflateEnd(&stream_);
+            }
 
-                stream.avail_in = str.size();
+            /// Replace `str` with its compressed form, `str` is left as is if compression fails.
+            bool compress(std::string& str, algorithm algo, const options& opts)
+            {
+                if (!reset(algo, opts))
+                    return false;
+
+                // The output is written straight into a buffer large enough for the worst case, so a single call finishes the stream
+                buffer_.resize(::deflateBound(&stream_, static_cast<uLong>(str.size())));
                 // zlib does not take a const pointer. The data is not altered.
-                stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(str.c_str()));
+                stream_.next_in = reinterpret_cast<Bytef*>(&str[0]);
+                stream_.avail_in = static_cast<uInt>(str.size());
+                stream_.next_out = reinterpret_cast<Bytef*>(&buffer_[0]);
+                stream_.avail_out = static_cast<uInt>(buffer_.size());
+
+                if (::deflate(&stream_, Z_FINISH) != Z_STREAM_END)
+                    return false;
+
+                buffer_.resize(stream_.total_out);
+                // The original body's memory becomes the buffer for the next call
+                str.swap(buffer_);
+                return true;
+            }
 
-                int code = Z_OK;
+            /// Start compressing a body that's given to `write()` in several parts.
+            bool begin(algorithm algo, const options& opts)
+            {
+                return reset(algo, opts);
+            }
+
+            /// Compress the next part of a body started with `begin()`, appending whatever output zlib produced to `out`.
+
+            ///
+            /// \param flush `Z_NO_FLUSH` to let zlib buffer the input, `Z_SYNC_FLUSH` so everything written so far can be decompressed, or `Z_FINISH` for the last part.
+            bool write(const char* data, size_t size, int flush, std::string& out)
+            {
+                // zlib does not take a const pointer. The data is not altered.
+                stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+                stream_.avail_in = static_cast<uInt>(size);
+
+                int code;
                 do
                 {
-                    stream.avail_out = sizeof(buffer);
-                    stream.next_out = reinterpret_cast<Bytef*>(&buffer[0]);
+                    size_t offset = out.size();
+                    out.resize(offset + 16384);
+                    stream_.next_out = reinterpret_cast<Bytef*>(&out[offset]);
+                    stream_.avail_out = 16384;
 
-                    code = ::deflate(&stream, Z_FINISH);
-                    // Successful and non-fatal error code returned by deflate when used with Z_FINISH flush
-                    if (code == Z_OK || code == Z_STREAM_END)
-                    {
-                        std::copy(&buffer[0], &buffer[sizeof(buffer) - stream.avail_out], std::back_inserter(compressed_str));
-                    }
+                    code = ::deflate(&stream_, flush);
+                    out.resize(out.size() - stream_.avail_out);
+                    if (code == Z_STREAM_ERROR)
+                        return false;
+                } while (stream_.avail_out == 0);
 
-                } while (code == Z_OK);
+                return flush != Z_FINISH || code == Z_STREAM_END;
+            }
 
-                if (code != Z_STREAM_END)
-                    compressed_str.clear();
+            /// The deflater owned by the calling thread (every worker thread has its own).
+            static deflater& this_thread()
+            {
+                static thread_local deflater instance;
+                return instance;
+            }
 
-                ::deflateEnd(&stream);
+        private:
+            bool reset(algorithm algo, const options& opts)
+            {
+                if (initialized_ && algo == algo_ && opts.level == level_ && opts.mem_level == mem_level_ && opts.strategy == strategy_)
+                    return ::deflateReset(&stream_) == Z_OK;
+
+                if (initialized_)
+                    ::deflateEnd(&stream_);
+                stream_ = z_stream{};
+                initialized_ = ::deflateInit2(&stream_, opts.level, Z_DEFLATED, algo, opts.mem_level, opts.strategy) == Z_OK;
+                algo_ = algo;
+                level_ = opts.level;
+                mem_level_ = opts.mem_level;
+                strategy_ = opts.strategy;
+                return initialized_;
             }
 
+            z_stream stream_{};
+            bool initialized_ = false;
+            algorithm algo_ = DEFLATE;
+            int level_ = 0;
+            int mem_level_ = 0;
+            int strategy_ = 0;
+            std::string buffer_;
+        };
+
+#ifdef CROW_ENABLE_ZSTD
+        /// The zstd counterpart of `deflater`, its compression context is reused for every body it compresses.
+        class zstd_compressor
+        {
+        public:
+            zstd_compressor():
+              context_(ZSTD_createCCtx())
+            {}
+            zstd_compressor(const zstd_compressor&) = delete;
+            zstd_compressor& operator=(const zstd_compressor&) = delete;
+
+            ~zstd_compressor()
+            {
+                ZSTD_freeCCtx(context_);
+            }
+
+            /// Replace `str` with its compressed form, `str` is left as is if compression fails.
+            bool compress(std::string& str, algorithm algo, const options& opts)
+            {
+                if (!begin(algo, opts))
+                    return false;
+
+                buffer_.resize(ZSTD_compressBound(str.size()));
+                size_t size = ZSTD_compress2(context_, &buffer_[0], buffer_.size(), str.data(), str.size());
+                if (ZSTD_isError(size))
+                    return false;
+
+                buffer_.resize(size);
+                str.swap(buffer_);
+                return true;
+            }
+
+            /// Start compressing a body that's given to `write()` in several parts.
+            bool begin(algorithm, const options& opts)
+            {
+                return context_ &&
+                       !ZSTD_isError(ZSTD_CCtx_reset(context_, ZSTD_reset_session_and_parameters)) &&
+                       !ZSTD_isError(ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, opts.zstd_level));
+            }
+
+            /// Compress the next part of a body started with `begin()`, `flush` has the same meaning as for `deflater::write()`.
+            bool write(const char* data, size_t size, int flush, std::string& out)
+            {
+                ZSTD_EndDirective mode = flush == Z_FINISH ? ZSTD_e_end : (flush == Z_SYNC_FLUSH ? ZSTD_e_flush : ZSTD_e_continue);
+                ZSTD_inBuffer input{data, size, 0};
+                size_t remaining;
+                do
+                {
+                    size_t offset = out.size();
+                    out.resize(offset + 16384);
+                    ZSTD_outBuffer output{&out[offset], 16384, 0};
+
+                    remaining = ZSTD_compressStream2(context_, &output, &input, mode);
+                    out.resize(offset + output.pos);
+                    if (ZSTD_isError(remaining))
+                        return false;
+                    // Flushing and ending are only done once zstd has nothing left to write
+                } while (mode == ZSTD_e_continue ? input.pos < input.size : remaining != 0);
+                return true;
+            }
+
+            /// The zstd compressor owned by the calling thread.
+            static zstd_compressor& this_thread()
+            {
+                static thread_local zstd_compressor instance;
+                return instance;
+            }
+
+        private:
+            ZSTD_CCtx* context_;
+            std::string buffer_;
+        };
+#endif
+
+        /// Replace `str` with its compressed form using the calling thread's compressor, `str` is left as is if compression fails.
+        inline bool compress(std::string& str, algorithm algo, const options& opts)
+        {
+#ifdef CROW_ENABLE_ZSTD
+            if (algo == ZSTD)
+                return zstd_compressor::this_thread().compress(str, algo, opts);
+#endif
+            return deflater::this_thread().compress(str, algo, opts);
+        }
+
+        inline std::string compress_string(std::string const& str, algorithm algo)
+        {
+            std::string compressed_str = str;
+            if (!compress(compressed_str, algo, options()))
+                compressed_str.clear();
             return compressed_str;
         }
 
+        /// Write a gzip compressed copy (`file.gz`) of every file that doesn't have an up to date one, for `use_precompressed_static()` to serve.
+
+        ///
+        /// Files with an unknown extension, a type `opts` doesn't allow, or that don't get any smaller are skipped.<br>
+        /// \return The number of files compressed.
+        inline size_t precompress_files(const std::vector<std::string>& paths, int level = Z_BEST_COMPRESSION, options opts = options())
+        {
+            static const char* suffixes[] = {".gz", ".br", ".zst"};
+            opts.level = level;
+            size_t compressed_files = 0;
+
+            for (const std::string& path : paths)
+            {
+                bool precompressed = false;
+                for (const char* suffix : suffixes)
+                {
+                    size_t length = std::char_traits<char>::length(suffix);
+                    precompressed = precompressed || (path.size() > length && path.compare(path.size() - length, length, suffix) == 0);
+                }
+                size_t last_dot = path.find_last_of('.');
+                if (precompressed || last_dot == std::string::npos || path.find_first_of("/\\", last_dot) != std::string::npos)
+                    continue;
+                auto mime_type = mime_types.find(path.substr(last_dot + 1));
+                if (mime_type == mime_types.end())
+                    continue;
+
+                struct stat original, sibling;
+                std::string sibling_path = path + ".gz";
+                if (stat(path.c_str(), &original) != 0 || !should_compress(mime_type->second, static_cast<size_t>(original.st_size), opts))
+                    continue;
+                if (stat(sibling_path.c_str(), &sibling) == 0 && sibling.st_mtime >= original.st_mtime)
+                    continue;
+
+                std::ifstream in(path, std::ios::in | std::ios::binary);
+                std::ostringstream contents;
+                contents << in.rdbuf();
+                std::string body = contents.str();
+                size_t original_size = body.size();
+                if (!deflater::this_thread().compress(body, GZIP, opts) || body.size() >= original_size)
+                    continue;
+
+                std::ofstream out(sibling_path, std::ios::out | std::ios::binary | std::ios::trunc);
+                out.write(body.data(), static_cast<std::streamsize>(body.size()));
+                if (out)
+                    compressed_files++;
+            }
+            return compressed_files;
+        }
+
+        /// Run `precompress_files()` on every file in a directory and its subdirectories (`CROW_STATIC_DIRECTORY` for example).
+        inline size_t precompress_directory(const std::string& directory, int level = Z_BEST_COMPRESSION, options opts = options())
+        {
+            return precompress_files(utility::list_files(directory), level, std::move(opts));
+        }
+
+        /// A stream that inflates a gzip or zlib compressed body as it arrives, with a limit on the inflated size.
+        class inflater
+        {
+        public:
+            enum class result
+            {
+                ok,        ///< The input was inflated, and more is expected.
+                finished,  ///< The compressed stream ended.
+                invalid,   ///< The input isn't valid gzip or zlib data (including data after the end of the stream, other than another gzip member).
+                too_large, ///< The inflated output would be larger than the limit.
+            };
+
+            inflater() = default;
+            inflater(const inflater&) = delete;
+            inflater& operator=(const inflater&) = delete;
+
+            ~inflater()
+            {
+                if (initialized_)
+                    ::inflateEnd(&stream_);
+            }
+
+            /// Start inflating a new stream (the stream is reset instead of being allocated again).
+            bool begin()
+            {
+                finished_ = false;
+                if (!initialized_)
+                {
+                    // Automatic header detection, for both gzip and zlib
+                    initialized_ = ::inflateInit2(&stream_, MAX_WBITS | 32) == Z_OK;
+                    if (!initialized_)
+                        return false;
+                }
+                else if (::inflateReset(&stream_) != Z_OK)
+                {
+                    return false;
+                }
+                // Tells whether the stream is gzip once its header is read
+                header_ = gz_header{};
+                return ::inflateGetHeader(&stream_, &header_) == Z_OK;
+            }
+
+            /// Inflate the next part of the stream, appending the output to `out` (which can't grow beyond `limit` bytes).
+
+            ///
+            /// A gzip stream can be made of several members (RFC 1952), each one is inflated after the other.
+            result write(const char* data, size_t size, std::string& out, size_t limit)
+            {
+                // zlib does not take a const pointer. The data is not altered.
+                stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+                stream_.avail_in = static_cast<uInt>(size);
+
+                while (true)
+                {
+                    if (finished_)
+                    {
+                        if (stream_.avail_in == 0)
+                            break;
+                        // Only another gzip member can follow the end of the stream
+                        if (header_.done != 1 || !begin())
+                            return result::invalid;
+                    }
+
+                    size_t offset = out.size();
+                    out.resize(offset + 16384);
+                    stream_.next_out = reinterpret_cast<Bytef*>(&out[offset]);
+                    stream_.avail_out = 16384;
+
+                    int code = ::inflate(&stream_, Z_NO_FLUSH);
+                    out.resize(out.size() - stream_.avail_out);
+                    if (out.size() > limit)
+                        return result::too_large;
+
+                    if (code == Z_STREAM_END)
+                        finished_ = true;
+                    else if (code != Z_OK && code != Z_BUF_ERROR)
+                        return result::invalid;
+                    else if (stream_.avail_in == 0 && stream_.avail_out != 0)
+                        break;
+                }
+
+                return finished_ ? result::finished : result::ok;
+            }
+
+            /// Whether the whole stream was inflated.
+            bool finished() const
+            {
+                return finished_;
+            }
+
+        private:
+            z_stream stream_{};
+            gz_header header_{}; ///< `done` is 1 for a gzip stream once its header is read, -1 for zlib.
+            bool initialized_ = false;
+            bool finished_ = false;
+        };
+
         inline std::string decompress_string(std::string const& deflated_string)
         {
             std::string inflated_string;
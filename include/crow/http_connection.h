@@ -20,6 +20,9 @@
 #include "crow/socket_adaptors.h"
 #include "crow/compression.h"
 #include "crow/utility.h"
+#include "crow/metrics.h"
+#include "crow/access_log.h"
+#include "crow/proxy_protocol.h"
 
 namespace crow
 {
@@ -42,7 +45,7 @@ namespace crow
           Handler* handler,
           const std::string& server_name,
           std::tuple<Middlewares...>* middlewares,
-          std::function<std::string()>& get_cached_date_str_f,
+          std::function<const std::string&()>& get_cached_date_str_f,
           detail::task_timer& task_timer,
           typename Adaptor::context* adaptor_ctx_,
           std::atomic<unsigned int>& queue_length):
@@ -55,8 +58,14 @@ namespace crow
           get_cached_date_str(get_cached_date_str_f),
           task_timer_(task_timer),
           res_stream_threshold_(handler->stream_threshold()),
-          queue_length_(queue_length)
+          queue_length_(queue_length),
+          server_metrics_(handler->server_metrics_collector()),
+          access_log_(handler->access_logger())
         {
+            parser_.limits = handler->limits();
+#ifdef CROW_ENABLE_COMPRESSION
+            parser_.decompression_limit = handler->request_decompression_limit();
+#endif
 #ifdef CROW_ENABLE_DEBUG
             connectionCount++;
             CROW_LOG_DEBUG << "Connection (" << this << ") allocated, total: " << connectionCount;
@@ -65,6 +74,9 @@ namespace crow
 
         ~Connection()
         {
+            // The server counts a connection towards its worker's queue length once it's accepted
+            if (started_)
+                queue_length_--;
 #ifdef CROW_ENABLE_DEBUG
             connectionCount--;
             CROW_LOG_DEBUG << "Connection (" << this << ") freed, total: " << connectionCount;
@@ -78,6 +90,23 @@ namespace crow
         }
 
         void start()
+        {
+            started_ = true;
+            // The peer never changes, so it's only looked up once
+            asio::error_code ec;
+            peer_ = adaptor_.raw_socket().remote_endpoint(ec);
+            has_peer_ = !ec;
+            if (ec)
+            {
+                CROW_LOG_DEBUG << this << " without a peer address: " << ec.message();
+            }
+            if (handler_->proxy_protocol_used())
+                read_proxy_header();
+            else
+                start_adaptor();
+        }
+
+        void start_adaptor()
         {
             auto self = this->shared_from_this();
             adaptor_.start([self](const asio::error_code& ec) {
@@ -97,7 +126,10 @@ namespace crow
 
         void handle_url()
         {
+            if (handler_->metrics_used() || access_log_)
+                request_start_ = std::chrono::steady_clock::now();
             routing_handle_result_ = handler_->handle_initial(req_, res);
+            parser_.route_limits = handler_->route_limits(*routing_handle_result_);
             // if no route is found for the request method, return the response without parsing or processing anything further.
             if (!routing_handle_result_->rule_index)
             {
@@ -109,30 +141,69 @@ namespace crow
         void handle_header()
         {
             // HTTP 1.1 Expect: 100-continue
-            if (req_.http_ver_major == 1 && req_.http_ver_minor == 1 && get_header_value(req_.headers, "expect") == "100-continue")
+            if (req_.http_ver_major == 1 && req_.http_ver_minor == 1 && get_header_value(req_.headers, known_header::expect) == "100-continue")
             {
-                buffers_.clear();
-                static std::string expect_100_continue = "HTTP/1.1 100 Continue\r\n\r\n";
-                buffers_.emplace_back(expect_100_continue.data(), expect_100_continue.size());
-                do_write();
+                const expectation_handler* expect_continue = handler_->expect_continue_handler(*routing_handle_result_);
+                if (!expect_continue)
+                {
+                    send_continue();
+                    return;
+                }
+
+                // Nothing more is read, and the request isn't handled, until the expectation is answered
+                expectation_pending_ = true;
+                req_.io_service = &adaptor_.get_io_service();
+                auto self = this->shared_from_this();
+                expectation expect([self](std::shared_ptr<response> rejection) {
+                    self->adaptor_.get_io_service().post([self, rejection] {
+                        self->answer_expectation(rejection);
+                    });
+                });
+                try
+                {
+                    (*expect_continue)(req_, expect);
+                }
+                catch (const std::exception& e)
+                {
+                    CROW_LOG_ERROR << "An uncaught exception occurred: " << e.what();
+                    expect.reject(response(500));
+                }
+                catch (...)
+                {
+                    CROW_LOG_ERROR << "An uncaught exception occurred. The type was unknown so no information was available.";
+                    expect.reject(response(500));
+                }
             }
         }
 
         void handle()
         {
+            if (expectation_pending_)
+            {
+                // The client sent the body without waiting, it's handled once the expectation is answered
+                message_waiting_ = true;
+                return;
+            }
+
             // TODO(EDev): cancel_deadline_timer should be looked into, it might be a good idea to add it to handle_url() and then restart the timer once everything passes
             cancel_deadline_timer();
             bool is_invalid_request = false;
             add_keep_alive_ = false;
 
-            req_.remote_ip_address = adaptor_.remote_endpoint().address().to_string();
+            if (server_metrics_)
+                server_metrics_->request(requests_served_ != 0);
+            requests_served_++;
+
+            if (has_peer_ && peer_address_.empty())
+                peer_address_ = peer_.address().to_string();
+            req_.remote_ip_address = peer_address_;
 
             add_keep_alive_ = req_.keep_alive;
             close_connection_ = req_.close_connection;
 
             if (req_.check_version(1, 1)) // HTTP/1.1
             {
-                if (!req_.headers.count("host"))
+                if (!req_.headers.count(known_header::host))
                 {
                     is_invalid_request = true;
                     res = response(400);
@@ -140,7 +211,7 @@ namespace crow
                 else if (req_.upgrade)
                 {
                     // h2 or h2c headers
-                    if (req_.get_header_value("upgrade").substr(0, 2) == "h2")
+                    if (req_.get_header_value(known_header::upgrade).substr(0, 2) == "h2")
                     {
                         // TODO(ipkn): HTTP/2
                         // currently, ignore upgrade header
@@ -154,7 +225,13 @@ namespace crow
                 }
             }
 
-            CROW_LOG_INFO << "Request: " << utility::lexical_cast<std::string>(adaptor_.remote_endpoint()) << " " << this << " HTTP/" << (char)(req_.http_ver_major + '0') << "." << (char)(req_.http_ver_minor + '0') << ' ' << method_name(req_.method) << " " << req_.url;
+            if (!is_invalid_request && parser_.body_error)
+            {
+                is_invalid_request = true;
+                res = response(parser_.body_error);
+            }
+
+            CROW_LOG_INFO << "Request: " << req_.remote_ip_address << " " << this << " HTTP/" << (char)(req_.http_ver_major + '0') << "." << (char)(req_.http_ver_minor + '0') << ' ' << method_name(req_.method) << " " << req_.url;
 
 
             need_to_call_after_handlers_ = false;
@@ -183,7 +260,7 @@ namespace crow
                     need_to_call_after_handlers_ = true;
                     handler_->handle(req_, res, routing_handle_result_);
                     if (add_keep_alive_)
-                        res.set_header("connection", "Keep-Alive");
+                        res.set_header(known_header::connection, "Keep-Alive");
                 }
                 else
                 {
@@ -213,49 +290,95 @@ namespace crow
                   decltype(ctx_),
                   decltype(*middlewares_)>({}, *middlewares_, ctx_, req_, res);
             }
+            if (res.is_static_type() && !handler_->precompressed_static().empty())
+            {
+                select_precompressed_file();
+            }
+            if (res.code == status::OK && (req_.method == HTTPMethod::Get || req_.method == HTTPMethod::Head))
+            {
+                if (handler_->dynamic_etags_used() && !res.is_static_type() && !res.body.empty() && !res.headers.count(known_header::etag))
+                {
+                    char etag[24];
+                    snprintf(etag, sizeof(etag), "W/\"%016llx\"", static_cast<unsigned long long>(utility::fnv1a(res.body.data(), res.body.size())));
+                    res.set_header(known_header::etag, etag);
+                }
+                // Before compressing or reading anything
+                if (is_not_modified())
+                {
+                    res.code = status::NOT_MODIFIED;
+                    res.body.clear();
+                    res.file_info = response::static_file_info{};
+                    res.headers.erase(known_header::content_length);
+                    res.headers.erase(known_header::content_type);
+                    res.headers.erase(known_header::content_encoding);
+                }
+                else if (req_.method == HTTPMethod::Get && !req_.get_header_value(known_header::range).empty())
+                {
+                    select_ranges();
+                }
+            }
 #ifdef CROW_ENABLE_COMPRESSION
-            if (handler_->compression_used())
+            if (handler_->compression_used() && res.compressed)
             {
-                std::string accept_encoding = req_.get_header_value("Accept-Encoding");
-                if (!accept_encoding.empty() && res.compressed)
+                const compression::options& compression_options = handler_->compression_options();
+                if (res.get_header_value(known_header::content_encoding).empty() &&
+                    compression::should_compress(res.get_header_value(known_header::content_type), res.body.size(), compression_options))
                 {
-                    switch (handler_->compression_algorithm())
+                    vary_on_accept_encoding();
+                    compression::algorithm algorithm = compression::DEFLATE;
+                    if (compression::negotiate(utility::accept_encoding(req_.get_header_value(known_header::accept_encoding)), handler_->compression_algorithms(), algorithm))
                     {
-                        case compression::DEFLATE:
-                            if (accept_encoding.find("deflate") != std::string::npos)
-                            {
-                                res.body = compression::compress_string(res.body, compression::algorithm::DEFLATE);
-                                res.set_header("Content-Encoding", "deflate");
-                            }
-                            break;
-                        case compression::GZIP:
-                            if (accept_encoding.find("gzip") != std::string::npos)
-                            {
-                                res.body = compression::compress_string(res.body, compression::algorithm::GZIP);
-                                res.set_header("Content-Encoding", "gzip");
-                            }
-                            break;
-                        default:
-                            break;
+                        const char* encoding = compression::encoding_name(algorithm);
+                        if (res.body.size() >= res_stream_threshold_ && !req_.check_version(1, 0))
+                        {
+                            // The body is compressed one piece at a time while it's streamed, so its size isn't known in advance
+                            compress_stream_ = true;
+                            stream_algorithm_ = algorithm;
+                            res.set_header(known_header::content_encoding, encoding);
+                            res.set_header(known_header::transfer_encoding, "chunked");
+                        }
+                        else if (compression::compress(res.body, algorithm, compression_options))
+                        {
+                            res.set_header(known_header::content_encoding, encoding);
+                        }
                     }
                 }
             }
 #endif
             //if there is a redirection with a partial URL, treat the URL as a route.
-            std::string location = res.get_header_value("Location");
+            std::string location = res.get_header_value(known_header::location);
             if (!location.empty() && location.find("://", 0) == std::string::npos)
             {
 #ifdef CROW_ENABLE_SSL
                 if (handler_->ssl_used())
-                    location.insert(0, "https://" + req_.get_header_value("Host"));
+                    location.insert(0, "https://" + req_.get_header_value(known_header::host));
                 else
 #endif
-                    location.insert(0, "http://" + req_.get_header_value("Host"));
-                res.set_header("location", location);
+                    location.insert(0, "http://" + req_.get_header_value(known_header::host));
+                res.set_header(known_header::location, location);
             }
 
             prepare_buffers();
 
+            if (res.route_metrics_ || access_log_)
+            {
+                uint64_t bytes_out = res.body.size();
+                if (res.is_static_type())
+                {
+                    bytes_out = res.file_info.ranges.empty() ? static_cast<uint64_t>(res.file_info.statbuf.st_size) : 0;
+                    for (const auto& range : res.file_info.ranges)
+                        bytes_out += range.size;
+                }
+                std::chrono::nanoseconds latency = std::chrono::steady_clock::now() - request_start_;
+                if (res.route_metrics_)
+                {
+                    res.route_metrics_->record(res.code, req_.body.size(), bytes_out, latency);
+                    res.route_metrics_ = nullptr;
+                }
+                if (access_log_)
+                    record_access(bytes_out, latency);
+            }
+
             if (res.is_static_type())
             {
                 do_write_static();
@@ -267,6 +390,152 @@ namespace crow
         }
 
     private:
+        /// Read the PROXY protocol header the load balancer sends before anything else.
+
+        ///
+        /// The header is decoded from a peek at the socket so only its own bytes are consumed, and whatever follows is left to the adaptor.
+        void read_proxy_header()
+        {
+            start_deadline();
+            wait_proxy_header(0);
+        }
+
+        /// Wait for (more of) the PROXY protocol header, the first `received` bytes of which are already in the buffer.
+
+        ///
+        /// A header that arrives in pieces is read as far as it goes, and peeked again once more of it arrives, until it's complete or the deadline closes the connection.
+        void wait_proxy_header(size_t received)
+        {
+            auto self = this->shared_from_this();
+            adaptor_.raw_socket().async_wait(asio::socket_base::wait_read, [self, received](const asio::error_code& ec) {
+                proxy_protocol::header header;
+                char* data = self->buffer_.data();
+                asio::error_code peek_ec;
+                size_t peeked = 0;
+                if (!ec)
+                    peeked = self->adaptor_.raw_socket().receive(asio::buffer(data + received, proxy_protocol::max_decoded_size - received), asio::socket_base::message_peek, peek_ec);
+                proxy_protocol::result result = ec || peek_ec ? proxy_protocol::result::invalid : proxy_protocol::decode(data, received + peeked, header);
+                if (result == proxy_protocol::result::incomplete && peeked > 0)
+                {
+                    // Everything before the end of an incomplete header is part of it
+                    asio::error_code read_ec;
+                    size_t read = self->adaptor_.raw_socket().receive(asio::buffer(data + received, peeked), 0, read_ec);
+                    if (!read_ec)
+                    {
+                        self->wait_proxy_header(received + read);
+                        return;
+                    }
+                }
+                if (result != proxy_protocol::result::complete)
+                {
+                    CROW_LOG_DEBUG << self << " without a valid PROXY protocol header";
+                    self->cancel_deadline_timer();
+                    self->adaptor_.close();
+                    return;
+                }
+                if (header.proxied)
+                {
+                    self->peer_ = header.source;
+                    self->has_peer_ = true;
+                }
+                self->skip_proxy_header(header.size - received);
+            });
+        }
+
+        void skip_proxy_header(size_t remaining)
+        {
+            auto self = this->shared_from_this();
+            asio::async_read(adaptor_.raw_socket(), asio::buffer(buffer_.data(), std::min(remaining, buffer_.size())), [self, remaining](const asio::error_code& ec, std::size_t bytes_transferred) {
+                if (ec)
+                {
+                    self->cancel_deadline_timer();
+                    self->adaptor_.close();
+                }
+                else if (bytes_transferred < remaining) // v2 TLVs larger than the buffer
+                {
+                    self->skip_proxy_header(remaining - bytes_transferred);
+                }
+                else
+                {
+                    self->start_adaptor();
+                }
+            });
+        }
+
+        /// Answer a request that's over its limits without handling it, and close the connection.
+        void reject_request(int code)
+        {
+            if (code == status::URI_TOO_LONG)
+            {
+                // The request was never routed
+                routing_handle_result_.reset();
+                request_start_ = std::chrono::steady_clock::now();
+            }
+            reject_request(response(code));
+        }
+
+        /// Answer a request without handling it, and close the connection.
+        void reject_request(response rejection)
+        {
+            CROW_LOG_INFO << "Request rejected: " << this << ' ' << rejection.code;
+            expectation_pending_ = false;
+            message_waiting_ = false;
+            close_connection_ = true;
+            need_to_call_after_handlers_ = false;
+            res = std::move(rejection);
+            complete_request();
+        }
+
+        /// Carry on with a request sent with `Expect: 100-continue` once the expectation is answered.
+        void answer_expectation(const std::shared_ptr<response>& rejection)
+        {
+            if (!expectation_pending_ || !adaptor_.is_open())
+                return;
+            expectation_pending_ = false;
+            if (rejection)
+            {
+                cancel_deadline_timer();
+                reject_request(std::move(*rejection));
+                return;
+            }
+
+            if (message_waiting_)
+            {
+                message_waiting_ = false;
+                handle();
+            }
+            else
+            {
+                send_continue();
+            }
+            continue_reading();
+        }
+
+        void send_continue()
+        {
+            static const std::string expect_100_continue = "HTTP/1.1 100 Continue\r\n\r\n";
+            // Written on its own, the connection's buffers and response belong to the final response
+            auto self = this->shared_from_this();
+            asio::async_write(adaptor_.socket(), asio::buffer(expect_100_continue), [self](const asio::error_code&, std::size_t bytes_transferred) {
+                self->count_written(bytes_transferred);
+            });
+        }
+
+        void record_access(uint64_t bytes_out, std::chrono::nanoseconds latency)
+        {
+            if (!access_entry_.peer_family && has_peer_)
+                access_log::set_peer(access_entry_, peer_);
+
+            access_entry_.timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            access_entry_.bytes_in = req_.body.size();
+            access_entry_.bytes_out = bytes_out;
+            access_entry_.latency_us = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+            access_entry_.route_id = routing_handle_result_ ? handler_->route_id(*routing_handle_result_) : 0;
+            access_entry_.status = static_cast<uint16_t>(res.code);
+            access_entry_.method = static_cast<uint8_t>(req_.method);
+            access_log_->record(access_entry_);
+        }
+
         void prepare_buffers()
         {
             res.complete_request_handler_ = nullptr;
@@ -309,11 +578,13 @@ namespace crow
               {status::CONFLICT, "HTTP/1.1 409 Conflict\r\n"},
               {status::GONE, "HTTP/1.1 410 Gone\r\n"},
               {status::PAYLOAD_TOO_LARGE, "HTTP/1.1 413 Payload Too Large\r\n"},
+              {status::URI_TOO_LONG, "HTTP/1.1 414 URI Too Long\r\n"},
               {status::UNSUPPORTED_MEDIA_TYPE, "HTTP/1.1 415 Unsupported Media Type\r\n"},
               {status::RANGE_NOT_SATISFIABLE, "HTTP/1.1 416 Range Not Satisfiable\r\n"},
               {status::EXPECTATION_FAILED, "HTTP/1.1 417 Expectation Failed\r\n"},
               {status::PRECONDITION_REQUIRED, "HTTP/1.1 428 Precondition Required\r\n"},
               {status::TOO_MANY_REQUESTS, "HTTP/1.1 429 Too Many Requests\r\n"},
+              {status::REQUEST_HEADER_FIELDS_TOO_LARGE, "HTTP/1.1 431 Request Header Fields Too Large\r\n"},
               {status::UNAVAILABLE_FOR_LEGAL_REASONS, "HTTP/1.1 451 Unavailable For Legal Reasons\r\n"},
 
               {status::INTERNAL_SERVER_ERROR, "HTTP/1.1 500 Internal Server Error\r\n"},
@@ -351,7 +622,7 @@ namespace crow
                 buffers_.emplace_back(crlf.data(), crlf.size());
             }
 
-            if (!res.manual_length_header && !res.headers.count("content-length"))
+            if (!res.manual_length_header && !res.headers.count(known_header::content_length) && !compress_stream_ && res.code != status::NOT_MODIFIED)
             {
                 content_length_ = std::to_string(res.body.size());
                 static std::string content_length_tag = "Content-Length: ";
@@ -359,14 +630,14 @@ namespace crow
                 buffers_.emplace_back(content_length_.data(), content_length_.size());
                 buffers_.emplace_back(crlf.data(), crlf.size());
             }
-            if (!res.headers.count("server"))
+            if (!res.headers.count(known_header::server))
             {
                 static std::string server_tag = "Server: ";
                 buffers_.emplace_back(server_tag.data(), server_tag.size());
                 buffers_.emplace_back(server_name_.data(), server_name_.size());
                 buffers_.emplace_back(crlf.data(), crlf.size());
             }
-            if (!res.headers.count("date"))
+            if (!res.headers.count(known_header::date))
             {
                 static std::string date_tag = "Date: ";
                 date_str_ = get_cached_date_str();
@@ -386,19 +657,59 @@ namespace crow
 
         void do_write_static()
         {
-            asio::write(adaptor_.socket(), buffers_);
+            auto& file_info = res.file_info;
+            if (file_info.data)
+            {
+                // A cached file is sent along with the headers
+                if (file_info.ranges.empty())
+                    buffers_.emplace_back(file_info.data->data(), file_info.data->size());
+                for (const auto& range : file_info.ranges)
+                {
+                    buffers_.emplace_back(range.header.data(), range.header.size());
+                    buffers_.emplace_back(file_info.data->data() + range.offset, static_cast<size_t>(range.size));
+                }
+                buffers_.emplace_back(file_info.ranges_trailer.data(), file_info.ranges_trailer.size());
+            }
+            count_written(asio::write(adaptor_.socket(), buffers_));
 
-            if (res.file_info.statResult == 0)
+            if (file_info.statResult == 0 && !file_info.data)
             {
-                std::ifstream is(res.file_info.path.c_str(), std::ios::in | std::ios::binary);
+                std::ifstream is(file_info.path.c_str(), std::ios::in | std::ios::binary);
                 std::vector<asio::const_buffer> buffers{1};
                 char buf[16384];
-                is.read(buf, sizeof(buf));
-                while (is.gcount() > 0)
+                if (file_info.ranges.empty())
                 {
-                    buffers[0] = asio::buffer(buf, is.gcount());
-                    do_write_sync(buffers);
                     is.read(buf, sizeof(buf));
+                    while (is.gcount() > 0)
+                    {
+                        buffers[0] = asio::buffer(buf, is.gcount());
+                        do_write_sync(buffers);
+                        is.read(buf, sizeof(buf));
+                    }
+                }
+                for (const auto& range : file_info.ranges)
+                {
+                    if (!range.header.empty())
+                    {
+                        buffers[0] = asio::buffer(range.header);
+                        do_write_sync(buffers);
+                    }
+                    is.seekg(static_cast<std::streamoff>(range.offset));
+                    uint64_t remaining = range.size;
+                    while (remaining > 0)
+                    {
+                        is.read(buf, static_cast<std::streamsize>(std::min<uint64_t>(sizeof(buf), remaining)));
+                        if (is.gcount() <= 0)
+                            break;
+                        buffers[0] = asio::buffer(buf, is.gcount());
+                        do_write_sync(buffers);
+                        remaining -= static_cast<uint64_t>(is.gcount());
+                    }
+                }
+                if (!file_info.ranges_trailer.empty())
+                {
+                    buffers[0] = asio::buffer(file_info.ranges_trailer);
+                    do_write_sync(buffers);
                 }
             }
             if (close_connection_)
@@ -432,30 +743,24 @@ namespace crow
             }
             else
             {
-                asio::write(adaptor_.socket(), buffers_); // Write the response start / headers
+                count_written(asio::write(adaptor_.socket(), buffers_)); // Write the response start / headers
                 cancel_deadline_timer();
-                if (res.body.length() > 0)
+#ifdef CROW_ENABLE_COMPRESSION
+                if (compress_stream_)
                 {
-                    std::string buf;
-                    std::vector<asio::const_buffer> buffers;
-
-                    while (res.body.length() > 16384)
+                    do_write_compressed_stream();
+                }
+                else
+#endif
+                  if (res.body.length() > 0)
+                {
+                    std::vector<asio::const_buffer> buffers{1};
+                    for (size_t offset = 0; offset < res.body.length(); offset += 16384)
                     {
-                        //buf.reserve(16385);
-                        buf = res.body.substr(0, 16384);
-                        res.body = res.body.substr(16384);
-                        buffers.clear();
-                        buffers.push_back(asio::buffer(buf));
+                        buffers[0] = asio::buffer(res.body.data() + offset, std::min<size_t>(16384, res.body.length() - offset));
                         do_write_sync(buffers);
                     }
-                    // Collect whatever is left (less than 16KB) and send it down the socket
-                    // buf.reserve(is.length());
-                    buf = res.body;
                     res.body.clear();
-
-                    buffers.clear();
-                    buffers.push_back(asio::buffer(buf));
-                    do_write_sync(buffers);
                 }
                 if (close_connection_)
                 {
@@ -471,6 +776,225 @@ namespace crow
             }
         }
 
+        /// Add `Accept-Encoding` to the response's `Vary` header, since its body depends on it.
+        void vary_on_accept_encoding()
+        {
+            std::string vary = res.get_header_value(known_header::vary);
+            if (vary.empty())
+                res.set_header(known_header::vary, "Accept-Encoding");
+            else if (vary.find("Accept-Encoding") == std::string::npos && vary != "*")
+                res.set_header(known_header::vary, vary + ", Accept-Encoding");
+        }
+
+        /// Whether the client's copy of the response (identified by `If-None-Match` or `If-Modified-Since`) is still valid.
+        bool is_not_modified()
+        {
+            const std::string& etag = res.get_header_value(known_header::etag);
+            const std::string& if_none_match = req_.get_header_value(known_header::if_none_match);
+            if (!if_none_match.empty())
+                return !etag.empty() && utility::etag_matches(if_none_match, etag);
+
+            // If-Modified-Since is ignored when If-None-Match is there
+            time_t last_modified, if_modified_since;
+            return utility::parse_http_date(req_.get_header_value(known_header::if_modified_since), if_modified_since) &&
+                   utility::parse_http_date(res.get_header_value(known_header::last_modified), last_modified) &&
+                   last_modified <= if_modified_since;
+        }
+
+        /// Only send the parts of the response a `Range` header asks for (`206 Partial Content`), or `416 Range Not Satisfiable` if there are none.
+        void select_ranges()
+        {
+            uint64_t size = res.is_static_type() ? static_cast<uint64_t>(res.file_info.statbuf.st_size) : res.body.size();
+            std::vector<utility::byte_range> ranges;
+            if (!utility::parse_ranges(req_.get_header_value(known_header::range), size, ranges))
+                return;
+
+            // If-Range needs a strong validator, otherwise the whole response is sent
+            const std::string& if_range = req_.get_header_value(known_header::if_range);
+            if (!if_range.empty() && if_range != (if_range[0] == '"' ? res.get_header_value(known_header::etag) : res.get_header_value(known_header::last_modified)))
+                return;
+
+#ifdef CROW_ENABLE_COMPRESSION
+            // Ranges refer to the body as it is now
+            res.compressed = false;
+#endif
+            if (ranges.empty())
+            {
+                res.code = status::RANGE_NOT_SATISFIABLE;
+                res.body.clear();
+                res.file_info = response::static_file_info{};
+                res.headers.erase(known_header::content_length);
+                res.headers.erase(known_header::content_type);
+                res.set_header(known_header::content_range, "bytes */" + std::to_string(size));
+                return;
+            }
+
+            res.code = status::PARTIAL_CONTENT;
+            std::string total = '/' + std::to_string(size);
+            std::string boundary;
+            std::string content_type = res.get_header_value(known_header::content_type);
+            if (!content_type.empty())
+                content_type = "\r\nContent-Type: " + content_type;
+            if (ranges.size() > 1)
+            {
+                boundary = utility::random_alphanum(24);
+                res.set_header(known_header::content_type, "multipart/byteranges; boundary=" + boundary);
+            }
+
+            uint64_t length = 0;
+            std::string body;
+            for (const auto& range : ranges)
+            {
+                std::string content_range = "bytes " + std::to_string(range.first) + '-' + std::to_string(range.last) + total;
+                std::string header;
+                if (boundary.empty())
+                    res.set_header(known_header::content_range, content_range);
+                else
+                    header = (length ? "\r\n--" : "--") + boundary + content_type + "\r\nContent-Range: " + content_range + "\r\n\r\n";
+
+                uint64_t range_size = range.last - range.first + 1;
+                length += header.size() + range_size;
+                if (res.is_static_type())
+                {
+                    res.file_info.ranges.push_back({std::move(header), range.first, range_size});
+                }
+                else
+                {
+                    body += header;
+                    body.append(res.body, static_cast<size_t>(range.first), static_cast<size_t>(range_size));
+                }
+            }
+
+            std::string trailer = boundary.empty() ? std::string() : "\r\n--" + boundary + "--\r\n";
+            length += trailer.size();
+            if (res.is_static_type())
+            {
+                res.file_info.ranges_trailer = std::move(trailer);
+                res.set_header(known_header::content_length, std::to_string(length));
+            }
+            else
+            {
+                res.body = std::move(body) + trailer;
+            }
+        }
+
+        /// Send a precompressed sibling of the static file (`app.js.gz` for example) instead of the file itself, if the client accepts its encoding.
+        void select_precompressed_file()
+        {
+            if (res.file_info.statResult != 0 || !res.get_header_value(known_header::content_encoding).empty())
+                return;
+
+            vary_on_accept_encoding();
+            const std::string& header = req_.get_header_value(known_header::accept_encoding);
+            if (header.empty())
+                return;
+
+            utility::accept_encoding accepted(header);
+            const auto& encodings = handler_->precompressed_static();
+            std::vector<float> quality(encodings.size());
+            for (size_t i = 0; i < encodings.size(); i++)
+                quality[i] = accepted.quality(encodings[i].first);
+
+            // Try the client's favorite encoding first (ties go to the app's order), until one of the files exists
+            while (true)
+            {
+                size_t best = 0;
+                for (size_t i = 1; i < encodings.size(); i++)
+                {
+                    if (quality[i] > quality[best])
+                        best = i;
+                }
+                if (quality[best] <= 0)
+                    return;
+                quality[best] = 0;
+
+                // A cached file's siblings come from the cache too
+                std::string path = res.file_info.path + encodings[best].second;
+                std::shared_ptr<const static_file_cache::entry> cached;
+                struct stat statbuf;
+                bool found;
+                if (res.file_info.data && (cached = handler_->static_cache()->get(path)))
+                {
+                    found = cached->exists;
+                    statbuf = cached->statbuf;
+                }
+                else
+                {
+                    found = stat(path.c_str(), &statbuf) == 0 && S_ISREG(statbuf.st_mode);
+                }
+
+                // Siblings older than the file itself are out of date
+                if (found && statbuf.st_mtime >= res.file_info.statbuf.st_mtime)
+                {
+                    res.file_info.path = std::move(path);
+                    res.file_info.statbuf = statbuf;
+                    res.file_info.data = cached ? cached->data : nullptr;
+                    res.set_header(known_header::content_length, std::to_string(statbuf.st_size));
+                    res.set_header(known_header::content_encoding, encodings[best].first);
+                    if (res.headers.count(known_header::etag))
+                        res.set_header(known_header::etag, static_file_cache::etag(statbuf));
+                    return;
+                }
+            }
+        }
+
+#ifdef CROW_ENABLE_COMPRESSION
+        /// Compress and send the body 16KB at a time using chunked transfer encoding, so only one compressed chunk is held in memory.
+        void do_write_compressed_stream()
+        {
+#ifdef CROW_ENABLE_ZSTD
+            if (stream_algorithm_ == compression::ZSTD)
+            {
+                do_write_compressed_stream(compression::zstd_compressor::this_thread());
+                return;
+            }
+#endif
+            do_write_compressed_stream(compression::deflater::this_thread());
+        }
+
+        template<typename Compressor>
+        void do_write_compressed_stream(Compressor& compressor)
+        {
+            bool ok = compressor.begin(stream_algorithm_, handler_->compression_options());
+            compress_stream_ = false;
+
+            static const std::string last_chunk = "0\r\n\r\n";
+            int flush = res.flush_compressed_chunks ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+            std::string compressed;
+            char chunk_size[20];
+            std::vector<asio::const_buffer> buffers{3};
+
+            for (size_t offset = 0; ok && offset < res.body.length(); offset += 16384)
+            {
+                size_t size = std::min<size_t>(16384, res.body.length() - offset);
+                bool last = offset + size == res.body.length();
+
+                compressed.clear();
+                ok = compressor.write(res.body.data() + offset, size, last ? Z_FINISH : flush, compressed);
+                if (compressed.empty())
+                    continue; // The compressor kept everything in its buffer, an empty chunk would end the body
+
+                buffers[0] = asio::buffer(chunk_size, snprintf(chunk_size, sizeof(chunk_size), "%lx\r\n", static_cast<unsigned long>(compressed.size())));
+                buffers[1] = asio::buffer(compressed);
+                buffers[2] = asio::buffer(crlf);
+                do_write_sync(buffers);
+            }
+            res.body.clear();
+
+            if (ok)
+            {
+                std::vector<asio::const_buffer> end{asio::buffer(last_chunk)};
+                do_write_sync(end);
+            }
+            else
+            {
+                // The body can't be terminated properly, make sure the client doesn't take it as complete
+                CROW_LOG_ERROR << this << " compressing a streamed response failed";
+                close_connection_ = true;
+            }
+        }
+#endif
+
         void do_read()
         {
             auto self = this->shared_from_this();
@@ -480,11 +1004,24 @@ namespace crow
                   bool error_while_reading = true;
                   if (!ec)
                   {
+                      if (self->server_metrics_)
+                          self->server_metrics_->read(bytes_transferred);
                       bool ret = self->parser_.feed(self->buffer_.data(), bytes_transferred);
                       if (ret && self->adaptor_.is_open())
                       {
                           error_while_reading = false;
                       }
+                      else if (self->parser_.limit_error && self->adaptor_.is_open())
+                      {
+                          // The connection is closed once the response is written, the rest of the request is never read
+                          self->cancel_deadline_timer();
+                          self->reject_request(self->parser_.limit_error);
+                          return;
+                      }
+                      else if (!ret && self->server_metrics_)
+                      {
+                          self->server_metrics_->parser_error(self->parser_.http_errno);
+                      }
                   }
 
                   if (error_while_reading)
@@ -495,31 +1032,40 @@ namespace crow
                       self->adaptor_.close();
                       CROW_LOG_DEBUG << self << " from read(1) with description: \"" << http_errno_description(static_cast<http_errno>(self->parser_.http_errno)) << '\"';
                   }
-                  else if (self->close_connection_)
-                  {
-                      self->cancel_deadline_timer();
-                      self->parser_.done();
-                      // adaptor will close after write
-                  }
-                  else if (!self->need_to_call_after_handlers_)
-                  {
-                      self->start_deadline();
-                      self->do_read();
-                  }
-                  else
+                  else if (!self->expectation_pending_) // Otherwise reading resumes once the expectation is answered
                   {
-                      // res will be completed later by user
-                      self->need_to_start_read_after_complete_ = true;
+                      self->continue_reading();
                   }
               });
         }
 
+        void continue_reading()
+        {
+            if (close_connection_)
+            {
+                cancel_deadline_timer();
+                parser_.done();
+                // adaptor will close after write
+            }
+            else if (!need_to_call_after_handlers_)
+            {
+                start_deadline();
+                do_read();
+            }
+            else
+            {
+                // res will be completed later by user
+                need_to_start_read_after_complete_ = true;
+            }
+        }
+
         void do_write()
         {
             auto self = this->shared_from_this();
             asio::async_write(
               adaptor_.socket(), buffers_,
-              [self](const asio::error_code& ec, std::size_t /*bytes_transferred*/) {
+              [self](const asio::error_code& ec, std::size_t bytes_transferred) {
+                  self->count_written(bytes_transferred);
                   self->res.clear();
                   self->res_body_copy_.clear();
                   self->parser_.clear();
@@ -542,7 +1088,7 @@ namespace crow
         inline void do_write_sync(std::vector<asio::const_buffer>& buffers)
         {
 
-            asio::write(adaptor_.socket(), buffers, [&](asio::error_code ec, std::size_t) {
+            size_t written = asio::write(adaptor_.socket(), buffers, [&](asio::error_code ec, std::size_t) {
                 if (!ec)
                 {
                     return false;
@@ -554,6 +1100,13 @@ namespace crow
                     return true;
                 }
             });
+            count_written(written);
+        }
+
+        void count_written(size_t bytes)
+        {
+            if (server_metrics_)
+                server_metrics_->written(bytes);
         }
 
         void cancel_deadline_timer()
@@ -572,6 +1125,8 @@ namespace crow
                 {
                     return;
                 }
+                if (self->server_metrics_)
+                    self->server_metrics_->timeout();
                 self->adaptor_.shutdown_readwrite();
                 self->adaptor_.close();
             });
@@ -600,19 +1155,35 @@ namespace crow
 
         detail::task_timer::identifier_type task_id_{};
 
+        std::chrono::steady_clock::time_point request_start_;
+        size_t requests_served_{};
+        bool started_{};
+        tcp::endpoint peer_;       ///< The client's address, from the socket or the PROXY protocol header.
+        std::string peer_address_; ///< `peer_`'s address as text, formatted for the connection's first request.
+        bool has_peer_{};          ///< Whether `peer_` is known, looking it up fails if the client is already gone.
+
         bool need_to_call_after_handlers_{};
+        bool expectation_pending_{}; ///< Waiting for an `Expect: 100-continue` handler to answer.
+        bool message_waiting_{};     ///< The request was fully read while its expectation was pending.
         bool need_to_start_read_after_complete_{};
         bool add_keep_alive_{};
 
         std::tuple<Middlewares...>* middlewares_;
         detail::context<Middlewares...> ctx_;
 
-        std::function<std::string()>& get_cached_date_str;
+        std::function<const std::string&()>& get_cached_date_str;
         detail::task_timer& task_timer_;
 
         size_t res_stream_threshold_;
+        bool compress_stream_{false};
+#ifdef CROW_ENABLE_COMPRESSION
+        compression::algorithm stream_algorithm_;
+#endif
 
         std::atomic<unsigned int>& queue_length_;
+        metrics::server_metrics* server_metrics_;
+        access_log* access_log_;
+        access_log::entry access_entry_{};
     };
 
 } // namespace crow
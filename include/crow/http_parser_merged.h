@@ -37,6 +37,22 @@ typedef unsigned __int64 uint64_t;
 #include <limits.h>
 }
 
+/* The header field, header value and URL loops skip ordinary characters 16
+ * (SSE4.2) or 32 (AVX2) bytes at a time when the compiler targets those
+ * instruction sets (-msse4.2, -mavx2, -march=native, /arch:AVX2). Define
+ * CROW_DISABLE_SIMD_PARSER to always use the byte-at-a-time loops.
+ */
+#if !defined(CROW_DISABLE_SIMD_PARSER) && (defined(__SSE4_2__) || defined(__AVX2__))
+# define CROW_PARSER_SSE42
+# if defined(__AVX2__)
+#  define CROW_PARSER_AVX2
+# endif
+# include <immintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+# endif
+#endif
+
 #include "crow/common.h"
 namespace crow
 {
@@ -470,6 +486,61 @@ do {                                                                 \
 } while (0)
 #define CROW_NEW_MESSAGE() (CROW_start_state)
 
+/* Find the first character of [p, end) that falls in one of the inclusive
+ * ranges listed in `ranges` (pairs of bounds, `ranges_size` bytes, read as a
+ * 16 byte block). Only whole blocks are checked, so the result can be any
+ * position before the first match: the caller goes on with its regular loop
+ * from there, stopping early is always safe.
+ */
+inline const char* find_range_char(const char* p, const char* end, const char* ranges, int ranges_size)
+{
+#ifdef CROW_PARSER_AVX2
+  while (end - p >= 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i found = _mm256_setzero_si256();
+    for (int i = 0; i < ranges_size; i += 2) {
+      /* Unsigned lo <= c && c <= hi */
+      __m256i above = _mm256_cmpeq_epi8(_mm256_max_epu8(block, _mm256_set1_epi8(ranges[i])), block);
+      __m256i below = _mm256_cmpeq_epi8(_mm256_min_epu8(block, _mm256_set1_epi8(ranges[i + 1])), block);
+      found = _mm256_or_si256(found, _mm256_and_si256(above, below));
+    }
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(found));
+    if (mask) {
+# ifdef _MSC_VER
+      unsigned long index;
+      _BitScanForward(&index, mask);
+      return p + index;
+# else
+      return p + __builtin_ctz(mask);
+# endif
+    }
+    p += 32;
+  }
+#endif
+#ifdef CROW_PARSER_SSE42
+  __m128i range_block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ranges));
+  while (end - p >= 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    int index = _mm_cmpestri(range_block, ranges_size, block, 16, _SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES | _SIDD_UBYTE_OPS);
+    if (index != 16)
+      return p + index;
+    p += 16;
+  }
+#else
+  (void)end;
+  (void)ranges;
+  (void)ranges_size;
+#endif
+  return p;
+}
+
+/* Characters that end a run of find_range_char() (always 16 readable bytes). */
+static const char header_value_stop_ranges[17] = "\x00\x08\x0a\x1f\x7f\x7f";
+/* Separators and non-ASCII bytes ('|' and '~' are tokens, they only stop the fast path) */
+static const char token_stop_ranges[17] = "\x00\x20\"\"(),,//:@[]{\xff";
+static const char path_stop_ranges[17] = "\x00\x20##??\x7f\xff";
+static const char query_string_stop_ranges[17] = "\x00\x20##\x7f\xff";
+
 /* Our URL parser.
  *
  * This is designed to be shared by http_parser_execute() for URL validation,
@@ -911,6 +982,16 @@ reexecute:
       case s_req_query_string_start:
       case s_req_query_string:
       {
+        if (parser->state == s_req_path || parser->state == s_req_query_string) {
+          /* Skip to the next character that could change the state, the last one is always left to the loop */
+          const char* next = parser->state == s_req_path ?
+            find_range_char(p, data + len - 1, path_stop_ranges, 8) :
+            find_range_char(p, data + len - 1, query_string_stop_ranges, 6);
+          CROW_COUNT_HEADER_SIZE(next - p);
+          p = next;
+          ch = *p;
+        }
+
         switch (ch) {
           case ' ':
             parser->state = s_req_http_start;
@@ -1117,6 +1198,7 @@ reexecute:
             case h_general: {
               size_t left = data + len - p;
               const char* pe = p + CROW_MIN(left, max_header_size);
+              p = find_range_char(p + 1, pe, token_stop_ranges, 16) - 1;
               while (p+1 < pe && CROW_TOKEN(p[1])) {
                 p++;
               }
@@ -1366,6 +1448,7 @@ reexecute:
                 size_t left = data + len - p;
                 const char* pe = p + CROW_MIN(left, max_header_size);
 
+                p = find_range_char(p, pe, header_value_stop_ranges, 6);
                 for (; p != pe; p++) {
                   ch = *p;
                   if (ch == cr || ch == lf) {
@@ -15,14 +15,39 @@ namespace crow
     template<typename T>
     inline const std::string& get_header_value(const T& headers, const std::string& key)
     {
-        if (headers.count(key))
+        auto it = headers.find(key);
+        if (it != headers.end())
         {
-            return headers.find(key)->second;
+            return it->second;
         }
         static std::string empty;
         return empty;
     }
 
+    /// Find and return the value of a known header without hashing its name. (returns an empty string if nothing is found)
+    inline const std::string& get_header_value(const ci_map& headers, known_header key)
+    {
+        auto it = headers.find(key);
+        if (it != headers.end())
+        {
+            return it->second;
+        }
+        static std::string empty;
+        return empty;
+    }
+
+    namespace detail
+    {
+        /// Empty a request or response body that's reused for the next message on the connection. A large body isn't kept for the rest of the connection.
+        inline void clear_reused_body(std::string& body)
+        {
+            if (body.capacity() > CROW_REUSED_BODY_CAPACITY)
+                std::string().swap(body);
+            else
+                body.clear();
+        }
+    } // namespace detail
+
     /// An HTTP request.
     struct request
     {
@@ -52,6 +77,21 @@ namespace crow
           method(method), raw_url(std::move(raw_url)), url(std::move(url)), url_params(std::move(url_params)), headers(std::move(headers)), body(std::move(body)), http_ver_major(http_major), http_ver_minor(http_minor), keep_alive(has_keep_alive), close_connection(has_close_connection), upgrade(is_upgrade)
         {}
 
+        /// Reset the request so the connection can parse its next one into it, its strings and headers keep their storage.
+        void clear()
+        {
+            method = HTTPMethod::Get;
+            raw_url.clear();
+            url.clear();
+            url_params.clear();
+            headers.clear();
+            detail::clear_reused_body(body);
+            remote_ip_address.clear();
+            middleware_context = nullptr;
+            middleware_container = nullptr;
+            io_service = nullptr;
+        }
+
         void add_header(std::string key, std::string value)
         {
             headers.emplace(std::move(key), std::move(value));
@@ -62,6 +102,11 @@ namespace crow
             return crow::get_header_value(headers, key);
         }
 
+        const std::string& get_header_value(known_header key) const
+        {
+            return crow::get_header_value(headers, key);
+        }
+
         bool check_version(unsigned char major, unsigned char minor) const
         {
             return http_ver_major == major && http_ver_minor == minor;
@@ -1,6 +1,10 @@
 #pragma once
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <ios>
 #include <fstream>
 #include <sstream>
@@ -19,6 +23,7 @@
 #include "crow/socket_adaptors.h"
 #include "crow/logging.h"
 #include "crow/mime_types.h"
+#include "crow/static_file_cache.h"
 #include "crow/returnable.h"
 
 
@@ -29,6 +34,25 @@ namespace crow
 
     class Router;
 
+    struct response;
+
+    namespace detail
+    {
+        /// Type erased calls into a single middleware's `before_handle` and `after_handle`.
+        struct middleware_dispatch_entry
+        {
+            void (*before)(request&, response&);
+            void (*after)(request&, response&);
+        };
+
+        struct middleware_plan;
+    } // namespace detail
+
+    namespace metrics
+    {
+        class route_metrics;
+    }
+
     /// HTTP response
     struct response
     {
@@ -43,6 +67,7 @@ namespace crow
 
 #ifdef CROW_ENABLE_COMPRESSION
         bool compressed = true; ///< If compression is enabled and this is false, the individual response will not be compressed.
+        bool flush_compressed_chunks = false; ///< If a large body is compressed while it's being streamed, make every chunk decompressible as soon as it arrives (at some cost in size).
 #endif
         bool skip_body = false;            ///< Whether this is a response to a HEAD request.
         bool manual_length_header = false; ///< Whether Crow should automatically add a "Content-Length" header.
@@ -50,8 +75,12 @@ namespace crow
         /// Set the value of an existing header in the response.
         void set_header(std::string key, std::string value)
         {
-            headers.erase(key);
-            headers.emplace(std::move(key), std::move(value));
+            headers.set(std::move(key), std::move(value));
+        }
+
+        void set_header(known_header key, std::string value)
+        {
+            headers.set(key, std::move(value));
         }
 
         /// Add a new header to the response.
@@ -60,11 +89,21 @@ namespace crow
             headers.emplace(std::move(key), std::move(value));
         }
 
+        void add_header(known_header key, std::string value)
+        {
+            headers.emplace(known_header_name(key), std::move(value));
+        }
+
         const std::string& get_header_value(const std::string& key)
         {
             return crow::get_header_value(headers, key);
         }
 
+        const std::string& get_header_value(known_header key)
+        {
+            return crow::get_header_value(headers, key);
+        }
+
         // naive validation of a mime-type string
         static bool validate_mime_type(const std::string& candidate) noexcept
         {
@@ -125,51 +164,61 @@ namespace crow
         response(returnable&& value)
         {
             body = value.dump();
-            set_header("Content-Type", value.content_type);
+            set_header(known_header::content_type, value.content_type);
         }
         response(returnable& value)
         {
             body = value.dump();
-            set_header("Content-Type", value.content_type);
+            set_header(known_header::content_type, value.content_type);
         }
         response(int code, returnable& value):
           code(code)
         {
             body = value.dump();
-            set_header("Content-Type", value.content_type);
+            set_header(known_header::content_type, value.content_type);
         }
         response(int code, returnable&& value):
           code(code), body(value.dump())
         {
-            set_header("Content-Type", std::move(value.content_type));
+            set_header(known_header::content_type, std::move(value.content_type));
         }
 
-        response(response&& r)
+        response(response&& r):
+          code(r.code), body(std::move(r.body)), headers(std::move(r.headers)), completed_(r.completed_), file_info(std::move(r.file_info))
         {
-            *this = std::move(r);
+#ifdef CROW_ENABLE_COMPRESSION
+            flush_compressed_chunks = r.flush_compressed_chunks;
+#endif
         }
 
         response(std::string contentType, std::string body):
           body(std::move(body))
         {
-            set_header("Content-Type", get_mime_type(contentType));
+            set_header(known_header::content_type, get_mime_type(contentType));
         }
 
         response(int code, std::string contentType, std::string body):
           code(code), body(std::move(body))
         {
-            set_header("Content-Type", get_mime_type(contentType));
+            set_header(known_header::content_type, get_mime_type(contentType));
         }
 
         response& operator=(const response& r) = delete;
 
-        response& operator=(response&& r) noexcept
+        response& operator=(response&& r)
         {
             body = std::move(r.body);
             code = r.code;
-            headers = std::move(r.headers);
+            // The headers are moved one by one, so this response's map keeps its storage (which can allocate, so this isn't noexcept)
+            headers.clear();
+            for (auto& header : r.headers)
+                headers.emplace(std::move(header.first), std::move(header.second));
+            r.headers.clear();
             completed_ = r.completed_;
             file_info = std::move(r.file_info);
+#ifdef CROW_ENABLE_COMPRESSION
+            flush_compressed_chunks = r.flush_compressed_chunks;
+#endif
             return *this;
         }
 
@@ -181,11 +230,17 @@ namespace crow
 
         void clear()
         {
-            body.clear();
+            detail::clear_reused_body(body);
             code = 200;
             headers.clear();
             completed_ = false;
             file_info = static_file_info{};
+            local_middleware_plan_ = nullptr;
+            local_middleware_request_ = nullptr;
+            route_metrics_ = nullptr;
+#ifdef CROW_ENABLE_COMPRESSION
+            flush_compressed_chunks = false;
+#endif
         }
 
         /// Return a "Temporary Redirect" response.
@@ -195,7 +250,7 @@ namespace crow
         void redirect(const std::string& location)
         {
             code = 307;
-            set_header("Location", location);
+            set_header(known_header::location, location);
         }
 
         /// Return a "Permanent Redirect" response.
@@ -205,7 +260,7 @@ namespace crow
         void redirect_perm(const std::string& location)
         {
             code = 308;
-            set_header("Location", location);
+            set_header(known_header::location, location);
         }
 
         /// Return a "Found (Moved Temporarily)" response.
@@ -215,7 +270,7 @@ namespace crow
         void moved(const std::string& location)
         {
             code = 302;
-            set_header("Location", location);
+            set_header(known_header::location, location);
         }
 
         /// Return a "Moved Permanently" response.
@@ -225,7 +280,7 @@ namespace crow
         void moved_perm(const std::string& location)
         {
             code = 301;
-            set_header("Location", location);
+            set_header(known_header::location, location);
         }
 
         void write(const std::string& body_part)
@@ -241,10 +296,11 @@ namespace crow
                 completed_ = true;
                 if (skip_body)
                 {
-                    set_header("Content-Length", std::to_string(body.size()));
+                    set_header(known_header::content_length, std::to_string(body.size()));
                     body = "";
                     manual_length_header = true;
                 }
+                call_local_after_handlers();
                 if (complete_request_handler_)
                 {
                     complete_request_handler_();
@@ -280,6 +336,17 @@ namespace crow
             std::string path = "";
             struct stat statbuf;
             int statResult;
+            std::shared_ptr<const std::string> data; ///< The file's content, if it comes from a \ref static_file_cache.
+
+            /// A part of the file sent in answer to a `Range` request.
+            struct range
+            {
+                std::string header; ///< Sent before the bytes (the part's headers in a multipart response).
+                uint64_t offset;
+                uint64_t size;
+            };
+            std::vector<range> ranges;  ///< The parts of the file to send, the whole file if empty.
+            std::string ranges_trailer; ///< Sent after the last part (the closing multipart boundary).
         };
 
         /// Return a static file as the response body
@@ -302,11 +369,14 @@ namespace crow
                 std::size_t last_dot = path.find_last_of(".");
                 std::string extension = path.substr(last_dot + 1);
                 code = 200;
-                this->add_header("Content-Length", std::to_string(file_info.statbuf.st_size));
+                this->add_header(known_header::content_length, std::to_string(file_info.statbuf.st_size));
+                this->add_header(known_header::etag, static_file_cache::etag(file_info.statbuf));
+                this->add_header(known_header::last_modified, static_file_cache::http_date(file_info.statbuf.st_mtime));
+                this->add_header(known_header::accept_ranges, "bytes");
 
                 if (!extension.empty())
                 {
-                    this->add_header("Content-Type", get_mime_type(extension));
+                    this->add_header(known_header::content_type, get_mime_type(extension));
                 }
             }
             else
@@ -316,10 +386,153 @@ namespace crow
             }
         }
 
+        /// Return a file held by a \ref static_file_cache as the response body
+
+        ///
+        /// The path isn't opened, it's only used to find precompressed versions of the file.
+        void set_static_file_info_cached(const std::string& path, const static_file_cache::entry& cached)
+        {
+#ifdef CROW_ENABLE_COMPRESSION
+            compressed = false;
+#endif
+            if (cached.exists)
+            {
+                file_info.path = path;
+                file_info.statbuf = cached.statbuf;
+                file_info.statResult = 0;
+                file_info.data = cached.data;
+                code = 200;
+                this->add_header(known_header::content_length, cached.content_length);
+                this->add_header(known_header::content_type, cached.content_type);
+                this->add_header(known_header::etag, cached.etag);
+                this->add_header(known_header::last_modified, cached.last_modified);
+                this->add_header(known_header::accept_ranges, "bytes");
+            }
+            else
+            {
+                code = 404;
+                file_info.path.clear();
+                file_info.statResult = -1;
+            }
+        }
+
     private:
+        /// Call the `after_handle` of the rule's local middleware (before the completion handler, which calls the global ones).
+        void call_local_after_handlers();
+
         bool completed_{};
         std::function<void()> complete_request_handler_;
         std::function<bool()> is_alive_helper_;
         static_file_info file_info;
+        const detail::middleware_plan* local_middleware_plan_{}; ///< Local middleware whose `after_handle` still needs to be called once the response completes.
+        request* local_middleware_request_{};
+        metrics::route_metrics* route_metrics_{}; ///< Where to record this response's metrics, set when the matched rule collects them.
+    };
+
+    namespace detail
+    {
+        /// The local middleware of a rule (including its blueprints' middleware), resolved once the router is validated.
+        struct middleware_plan
+        {
+            std::vector<middleware_dispatch_entry> entries;
+
+            bool empty() const
+            {
+                return entries.empty();
+            }
+
+            /// Call `before_handle` on every middleware in order.
+
+            ///
+            /// If a middleware completes the response, the `after_handle` of the middleware that already ran is called and `true` is returned.
+            bool before(request& req, response& res) const
+            {
+                for (size_t i = 0; i < entries.size(); i++)
+                {
+                    entries[i].before(req, res);
+                    if (res.is_completed())
+                    {
+                        after(req, res, i + 1);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            /// Call `after_handle` on the first `count` middleware in reverse order.
+            void after(request& req, response& res, size_t count) const
+            {
+                while (count > 0)
+                    entries[--count].after(req, res);
+            }
+
+            void after(request& req, response& res) const
+            {
+                after(req, res, entries.size());
+            }
+        };
+    } // namespace detail
+
+    inline void response::call_local_after_handlers()
+    {
+        if (local_middleware_plan_)
+        {
+            const detail::middleware_plan* plan = local_middleware_plan_;
+            local_middleware_plan_ = nullptr;
+            plan->after(*local_middleware_request_, *this);
+        }
+    }
+
+    /// The answer to a request sent with `Expect: 100-continue`, given before its body is read.
+
+    ///
+    /// `accept()` tells the client to send the body, and the request is handled as usual once it's read. `reject()` answers the request without reading its body, and closes the connection.<br>
+    /// Either one can be called later and from any thread (copies of the expectation can be kept until then), as long as it's within the app's timeout. If neither is called, the body is accepted once the last copy is destroyed.
+    class expectation
+    {
+    public:
+        /// Called once with the response the request is rejected with, or `nullptr` if its body is accepted.
+        using decide_function = std::function<void(std::shared_ptr<response>)>;
+
+        explicit expectation(decide_function decide):
+          state_(std::make_shared<state>(std::move(decide)))
+        {}
+
+        void accept()
+        {
+            state_->decide(nullptr);
+        }
+
+        void reject(response res)
+        {
+            state_->decide(std::make_shared<response>(std::move(res)));
+        }
+
+    private:
+        struct state
+        {
+            explicit state(decide_function decide):
+              decide_(std::move(decide))
+            {}
+
+            ~state()
+            {
+                decide(nullptr);
+            }
+
+            void decide(std::shared_ptr<response> rejection)
+            {
+                if (!decided_.exchange(true))
+                    decide_(std::move(rejection));
+            }
+
+            decide_function decide_;
+            std::atomic<bool> decided_{false};
+        };
+
+        std::shared_ptr<state> state_;
     };
+
+    /// Decides whether requests sent with `Expect: 100-continue` should send their body, by calling `accept()` or `reject()` on the \ref expectation.
+    using expectation_handler = std::function<void(const request&, expectation)>;
 } // namespace crow
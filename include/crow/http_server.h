@@ -18,6 +18,7 @@
 #include "crow/http_connection.h"
 #include "crow/logging.h"
 #include "crow/task_timer.h"
+#include "crow/metrics.h"
 
 namespace crow
 {
@@ -28,6 +29,7 @@ namespace crow
     {
     public:
         Server(Handler* handler, std::string bindaddr, uint16_t port, std::string server_name = std::string("Crow/") + VERSION, std::tuple<Middlewares...>* middlewares = nullptr, uint16_t concurrency = 1, uint8_t timeout = 5, typename Adaptor::context* adaptor_ctx = nullptr):
+          task_queue_length_pool_(concurrency - 1),
           acceptor_(io_service_, tcp::endpoint(asio::ip::address::from_string(bindaddr), port)),
           signals_(io_service_),
           tick_timer_(io_service_),
@@ -37,7 +39,6 @@ namespace crow
           server_name_(server_name),
           port_(port),
           bindaddr_(bindaddr),
-          task_queue_length_pool_(concurrency_ - 1),
           middlewares_(middlewares),
           adaptor_ctx_(adaptor_ctx)
         {}
@@ -91,7 +92,7 @@ namespace crow
                             date_str.resize(date_str_sz);
                         };
                         update_date_str();
-                        get_cached_date_str_pool_[i] = [&]() -> std::string {
+                        get_cached_date_str_pool_[i] = [&]() -> const std::string& {
                             if (std::chrono::steady_clock::now() - last >= std::chrono::seconds(1))
                             {
                                 last = std::chrono::steady_clock::now();
@@ -105,6 +106,13 @@ namespace crow
                         task_timer.set_default_timeout(timeout_);
                         task_timer_pool_[i] = &task_timer;
                         task_queue_length_pool_[i] = 0;
+                        detail::this_thread_worker() = i;
+                        if (metrics::server_metrics* server_metrics = handler_->server_metrics_collector())
+                        {
+                            task_timer.set_tick_observer([server_metrics](std::chrono::nanoseconds lag) {
+                                server_metrics->loop_lag(lag);
+                            });
+                        }
 
                         init_count++;
                         while (1)
@@ -185,6 +193,15 @@ namespace crow
                 cv_started_.wait(lock);
         }
 
+        /// Get the number of connections each worker is currently serving.
+        std::vector<unsigned> active_connections() const
+        {
+            std::vector<unsigned> result;
+            for (auto& queue_length : task_queue_length_pool_)
+                result.push_back(queue_length.load(std::memory_order_relaxed));
+            return result;
+        }
+
         void signal_clear()
         {
             signals_.clear();
@@ -218,8 +235,6 @@ namespace crow
             {
                 uint16_t service_idx = pick_io_service_idx();
                 asio::io_service& is = *io_service_pool_[service_idx];
-                task_queue_length_pool_[service_idx]++;
-                CROW_LOG_DEBUG << &is << " {" << service_idx << "} queue length: " << task_queue_length_pool_[service_idx];
 
                 auto p = std::make_shared<Connection<Adaptor, Handler, Middlewares...>>(
                   is, handler_, server_name_, middlewares_,
@@ -230,16 +245,17 @@ namespace crow
                   [this, p, &is, service_idx](asio::error_code ec) {
                       if (!ec)
                       {
+                          // The connection gives its slot back once it's destroyed
+                          task_queue_length_pool_[service_idx]++;
+                          CROW_LOG_DEBUG << &is << " {" << service_idx << "} queue length: " << task_queue_length_pool_[service_idx];
+                          if (metrics::server_metrics* server_metrics = handler_->server_metrics_collector())
+                              server_metrics->accepted();
+
                           is.post(
                             [p] {
                                 p->start();
                             });
                       }
-                      else
-                      {
-                          task_queue_length_pool_[service_idx]--;
-                          CROW_LOG_DEBUG << &is << " {" << service_idx << "} queue length: " << task_queue_length_pool_[service_idx];
-                      }
                       do_accept();
                   });
             }
@@ -254,10 +270,12 @@ namespace crow
         }
 
     private:
+        // Connections decrease their worker's queue length when they're freed, which can happen while the io_services below are destroyed
+        std::vector<std::atomic<unsigned int>> task_queue_length_pool_;
         asio::io_service io_service_;
         std::vector<std::unique_ptr<asio::io_service>> io_service_pool_;
         std::vector<detail::task_timer*> task_timer_pool_;
-        std::vector<std::function<std::string()>> get_cached_date_str_pool_;
+        std::vector<std::function<const std::string&()>> get_cached_date_str_pool_;
         tcp::acceptor acceptor_;
         bool shutting_down_ = false;
         bool server_started_{false};
@@ -273,7 +291,6 @@ namespace crow
         std::string server_name_;
         uint16_t port_;
         std::string bindaddr_;
-        std::vector<std::atomic<unsigned int>> task_queue_length_pool_;
 
         std::chrono::milliseconds tick_interval_;
         std::function<void()> tick_function_;
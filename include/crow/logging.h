@@ -1,13 +1,21 @@
 #pragma once
 
 #include "crow/settings.h"
+#include "crow/ring_buffer.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 
 namespace crow
 {
@@ -38,39 +46,30 @@ namespace crow
         virtual void log(std::string message, LogLevel level) = 0;
     };
 
-    class CerrLogHandler : public ILogHandler
+    namespace detail
     {
-    public:
-        void log(std::string message, LogLevel level) override
+        inline const char* log_level_prefix(LogLevel level)
         {
-            std::string prefix;
             switch (level)
             {
                 case LogLevel::Debug:
-                    prefix = "DEBUG   ";
-                    break;
+                    return "DEBUG   ";
                 case LogLevel::Info:
-                    prefix = "INFO    ";
-                    break;
+                    return "INFO    ";
                 case LogLevel::Warning:
-                    prefix = "WARNING ";
-                    break;
+                    return "WARNING ";
                 case LogLevel::Error:
-                    prefix = "ERROR   ";
-                    break;
+                    return "ERROR   ";
                 case LogLevel::Critical:
-                    prefix = "CRITICAL";
-                    break;
+                    return "CRITICAL";
             }
-            std::cerr << std::string("(") + timestamp() + std::string(") [") + prefix + std::string("] ") + message << std::endl;
+            return "";
         }
 
-    private:
-        static std::string timestamp()
+        /// Format a time the way log lines are timestamped.
+        inline std::string log_timestamp(time_t t)
         {
             char date[32];
-            time_t t = time(0);
-
             tm my_tm;
 
 #if defined(_MSC_VER) || defined(__MINGW32__)
@@ -90,6 +89,167 @@ namespace crow
             size_t sz = strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &my_tm);
             return std::string(date, date + sz);
         }
+    } // namespace detail
+
+    class CerrLogHandler : public ILogHandler
+    {
+    public:
+        void log(std::string message, LogLevel level) override
+        {
+            std::cerr << std::string("(") + detail::log_timestamp(time(0)) + std::string(") [") + detail::log_level_prefix(level) + std::string("] ") + message << std::endl;
+        }
+    };
+
+    /// A log handler that moves formatting and writing log lines off the logging thread.
+
+    ///
+    /// Messages are queued in a fixed size lock-free ring buffer, a background thread then writes them in batches (in the same format as `CerrLogHandler`).<br>
+    /// When the buffer is full messages are either dropped (and counted) or the logging thread waits for space, depending on the `overflow_policy`.<br>
+    /// The handler has to outlive any use of it, use `crow::logger::setHandler()` to install it.
+    class AsyncLogHandler : public ILogHandler
+    {
+    public:
+        enum class overflow_policy
+        {
+            drop,
+            block,
+        };
+
+        /// \param out Where log lines are written, only the background thread uses it.
+        /// \param capacity The number of messages the buffer can hold, rounded up to a power of 2.
+        AsyncLogHandler(std::ostream& out = std::cerr, size_t capacity = 8192, overflow_policy policy = overflow_policy::drop):
+          out_(out), policy_(policy), queue_(capacity)
+        {
+            flusher_ = std::thread([this] {
+                flush_loop();
+            });
+        }
+
+        /// Write everything still queued and stop the background thread.
+        ~AsyncLogHandler()
+        {
+            stopping_.store(true, std::memory_order_release);
+            wakeup_.notify_one();
+            flusher_.join();
+        }
+
+        void log(std::string message, LogLevel level) override
+        {
+            entry e{std::move(message), level, time(0)};
+            while (!queue_.try_push(e))
+            {
+                if (policy_ == overflow_policy::drop)
+                {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                wakeup_.notify_one();
+                std::this_thread::yield();
+            }
+            if (flusher_waiting_.load(std::memory_order_relaxed))
+                wakeup_.notify_one();
+        }
+
+        /// Wait until every message logged before this call is written.
+        void flush()
+        {
+            size_t target = queue_.push_count();
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (written_.load(std::memory_order_acquire) < target)
+            {
+                wakeup_.notify_one();
+                flushed_.wait_for(lock, std::chrono::milliseconds(10));
+            }
+        }
+
+        /// The number of messages dropped because the buffer was full.
+        uint64_t dropped() const
+        {
+            return dropped_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        struct entry
+        {
+            std::string message;
+            LogLevel level;
+            time_t time;
+        };
+
+        void flush_loop()
+        {
+            std::string batch;
+            std::string timestamp;
+            time_t timestamp_time = 0;
+            uint64_t dropped_reported = 0;
+            size_t written = 0;
+            entry e;
+
+            while (true)
+            {
+                bool stopping = stopping_.load(std::memory_order_acquire);
+
+                batch.clear();
+                while (queue_.try_pop(e))
+                {
+                    // Only format the timestamp again when the second changes
+                    if (e.time != timestamp_time || timestamp.empty())
+                    {
+                        timestamp_time = e.time;
+                        timestamp = detail::log_timestamp(e.time);
+                    }
+                    batch += '(';
+                    batch += timestamp;
+                    batch += ") [";
+                    batch += detail::log_level_prefix(e.level);
+                    batch += "] ";
+                    batch += e.message;
+                    batch += '\n';
+                    written++;
+                }
+
+                uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+                if (dropped != dropped_reported)
+                {
+                    batch += "(" + detail::log_timestamp(time(0)) + ") [" + detail::log_level_prefix(LogLevel::Warning) + "] " + std::to_string(dropped - dropped_reported) + " log messages were dropped\n";
+                    dropped_reported = dropped;
+                }
+
+                if (!batch.empty())
+                {
+                    out_.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+                    out_.flush();
+                }
+
+                std::unique_lock<std::mutex> lock(mutex_);
+                written_.store(written, std::memory_order_release);
+                flushed_.notify_all();
+
+                if (batch.empty())
+                {
+                    if (stopping)
+                        break;
+                    // Producers only notify while this is set, the timeout covers a notification racing with it
+                    flusher_waiting_.store(true, std::memory_order_relaxed);
+                    wakeup_.wait_for(lock, std::chrono::milliseconds(10));
+                    flusher_waiting_.store(false, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        std::ostream& out_;
+        overflow_policy policy_;
+
+        detail::mpsc_ring_buffer<entry> queue_;
+        std::atomic<size_t> written_{0};
+        std::atomic<uint64_t> dropped_{0};
+
+        std::atomic<bool> stopping_{false};
+        std::atomic<bool> flusher_waiting_{false};
+        std::mutex mutex_;
+        std::condition_variable wakeup_;
+        std::condition_variable flushed_;
+        std::thread flusher_;
     };
 
     class logger
@@ -122,17 +282,17 @@ namespace crow
         }
 
         //
-        static void setLogLevel(LogLevel level) { get_log_level_ref() = level; }
+        static void setLogLevel(LogLevel level) { get_log_level_ref().store(level, std::memory_order_relaxed); }
 
         static void setHandler(ILogHandler* handler) { get_handler_ref() = handler; }
 
-        static LogLevel get_current_log_level() { return get_log_level_ref(); }
+        static LogLevel get_current_log_level() { return get_log_level_ref().load(std::memory_order_relaxed); }
 
     private:
         //
-        static LogLevel& get_log_level_ref()
+        static std::atomic<LogLevel>& get_log_level_ref()
         {
-            static LogLevel current_level = static_cast<LogLevel>(CROW_LOG_LEVEL);
+            static std::atomic<LogLevel> current_level{static_cast<LogLevel>(CROW_LOG_LEVEL)};
             return current_level;
         }
         static ILogHandler*& get_handler_ref()
@@ -148,18 +308,24 @@ namespace crow
     };
 } // namespace crow
 
-#define CROW_LOG_CRITICAL                                                  \
-    if (crow::logger::get_current_log_level() <= crow::LogLevel::Critical) \
-    crow::logger(crow::LogLevel::Critical)
-#define CROW_LOG_ERROR                                                  \
-    if (crow::logger::get_current_log_level() <= crow::LogLevel::Error) \
-    crow::logger(crow::LogLevel::Error)
-#define CROW_LOG_WARNING                                                  \
-    if (crow::logger::get_current_log_level() <= crow::LogLevel::Warning) \
-    crow::logger(crow::LogLevel::Warning)
-#define CROW_LOG_INFO                                                  \
-    if (crow::logger::get_current_log_level() <= crow::LogLevel::Info) \
-    crow::logger(crow::LogLevel::Info)
-#define CROW_LOG_DEBUG                                                  \
-    if (crow::logger::get_current_log_level() <= crow::LogLevel::Debug) \
-    crow::logger(crow::LogLevel::Debug)
+// Log statements below CROW_LOG_MIN_LEVEL are never executed, so the compiler removes them entirely
+#define CROW_LOG_CRITICAL                                                                                  \
+    if (CROW_LOG_MIN_LEVEL > 4 || crow::logger::get_current_log_level() > crow::LogLevel::Critical) {} \
+    else                                                                                                   \
+        crow::logger(crow::LogLevel::Critical)
+#define CROW_LOG_ERROR                                                                                  \
+    if (CROW_LOG_MIN_LEVEL > 3 || crow::logger::get_current_log_level() > crow::LogLevel::Error) {} \
+    else                                                                                                \
+        crow::logger(crow::LogLevel::Error)
+#define CROW_LOG_WARNING                                                                                  \
+    if (CROW_LOG_MIN_LEVEL > 2 || crow::logger::get_current_log_level() > crow::LogLevel::Warning) {} \
+    else                                                                                                  \
+        crow::logger(crow::LogLevel::Warning)
+#define CROW_LOG_INFO                                                                                  \
+    if (CROW_LOG_MIN_LEVEL > 1 || crow::logger::get_current_log_level() > crow::LogLevel::Info) {} \
+    else                                                                                               \
+        crow::logger(crow::LogLevel::Info)
+#define CROW_LOG_DEBUG                                                                                  \
+    if (CROW_LOG_MIN_LEVEL > 0 || crow::logger::get_current_log_level() > crow::LogLevel::Debug) {} \
+    else                                                                                                \
+        crow::logger(crow::LogLevel::Debug)
@@ -0,0 +1,468 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "crow/common.h"
+#include "crow/http_parser_merged.h"
+
+namespace crow
+{
+    namespace metrics
+    {
+        class route_metrics;
+
+        /// A log-linear (HDR style) histogram of durations in nanoseconds.
+
+        ///
+        /// Values below 8ns are counted exactly, every power of 2 above that is split into 8 linear buckets, which keeps the error under 12.5% up to ~36 minutes.
+        class latency_histogram
+        {
+        public:
+            static constexpr unsigned sub_bucket_bits = 3;
+            static constexpr unsigned sub_bucket_count = 1 << sub_bucket_bits;
+            static constexpr unsigned max_value_bits = 41;
+            static constexpr unsigned bucket_count = sub_bucket_count * (max_value_bits - sub_bucket_bits + 1);
+
+            /// Get the bucket a value is counted in, values beyond the range end up in the last bucket.
+            static unsigned bucket_index(uint64_t value)
+            {
+                if (value < sub_bucket_count)
+                    return static_cast<unsigned>(value);
+
+                unsigned msb = most_significant_bit(value);
+                if (msb >= max_value_bits)
+                    return bucket_count - 1;
+                return sub_bucket_count * (msb - sub_bucket_bits + 1) + static_cast<unsigned>((value >> (msb - sub_bucket_bits)) & (sub_bucket_count - 1));
+            }
+
+            /// The smallest value counted in a bucket.
+            static uint64_t bucket_lower_bound(unsigned index)
+            {
+                if (index < 2 * sub_bucket_count)
+                    return index;
+                unsigned msb = index / sub_bucket_count + sub_bucket_bits - 1;
+                return static_cast<uint64_t>(sub_bucket_count + index % sub_bucket_count) << (msb - sub_bucket_bits);
+            }
+
+            /// The value right after the largest one counted in a bucket.
+            static uint64_t bucket_upper_bound(unsigned index)
+            {
+                if (index < 2 * sub_bucket_count)
+                    return index + 1;
+                unsigned msb = index / sub_bucket_count + sub_bucket_bits - 1;
+                return bucket_lower_bound(index) + (static_cast<uint64_t>(1) << (msb - sub_bucket_bits));
+            }
+
+            void record(uint64_t value, uint64_t count = 1)
+            {
+                buckets_[bucket_index(value)] += count;
+                count_ += count;
+                sum_ += value * count;
+            }
+
+            /// Add another histogram's counts to this one.
+            latency_histogram& operator+=(const latency_histogram& other)
+            {
+                for (unsigned i = 0; i < bucket_count; i++)
+                    buckets_[i] += other.buckets_[i];
+                count_ += other.count_;
+                sum_ += other.sum_;
+                return *this;
+            }
+
+            /// The number of recorded values.
+            uint64_t count() const { return count_; }
+
+            /// The sum of all recorded values.
+            uint64_t sum() const { return sum_; }
+
+            uint64_t bucket(unsigned index) const { return buckets_[index]; }
+
+            /// The value below which the given fraction (between 0 and 1) of recorded values fall, rounded up to its bucket's bound.
+            uint64_t value_at_quantile(double quantile) const
+            {
+                if (count_ == 0)
+                    return 0;
+                uint64_t target = static_cast<uint64_t>(quantile * static_cast<double>(count_) + 0.5);
+                if (target == 0)
+                    target = 1;
+                uint64_t seen = 0;
+                for (unsigned i = 0; i < bucket_count; i++)
+                {
+                    seen += buckets_[i];
+                    if (seen >= target)
+                        return bucket_upper_bound(i) - 1;
+                }
+                return bucket_upper_bound(bucket_count - 1) - 1;
+            }
+
+            /// The number of recorded values that are at most `value` (approximated to the bucket precision).
+            uint64_t count_at_or_below(uint64_t value) const
+            {
+                uint64_t result = 0;
+                for (unsigned i = 0; i < bucket_count && bucket_lower_bound(i) <= value; i++)
+                    result += buckets_[i];
+                return result;
+            }
+
+        private:
+            static unsigned most_significant_bit(uint64_t value)
+            {
+#if defined(__GNUC__) || defined(__clang__)
+                return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#else
+                unsigned msb = 0;
+                while (value >>= 1)
+                    msb++;
+                return msb;
+#endif
+            }
+
+            std::array<uint64_t, bucket_count> buckets_{};
+            uint64_t count_{};
+            uint64_t sum_{};
+
+            friend class route_metrics;
+        };
+
+        /// A point in time copy of a route's metrics.
+        struct route_snapshot
+        {
+            std::string rule;
+            std::string name;
+            uint64_t requests{};
+            /// Responses by status class, index 1 counts 1xx responses, index 5 counts 5xx responses, and index 0 counts anything else.
+            std::array<uint64_t, 6> status_classes{};
+            /// The request body bytes received.
+            uint64_t bytes_in{};
+            /// The response body bytes sent.
+            uint64_t bytes_out{};
+            /// The time from the request being received to its response being ready to send.
+            latency_histogram latency;
+        };
+
+        /// The metrics a rule collects while handling requests.
+
+        ///
+        /// Every server worker writes to its own shard using relaxed atomics, the shards are only merged when a snapshot is taken.
+        class route_metrics
+        {
+        public:
+            /// Allocate (and reset) one shard per worker, metrics are only collected once shards exist.
+            void shards(unsigned count)
+            {
+                // value initialization zeroes the atomic counters
+                shards_.reset(count ? new shard[count]() : nullptr);
+                shard_count_ = count;
+            }
+
+            bool enabled() const
+            {
+                return shard_count_ != 0;
+            }
+
+            void record(int status, uint64_t bytes_in, uint64_t bytes_out, std::chrono::nanoseconds latency)
+            {
+                if (!shard_count_)
+                    return;
+                shard& s = shards_[crow::detail::this_thread_worker() % shard_count_];
+                uint64_t latency_ns = latency.count() > 0 ? static_cast<uint64_t>(latency.count()) : 0;
+                unsigned status_class = status >= 100 && status < 600 ? static_cast<unsigned>(status / 100) : 0;
+
+                s.requests.fetch_add(1, std::memory_order_relaxed);
+                s.status_classes[status_class].fetch_add(1, std::memory_order_relaxed);
+                s.bytes_in.fetch_add(bytes_in, std::memory_order_relaxed);
+                s.bytes_out.fetch_add(bytes_out, std::memory_order_relaxed);
+                s.latency[latency_histogram::bucket_index(latency_ns)].fetch_add(1, std::memory_order_relaxed);
+                s.latency_sum.fetch_add(latency_ns, std::memory_order_relaxed);
+            }
+
+            /// Merge all shards into a snapshot, values recorded while this runs may or may not be included.
+            route_snapshot snapshot() const
+            {
+                route_snapshot result;
+                for (unsigned i = 0; i < shard_count_; i++)
+                {
+                    const shard& s = shards_[i];
+                    result.requests += s.requests.load(std::memory_order_relaxed);
+                    for (unsigned c = 0; c < result.status_classes.size(); c++)
+                        result.status_classes[c] += s.status_classes[c].load(std::memory_order_relaxed);
+                    result.bytes_in += s.bytes_in.load(std::memory_order_relaxed);
+                    result.bytes_out += s.bytes_out.load(std::memory_order_relaxed);
+
+                    for (unsigned b = 0; b < latency_histogram::bucket_count; b++)
+                    {
+                        uint64_t count = s.latency[b].load(std::memory_order_relaxed);
+                        result.latency.buckets_[b] += count;
+                        result.latency.count_ += count;
+                    }
+                    result.latency.sum_ += s.latency_sum.load(std::memory_order_relaxed);
+                }
+                return result;
+            }
+
+        private:
+            struct shard
+            {
+                std::atomic<uint64_t> requests;
+                std::array<std::atomic<uint64_t>, 6> status_classes;
+                std::atomic<uint64_t> bytes_in;
+                std::atomic<uint64_t> bytes_out;
+                std::array<std::atomic<uint64_t>, latency_histogram::bucket_count> latency;
+                std::atomic<uint64_t> latency_sum;
+            };
+
+            std::unique_ptr<shard[]> shards_;
+            unsigned shard_count_{};
+        };
+
+        /// The number of `http_errno` values the parser can report.
+        constexpr unsigned http_errno_count = CHPE_INVALID_TRANSFER_ENCODING + 1;
+
+        /// A point in time copy of the server's metrics.
+        struct server_snapshot
+        {
+            /// The connections each worker is currently serving.
+            std::vector<unsigned> active_connections;
+            /// How late each worker's last timer tick ran, which is how long its event loop was kept busy.
+            std::vector<std::chrono::nanoseconds> loop_lag;
+            uint64_t accepts{};
+            uint64_t requests{};
+            /// Requests that were received on a connection which had already served a request.
+            uint64_t keep_alive_requests{};
+            /// Connections closed because their deadline timer fired.
+            uint64_t timeouts{};
+            uint64_t bytes_read{};
+            uint64_t bytes_written{};
+            uint64_t active_websockets{};
+            /// Requests the parser rejected, indexed by `http_errno`.
+            std::array<uint64_t, http_errno_count> parser_errors{};
+        };
+
+        /// Connection level metrics collected by the server.
+
+        ///
+        /// Like `route_metrics`, each worker writes to its own shard and the shards are merged when a snapshot is taken.
+        class server_metrics
+        {
+        public:
+            /// Allocate (and reset) one shard per worker.
+            void shards(unsigned count)
+            {
+                // value initialization zeroes the atomic counters
+                shards_.reset(count ? new shard[count]() : nullptr);
+                shard_count_ = count;
+            }
+
+            void accepted() { add(&shard::accepts, 1); }
+            void request(bool reused_connection) { add(reused_connection ? &shard::keep_alive_requests : &shard::new_connection_requests, 1); }
+            void timeout() { add(&shard::timeouts, 1); }
+            void read(uint64_t bytes) { add(&shard::bytes_read, bytes); }
+            void written(uint64_t bytes) { add(&shard::bytes_written, bytes); }
+            void websocket_opened() { add(&shard::websockets_opened, 1); }
+            void websocket_closed() { add(&shard::websockets_closed, 1); }
+
+            void parser_error(unsigned error)
+            {
+                if (shard_count_ && error < http_errno_count)
+                    current().parser_errors[error].fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void loop_lag(std::chrono::nanoseconds lag)
+            {
+                if (shard_count_)
+                    current().loop_lag.store(lag.count() > 0 ? static_cast<uint64_t>(lag.count()) : 0, std::memory_order_relaxed);
+            }
+
+            /// Merge all shards into a snapshot (without the active connections, which the server keeps track of).
+            server_snapshot snapshot() const
+            {
+                server_snapshot result;
+                uint64_t websockets_opened = 0, websockets_closed = 0;
+                for (unsigned i = 0; i < shard_count_; i++)
+                {
+                    const shard& s = shards_[i];
+                    result.accepts += s.accepts.load(std::memory_order_relaxed);
+                    result.keep_alive_requests += s.keep_alive_requests.load(std::memory_order_relaxed);
+                    result.requests += s.new_connection_requests.load(std::memory_order_relaxed) + s.keep_alive_requests.load(std::memory_order_relaxed);
+                    result.timeouts += s.timeouts.load(std::memory_order_relaxed);
+                    result.bytes_read += s.bytes_read.load(std::memory_order_relaxed);
+                    result.bytes_written += s.bytes_written.load(std::memory_order_relaxed);
+                    websockets_opened += s.websockets_opened.load(std::memory_order_relaxed);
+                    websockets_closed += s.websockets_closed.load(std::memory_order_relaxed);
+                    for (unsigned e = 0; e < http_errno_count; e++)
+                        result.parser_errors[e] += s.parser_errors[e].load(std::memory_order_relaxed);
+                    result.loop_lag.emplace_back(s.loop_lag.load(std::memory_order_relaxed));
+                }
+                result.active_websockets = websockets_opened >= websockets_closed ? websockets_opened - websockets_closed : 0;
+                return result;
+            }
+
+        private:
+            struct shard
+            {
+                std::atomic<uint64_t> accepts;
+                std::atomic<uint64_t> new_connection_requests;
+                std::atomic<uint64_t> keep_alive_requests;
+                std::atomic<uint64_t> timeouts;
+                std::atomic<uint64_t> bytes_read;
+                std::atomic<uint64_t> bytes_written;
+                std::atomic<uint64_t> websockets_opened;
+                std::atomic<uint64_t> websockets_closed;
+                std::atomic<uint64_t> loop_lag;
+                std::array<std::atomic<uint64_t>, http_errno_count> parser_errors;
+                char padding[64]; ///< Keeps the busiest counters of neighbouring shards off the same cache line.
+            };
+
+            shard& current()
+            {
+                return shards_[crow::detail::this_thread_worker() % shard_count_];
+            }
+
+            void add(std::atomic<uint64_t> shard::*counter, uint64_t value)
+            {
+                if (shard_count_)
+                    (current().*counter).fetch_add(value, std::memory_order_relaxed);
+            }
+
+            std::unique_ptr<shard[]> shards_;
+            unsigned shard_count_{};
+        };
+
+        namespace detail
+        {
+            inline std::string prometheus_label(const std::string& value)
+            {
+                std::string result;
+                result.reserve(value.size());
+                for (char c : value)
+                {
+                    if (c == '\\' || c == '"')
+                        result += '\\';
+                    if (c == '\n')
+                        result += "\\n";
+                    else
+                        result += c;
+                }
+                return result;
+            }
+        } // namespace detail
+
+        /// Write route snapshots in the Prometheus text exposition format (version 0.0.4).
+
+        ///
+        /// Latencies are exported as a histogram in seconds, the bucket counts are derived from the log-linear histogram and share its precision.
+        inline void write_prometheus(std::ostream& out, const std::vector<route_snapshot>& routes)
+        {
+            static const std::pair<const char*, uint64_t> latency_bounds[] = {
+              {"0.0001", 100000ull},
+              {"0.00025", 250000ull},
+              {"0.0005", 500000ull},
+              {"0.001", 1000000ull},
+              {"0.0025", 2500000ull},
+              {"0.005", 5000000ull},
+              {"0.01", 10000000ull},
+              {"0.025", 25000000ull},
+              {"0.05", 50000000ull},
+              {"0.1", 100000000ull},
+              {"0.25", 250000000ull},
+              {"0.5", 500000000ull},
+              {"1", 1000000000ull},
+              {"2.5", 2500000000ull},
+              {"5", 5000000000ull},
+              {"10", 10000000000ull},
+            };
+            static const char* status_class_names[] = {"other", "1xx", "2xx", "3xx", "4xx", "5xx"};
+
+            out << "# HELP crow_route_requests_total Requests handled by each route.\n"
+                << "# TYPE crow_route_requests_total counter\n";
+            for (auto& route : routes)
+                out << "crow_route_requests_total{route=\"" << detail::prometheus_label(route.rule) << "\"} " << route.requests << '\n';
+
+            out << "# HELP crow_route_responses_total Responses sent by each route, by status class.\n"
+                << "# TYPE crow_route_responses_total counter\n";
+            for (auto& route : routes)
+            {
+                for (unsigned c = 0; c < route.status_classes.size(); c++)
+                {
+                    if (route.status_classes[c])
+                        out << "crow_route_responses_total{route=\"" << detail::prometheus_label(route.rule) << "\",code=\"" << status_class_names[c] << "\"} " << route.status_classes[c] << '\n';
+                }
+            }
+
+            out << "# HELP crow_route_request_bytes_total Request body bytes received by each route.\n"
+                << "# TYPE crow_route_request_bytes_total counter\n";
+            for (auto& route : routes)
+                out << "crow_route_request_bytes_total{route=\"" << detail::prometheus_label(route.rule) << "\"} " << route.bytes_in << '\n';
+
+            out << "# HELP crow_route_response_bytes_total Response body bytes sent by each route.\n"
+                << "# TYPE crow_route_response_bytes_total counter\n";
+            for (auto& route : routes)
+                out << "crow_route_response_bytes_total{route=\"" << detail::prometheus_label(route.rule) << "\"} " << route.bytes_out << '\n';
+
+            out << "# HELP crow_route_latency_seconds Time taken to handle requests on each route.\n"
+                << "# TYPE crow_route_latency_seconds histogram\n";
+            for (auto& route : routes)
+            {
+                std::string label = detail::prometheus_label(route.rule);
+                for (auto& bound : latency_bounds)
+                    out << "crow_route_latency_seconds_bucket{route=\"" << label << "\",le=\"" << bound.first << "\"} " << route.latency.count_at_or_below(bound.second) << '\n';
+                out << "crow_route_latency_seconds_bucket{route=\"" << label << "\",le=\"+Inf\"} " << route.latency.count() << '\n';
+                out << "crow_route_latency_seconds_sum{route=\"" << label << "\"} " << static_cast<double>(route.latency.sum()) / 1e9 << '\n';
+                out << "crow_route_latency_seconds_count{route=\"" << label << "\"} " << route.latency.count() << '\n';
+            }
+        }
+
+        /// Write a server snapshot in the Prometheus text exposition format (version 0.0.4).
+        inline void write_prometheus(std::ostream& out, const server_snapshot& server)
+        {
+            out << "# HELP crow_active_connections Connections currently served by each worker.\n"
+                << "# TYPE crow_active_connections gauge\n";
+            for (unsigned i = 0; i < server.active_connections.size(); i++)
+                out << "crow_active_connections{worker=\"" << i << "\"} " << server.active_connections[i] << '\n';
+
+            out << "# HELP crow_event_loop_lag_seconds How late each worker's last timer tick ran.\n"
+                << "# TYPE crow_event_loop_lag_seconds gauge\n";
+            for (unsigned i = 0; i < server.loop_lag.size(); i++)
+                out << "crow_event_loop_lag_seconds{worker=\"" << i << "\"} " << static_cast<double>(server.loop_lag[i].count()) / 1e9 << '\n';
+
+            out << "# HELP crow_connections_accepted_total Connections accepted.\n"
+                << "# TYPE crow_connections_accepted_total counter\n"
+                << "crow_connections_accepted_total " << server.accepts << '\n'
+                << "# HELP crow_requests_total Requests received.\n"
+                << "# TYPE crow_requests_total counter\n"
+                << "crow_requests_total " << server.requests << '\n'
+                << "# HELP crow_keep_alive_requests_total Requests received on a reused connection.\n"
+                << "# TYPE crow_keep_alive_requests_total counter\n"
+                << "crow_keep_alive_requests_total " << server.keep_alive_requests << '\n'
+                << "# HELP crow_connection_timeouts_total Connections closed by their deadline timer.\n"
+                << "# TYPE crow_connection_timeouts_total counter\n"
+                << "crow_connection_timeouts_total " << server.timeouts << '\n'
+                << "# HELP crow_read_bytes_total Bytes read from HTTP connections.\n"
+                << "# TYPE crow_read_bytes_total counter\n"
+                << "crow_read_bytes_total " << server.bytes_read << '\n'
+                << "# HELP crow_written_bytes_total Bytes written to HTTP connections.\n"
+                << "# TYPE crow_written_bytes_total counter\n"
+                << "crow_written_bytes_total " << server.bytes_written << '\n'
+                << "# HELP crow_active_websockets Open websocket connections.\n"
+                << "# TYPE crow_active_websockets gauge\n"
+                << "crow_active_websockets " << server.active_websockets << '\n';
+
+            out << "# HELP crow_parser_errors_total Requests rejected by the HTTP parser, by error.\n"
+                << "# TYPE crow_parser_errors_total counter\n";
+            for (unsigned e = 0; e < http_errno_count; e++)
+            {
+                if (server.parser_errors[e])
+                    out << "crow_parser_errors_total{error=\"" << http_errno_name(static_cast<http_errno>(e)) << "\"} " << server.parser_errors[e] << '\n';
+            }
+        }
+    } // namespace metrics
+} // namespace crow
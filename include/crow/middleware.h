@@ -8,6 +8,7 @@
 #include <type_traits>
 #include <iostream>
 #include <utility>
+#include <vector>
 
 namespace crow
 {
@@ -327,5 +328,56 @@ namespace crow
             mutable int slider;
         };
 
+        template<typename App, int N>
+        struct middleware_dispatch
+        {
+            using context_t = typename App::context_t;
+            using container_t = typename App::mw_container_t;
+            using MW = typename std::tuple_element<N, container_t>::type;
+            using parent_context_t = typename context_t::template partial<N - 1>;
+
+            static void before(request& req, response& res)
+            {
+                auto& ctx = *reinterpret_cast<context_t*>(req.middleware_context);
+                auto& container = *reinterpret_cast<container_t*>(req.middleware_container);
+                before_handler_call<MW, context_t, parent_context_t>(std::get<N>(container), req, res, ctx, static_cast<parent_context_t&>(ctx));
+            }
+
+            static void after(request& req, response& res)
+            {
+                auto& ctx = *reinterpret_cast<context_t*>(req.middleware_context);
+                auto& container = *reinterpret_cast<container_t*>(req.middleware_container);
+                after_handler_call<MW, context_t, parent_context_t>(std::get<N>(container), req, res, ctx, static_cast<parent_context_t&>(ctx));
+            }
+        };
+
+        // Only local middleware can be part of a rule's plan, global middleware is left empty so that it's never instantiated here.
+        template<typename App, int N>
+        typename std::enable_if<!is_middleware_global<typename std::tuple_element<N, typename App::mw_container_t>::type>::value, middleware_dispatch_entry>::type
+          make_middleware_dispatch_entry()
+        {
+            return {&middleware_dispatch<App, N>::before, &middleware_dispatch<App, N>::after};
+        }
+
+        template<typename App, int N>
+        typename std::enable_if<is_middleware_global<typename std::tuple_element<N, typename App::mw_container_t>::type>::value, middleware_dispatch_entry>::type
+          make_middleware_dispatch_entry()
+        {
+            return {nullptr, nullptr};
+        }
+
+        template<typename App, unsigned... N>
+        std::vector<middleware_dispatch_entry> middleware_dispatch_table(black_magic::seq<N...>)
+        {
+            return {make_middleware_dispatch_entry<App, N>()...};
+        }
+
+        /// Get the dispatch entries for every middleware in an App, in the same order as the App's middleware tuple.
+        template<typename App>
+        std::vector<middleware_dispatch_entry> middleware_dispatch_table()
+        {
+            return middleware_dispatch_table<App>(black_magic::gen_seq<std::tuple_size<typename App::mw_container_t>::value>());
+        }
+
     } // namespace detail
 } // namespace crow
@@ -47,6 +47,9 @@ namespace crow
             friend typename std::enable_if<(N < std::tuple_size<typename std::remove_reference<Container>::type>::value), bool>::type
               middleware_call_helper(const CallCriteria& cc, Container& middlewares, request& req, response& res, Context& ctx);
 
+            template<typename App, int N>
+            friend struct middleware_dispatch;
+
             template<typename T>
             typename T::context& get()
             {
@@ -232,7 +232,7 @@ namespace crow
         void before_handle(request& req, response& res, context& ctx)
         {
             // TODO(dranikpg): remove copies, use string_view with c++17
-            int count = req.headers.count("Cookie");
+            int count = req.headers.count(known_header::cookie);
             if (!count)
                 return;
             if (count > 1)
@@ -241,7 +241,7 @@ namespace crow
                 res.end();
                 return;
             }
-            std::string cookies = req.get_header_value("Cookie");
+            std::string cookies = req.get_header_value(known_header::cookie);
             size_t pos = 0;
             while (pos < cookies.size())
             {
@@ -276,7 +276,7 @@ namespace crow
         {
             for (const auto& cookie : ctx.cookies_to_add)
             {
-                res.add_header("Set-Cookie", cookie.dump());
+                res.add_header(known_header::set_cookie, cookie.dump());
             }
         }
     };
@@ -15,9 +15,9 @@ namespace crow
 
         void after_handle(request& /*req*/, response& res, context& /*ctx*/)
         {
-            if (get_header_value(res.headers, "Content-Type").empty())
+            if (get_header_value(res.headers, known_header::content_type).empty())
             {
-                res.set_header("Content-Type", "text/plain; charset=utf-8");
+                res.set_header(known_header::content_type, "text/plain; charset=utf-8");
             }
         }
     };
@@ -1,4 +1,6 @@
 // This file is generated from nginx/conf/mime.types using nginx_mime2cpp.py on 2021-12-03.
+#pragma once
+
 #include <unordered_map>
 #include <string>
 
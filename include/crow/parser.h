@@ -3,9 +3,12 @@
 #include <string>
 #include <unordered_map>
 #include <algorithm>
+#include <memory>
 
 #include "crow/http_request.h"
 #include "crow/http_parser_merged.h"
+#include "crow/compression.h"
+#include "crow/utility.h"
 
 namespace crow
 {
@@ -30,9 +33,11 @@ namespace crow
         static int on_url(http_parser* self_, const char* at, size_t length)
         {
             HTTPParser* self = static_cast<HTTPParser*>(self_);
+            if (self->limits.max_url_size && self->req.raw_url.size() + length > self->limits.max_url_size)
+                return self->reject(status::URI_TOO_LONG);
             self->req.raw_url.insert(self->req.raw_url.end(), at, at + length);
-            self->req.url_params = query_string(self->req.raw_url);
-            self->req.url = self->req.raw_url.substr(0, self->qs_point != 0 ? self->qs_point : std::string::npos);
+            self->req.url_params.assign(self->req.raw_url);
+            self->req.url.assign(self->req.raw_url, 0, self->qs_point != 0 ? self->qs_point : std::string::npos);
 
             self->process_url();
 
@@ -41,12 +46,17 @@ namespace crow
         static int on_header_field(http_parser* self_, const char* at, size_t length)
         {
             HTTPParser* self = static_cast<HTTPParser*>(self_);
+            if (!self->count_header_bytes(length))
+                return self->reject(status::REQUEST_HEADER_FIELDS_TOO_LARGE);
             switch (self->header_building_state)
             {
                 case 0:
+                    if (self->current_limits().max_header_count && ++self->header_count > self->current_limits().max_header_count)
+                        return self->reject(status::REQUEST_HEADER_FIELDS_TOO_LARGE);
                     if (!self->header_value.empty())
                     {
-                        self->req.headers.emplace(std::move(self->header_field), std::move(self->header_value));
+                        // Copied rather than moved, so the map's and the parser's strings keep their capacity for the next request
+                        self->req.headers.emplace(self->header_field, self->header_value);
                     }
                     self->header_field.assign(at, at + length);
                     self->header_building_state = 1;
@@ -60,6 +70,8 @@ namespace crow
         static int on_header_value(http_parser* self_, const char* at, size_t length)
         {
             HTTPParser* self = static_cast<HTTPParser*>(self_);
+            if (!self->count_header_bytes(length))
+                return self->reject(status::REQUEST_HEADER_FIELDS_TOO_LARGE);
             switch (self->header_building_state)
             {
                 case 0:
@@ -77,17 +89,52 @@ namespace crow
             HTTPParser* self = static_cast<HTTPParser*>(self_);
             if (!self->header_field.empty())
             {
-                self->req.headers.emplace(std::move(self->header_field), std::move(self->header_value));
+                self->req.headers.emplace(self->header_field, self->header_value);
+                self->header_field.clear();
+                self->header_value.clear();
             }
 
             self->set_connection_parameters();
 
+            // A body that's announced as too large is rejected before any of it is read
+            size_t max_body_size = self->current_limits().max_body_size;
+            if (max_body_size && self->content_length != static_cast<uint64_t>(-1) && self->content_length > max_body_size)
+                return self->reject(status::PAYLOAD_TOO_LARGE);
+
             self->process_header();
+#ifdef CROW_ENABLE_COMPRESSION
+            if (self->decompression_limit)
+                self->start_decompression();
+#endif
             return 0;
         }
         static int on_body(http_parser* self_, const char* at, size_t length)
         {
             HTTPParser* self = static_cast<HTTPParser*>(self_);
+            self->body_bytes += length;
+            if (self->current_limits().max_body_size && self->body_bytes > self->current_limits().max_body_size)
+                return self->reject(status::PAYLOAD_TOO_LARGE); // Chunked bodies don't announce their size
+            if (self->body_error)
+                return 0; // The rest of the body is read but ignored, so the connection can still be used
+#ifdef CROW_ENABLE_COMPRESSION
+            if (self->decompressing_)
+            {
+                switch (self->inflater_->write(at, length, self->req.body, self->decompression_limit))
+                {
+                    case compression::inflater::result::too_large:
+                        self->body_error = 413;
+                        break;
+                    case compression::inflater::result::invalid:
+                        self->body_error = 400;
+                        break;
+                    default:
+                        break;
+                }
+                if (self->body_error)
+                    self->req.body.clear();
+                return 0;
+            }
+#endif
             self->req.body.insert(self->req.body.end(), at, at + length);
             return 0;
         }
@@ -95,6 +142,14 @@ namespace crow
         {
             HTTPParser* self = static_cast<HTTPParser*>(self_);
 
+#ifdef CROW_ENABLE_COMPRESSION
+            // A compressed body that ends early is as invalid as a corrupted one
+            if (self->decompressing_ && !self->body_error && !self->inflater_->finished())
+            {
+                self->body_error = 400;
+                self->req.body.clear();
+            }
+#endif
             self->message_complete = true;
             self->process_message();
             return 0;
@@ -138,15 +193,31 @@ namespace crow
 
         void clear()
         {
-            req = crow::request();
+            // The request's storage is reused by the next one
+            req.clear();
             header_field.clear();
             header_value.clear();
             header_building_state = 0;
             qs_point = 0;
             message_complete = false;
+            body_error = 0;
+            limit_error = 0;
+            route_limits = nullptr;
+            header_count = 0;
+            header_bytes = 0;
+            body_bytes = 0;
+#ifdef CROW_ENABLE_COMPRESSION
+            decompressing_ = false;
+#endif
             state = CROW_NEW_MESSAGE();
         }
 
+        /// The limits the request is held to, the route's once it's routed.
+        const request_limits& current_limits() const
+        {
+            return route_limits ? *route_limits : limits;
+        }
+
         inline void process_url()
         {
             handler_->handle_url();
@@ -162,6 +233,29 @@ namespace crow
             handler_->handle();
         }
 
+#ifdef CROW_ENABLE_COMPRESSION
+        /// Inflate the body as it's read if it's gzip or deflate compressed, the `Content-Encoding` header is removed since handlers get the original body.
+        void start_decompression()
+        {
+            auto encoding = req.headers.find(known_header::content_encoding);
+            if (encoding == req.headers.end())
+                return;
+            std::string coding = utility::trim(encoding->second);
+            if (!utility::string_equals(coding, "gzip") && !utility::string_equals(coding, "x-gzip") && !utility::string_equals(coding, "deflate"))
+                return;
+
+            if (!inflater_)
+                inflater_.reset(new compression::inflater());
+            if (!inflater_->begin())
+            {
+                body_error = 500;
+                return;
+            }
+            decompressing_ = true;
+            req.headers.erase(encoding);
+        }
+#endif
+
         inline void set_connection_parameters()
         {
             req.http_ver_major = http_major;
@@ -186,11 +280,45 @@ namespace crow
         /// Data parsed is put directly into this object as soon as the related callback returns. (e.g. the request will have the cooorect method as soon as on_method() returns)
         request req;
 
+#ifdef CROW_ENABLE_COMPRESSION
+        /// Inflate compressed request bodies up to this many bytes, 0 to leave them compressed.
+        size_t decompression_limit = 0;
+#endif
+        /// The status code the request should be rejected with because of its body (0 if the body is fine).
+        int body_error = 0;
+
+        /// The limits requests are held to until they're routed (the URL is always held to these).
+        request_limits limits;
+        /// The limits of the route the request was routed to, `nullptr` if it uses \ref limits.
+        const request_limits* route_limits = nullptr;
+        /// The status code the request is answered with because it's over one of its limits, parsing stops as soon as that's known (0 if it's within them).
+        int limit_error = 0;
+
     private:
+        /// Stop parsing the request, the connection answers it with `code` and closes.
+        int reject(int code)
+        {
+            limit_error = code;
+            return -1;
+        }
+
+        bool count_header_bytes(size_t length)
+        {
+            header_bytes += length;
+            return !current_limits().max_header_bytes || header_bytes <= current_limits().max_header_bytes;
+        }
+
         int header_building_state = 0;
         bool message_complete = false;
+        size_t header_count = 0;
+        size_t header_bytes = 0;
+        size_t body_bytes = 0;
         std::string header_field;
         std::string header_value;
+#ifdef CROW_ENABLE_COMPRESSION
+        bool decompressing_ = false;
+        std::unique_ptr<compression::inflater> inflater_; ///< Created for the first compressed body, and reused for the connection's next ones.
+#endif
 
         Handler* handler_; ///< This is currently an HTTP connection object (\ref crow.Connection).
     };
@@ -0,0 +1,198 @@
+#pragma once
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace crow
+{
+    /// Decoding of the PROXY protocol header (v1 or v2) a load balancer sends at the start of a connection, before anything from the client.
+
+    ///
+    /// The header carries the address of the client the load balancer accepted the connection from.
+    /// Decoding is strict, anything that doesn't follow the specification (https://www.haproxy.org/download/2.9/doc/proxy-protocol.txt) exactly is invalid.
+    namespace proxy_protocol
+    {
+        enum class result
+        {
+            complete,   ///< The header was decoded.
+            incomplete, ///< What was given is the start of a valid header.
+            invalid,
+        };
+
+        /// What a header says about the connection.
+        struct header
+        {
+            size_t size = 0;                ///< The bytes the header takes (including any v2 TLVs, which aren't decoded).
+            bool proxied = false;           ///< Whether `source` is set. It isn't for the load balancer's own connections (v1 `UNKNOWN`, v2 `LOCAL`) or non-IP addresses, which should keep the connection's address.
+            asio::ip::tcp::endpoint source; ///< The client's address.
+        };
+
+        /// The most bytes decoding a header needs (a v1 line, the fixed part and addresses of a v2 header take less).
+        const size_t max_decoded_size = 107;
+
+        namespace detail
+        {
+            const size_t v2_fixed_size = 16;
+
+            /// Whether `data` is the start of `prefix` (or starts with all of it).
+            inline bool starts_like(const char* data, size_t size, const char* prefix, size_t prefix_size)
+            {
+                return std::memcmp(data, prefix, size < prefix_size ? size : prefix_size) == 0;
+            }
+
+            /// A decimal port, without leading zeros.
+            inline bool decode_port(const std::string& text, uint16_t& port)
+            {
+                if (text.empty() || text.size() > 5 || (text[0] == '0' && text.size() > 1))
+                    return false;
+                uint32_t value = 0;
+                for (char c : text)
+                {
+                    if (c < '0' || c > '9')
+                        return false;
+                    value = value * 10 + static_cast<uint32_t>(c - '0');
+                }
+                if (value > 65535)
+                    return false;
+                port = static_cast<uint16_t>(value);
+                return true;
+            }
+
+            /// `PROXY TCP4 <source> <destination> <source port> <destination port>\r\n`, `TCP6` or `UNKNOWN` (followed by anything) instead of `TCP4`.
+            inline result decode_v1(const char* data, size_t size, header& out)
+            {
+                const char* end = static_cast<const char*>(std::memchr(data, '\n', size < max_decoded_size ? size : max_decoded_size));
+                if (!end)
+                    return size < max_decoded_size ? result::incomplete : result::invalid;
+                if (end == data || end[-1] != '\r')
+                    return result::invalid;
+                std::string line(data + 6, end - 1);
+                out.size = static_cast<size_t>(end - data) + 1;
+
+                if (line.compare(0, 7, "UNKNOWN") == 0)
+                {
+                    out.proxied = false;
+                    return result::complete;
+                }
+                bool v4 = line.compare(0, 5, "TCP4 ") == 0;
+                if (!v4 && line.compare(0, 5, "TCP6 ") != 0)
+                    return result::invalid;
+
+                // Exactly four fields, separated by single spaces
+                std::string fields[4];
+                size_t start = 5;
+                for (int i = 0; i < 4; i++)
+                {
+                    size_t space = line.find(' ', start);
+                    if ((space == std::string::npos) != (i == 3))
+                        return result::invalid;
+                    fields[i] = line.substr(start, space == std::string::npos ? std::string::npos : space - start);
+                    start = space + 1;
+                }
+
+                asio::error_code ec;
+                asio::ip::address source, destination;
+                if (v4)
+                {
+                    source = asio::ip::make_address_v4(fields[0], ec);
+                    if (!ec)
+                        destination = asio::ip::make_address_v4(fields[1], ec);
+                }
+                else if (fields[0].find('%') == std::string::npos && fields[1].find('%') == std::string::npos) // Without a scope id
+                {
+                    source = asio::ip::make_address_v6(fields[0], ec);
+                    if (!ec)
+                        destination = asio::ip::make_address_v6(fields[1], ec);
+                }
+                else
+                {
+                    return result::invalid;
+                }
+                uint16_t source_port, destination_port;
+                if (ec || !decode_port(fields[2], source_port) || !decode_port(fields[3], destination_port))
+                    return result::invalid;
+
+                out.proxied = true;
+                out.source = asio::ip::tcp::endpoint(source, source_port);
+                return result::complete;
+            }
+
+            inline uint16_t read_u16(const char* data)
+            {
+                return static_cast<uint16_t>((static_cast<unsigned char>(data[0]) << 8) | static_cast<unsigned char>(data[1]));
+            }
+
+            /// A 12 byte signature, the version and command, the address family and protocol, the length of the rest, then the addresses and TLVs.
+            inline result decode_v2(const char* data, size_t size, header& out)
+            {
+                if (size < v2_fixed_size)
+                    return result::incomplete;
+                unsigned char version_command = static_cast<unsigned char>(data[12]);
+                unsigned char family = static_cast<unsigned char>(data[13]) >> 4;
+                unsigned char protocol = static_cast<unsigned char>(data[13]) & 0xF;
+                size_t length = read_u16(data + 14);
+                out.size = v2_fixed_size + length;
+
+                if ((version_command >> 4) != 2 || (version_command & 0xF) > 1 || family > 3 || protocol > 2)
+                    return result::invalid;
+                // LOCAL
+                if ((version_command & 0xF) == 0)
+                {
+                    out.proxied = false;
+                    return result::complete;
+                }
+                // AF_UNSPEC and AF_UNIX
+                if (family == 0 || family == 3)
+                {
+                    out.proxied = false;
+                    return family == 3 && length < 216 ? result::invalid : result::complete;
+                }
+                // AF_INET and AF_INET6, only over TCP
+                size_t address_size = family == 1 ? 4 : 16;
+                if (protocol != 1 || length < 2 * address_size + 4)
+                    return result::invalid;
+                if (size < v2_fixed_size + 2 * address_size + 4)
+                    return result::incomplete;
+
+                const char* source = data + v2_fixed_size;
+                uint16_t source_port = read_u16(source + 2 * address_size);
+                if (family == 1)
+                {
+                    asio::ip::address_v4::bytes_type bytes;
+                    std::memcpy(bytes.data(), source, bytes.size());
+                    out.source = asio::ip::tcp::endpoint(asio::ip::address_v4(bytes), source_port);
+                }
+                else
+                {
+                    asio::ip::address_v6::bytes_type bytes;
+                    std::memcpy(bytes.data(), source, bytes.size());
+                    out.source = asio::ip::tcp::endpoint(asio::ip::address_v6(bytes), source_port);
+                }
+                out.proxied = true;
+                return result::complete;
+            }
+        } // namespace detail
+
+        /// Decode the header at the start of `data`.
+        inline result decode(const char* data, size_t size, header& out)
+        {
+            if (size == 0)
+                return result::incomplete;
+            if (data[0] == 'P')
+            {
+                if (!detail::starts_like(data, size, "PROXY ", 6))
+                    return result::invalid;
+                return size < 6 ? result::incomplete : detail::decode_v1(data, size, out);
+            }
+            if (!detail::starts_like(data, size, "\r\n\r\n\0\r\nQUIT\n", 12))
+                return result::invalid;
+            return detail::decode_v2(data, size, out);
+        }
+    } // namespace proxy_protocol
+} // namespace crow
@@ -2,12 +2,16 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <iostream>
 #include <memory>
 
+#include "crow/utility.h"
+
 namespace crow
 {
 
@@ -290,17 +294,22 @@ namespace crow
 {
     struct request;
     /// A class to represent any data coming after the `?` in the request URL into key-value pairs.
+
+    ///
+    /// The parameters are only parsed when they're first read, so requests whose handlers don't use them don't pay for it.<br>
+    /// The first read (and the first lookup that indexes them) is guarded, so the const functions can be called from several threads at once (as with any other object, the ones that modify it can't).
     class query_string
     {
     public:
-        static const int MAX_KEY_VALUE_PAIRS_COUNT = 256;
+        static const int MAX_KEY_VALUE_PAIRS_COUNT = 256; ///< Unused, the number of parameters isn't limited.
+        static const size_t MIN_INDEXED_PAIRS_COUNT = 16; ///< Query strings with fewer parameters are searched linearly, larger ones get a hash table.
 
         query_string()
         {
         }
 
         query_string(const query_string& qs):
-          url_(qs.url_)
+          url_(qs.url_), parse_url_(qs.parse_url_), parsed_(qs.parsed_.load())
         {
             for (auto p : qs.key_value_pairs_)
             {
@@ -311,6 +320,9 @@ namespace crow
         query_string& operator=(const query_string& qs)
         {
             url_ = qs.url_;
+            parse_url_ = qs.parse_url_;
+            parsed_ = qs.parsed_.load();
+            indexed_ = false;
             key_value_pairs_.clear();
             for (auto p : qs.key_value_pairs_)
             {
@@ -324,6 +336,9 @@ namespace crow
             key_value_pairs_ = std::move(qs.key_value_pairs_);
             char* old_data = (char*)qs.url_.c_str();
             url_ = std::move(qs.url_);
+            parse_url_ = qs.parse_url_;
+            parsed_ = qs.parsed_.load();
+            indexed_ = false;
             for (auto& p : key_value_pairs_)
             {
                 p += (char*)url_.c_str() - old_data;
@@ -333,25 +348,31 @@ namespace crow
 
 
         query_string(std::string params, bool url = true):
-          url_(std::move(params))
+          url_(std::move(params)), parse_url_(url)
         {
-            if (url_.empty())
-                return;
-
-            key_value_pairs_.resize(MAX_KEY_VALUE_PAIRS_COUNT);
+        }
 
-            size_t count = qs_parse(&url_[0], &key_value_pairs_[0], MAX_KEY_VALUE_PAIRS_COUNT, url);
-            key_value_pairs_.resize(count);
+        /// Replace the parameters, the storage of the previous ones is reused.
+        void assign(const std::string& params, bool url = true)
+        {
+            url_.assign(params);
+            parse_url_ = url;
+            parsed_ = false;
+            indexed_ = false;
+            key_value_pairs_.clear();
         }
 
         void clear()
         {
             key_value_pairs_.clear();
             url_.clear();
+            parsed_ = false;
+            indexed_ = false;
         }
 
         friend std::ostream& operator<<(std::ostream& os, const query_string& qs)
         {
+            qs.parse();
             os << "[ ";
             for (size_t i = 0; i < qs.key_value_pairs_.size(); ++i)
             {
@@ -369,10 +390,26 @@ namespace crow
         /// Note: this method returns the value of the first occurrence of the key only, to return all occurrences, see \ref get_list().
         char* get(const std::string& name) const
         {
-            char* ret = qs_k2v(name.c_str(), key_value_pairs_.data(), key_value_pairs_.size());
-            return ret;
+            parse();
+            if (key_value_pairs_.size() < MIN_INDEXED_PAIRS_COUNT)
+                return qs_k2v(name.c_str(), key_value_pairs_.data(), key_value_pairs_.size());
+
+            std::string key;
+            uint32_t key_hash = index_key(name, key);
+            size_t slot = key_hash;
+            const indexed_pair* pair = next_match(key, key_hash, slot);
+            return pair ? pair->value : nullptr;
         }
 
+#ifdef CROW_CAN_USE_CPP17
+        /// Works similar to \ref get() but returns a view of the value, whose `data()` is `nullptr` if the key isn't found.
+        std::string_view get_view(const std::string& name) const
+        {
+            char* value = get(name);
+            return value ? std::string_view(value) : std::string_view();
+        }
+#endif
+
         /// Works similar to \ref get() except it removes the item from the query string.
         char* pop(const std::string& name)
         {
@@ -385,6 +422,7 @@ namespace crow
                     if (str_item.substr(0, name.size() + 1) == name + '=')
                     {
                         key_value_pairs_.erase(key_value_pairs_.begin() + i);
+                        indexed_ = false;
                         break;
                     }
                 }
@@ -398,18 +436,22 @@ namespace crow
         /// Note: Square brackets in the above example are controlled by `use_brackets` boolean (true by default). If set to false, the example becomes `?name=value1,name=value2...name=valuen`
         std::vector<char*> get_list(const std::string& name, bool use_brackets = true) const
         {
+            parse();
             std::vector<char*> ret;
             std::string plus = name + (use_brackets ? "[]" : "");
-            char* element = nullptr;
-
-            int count = 0;
-            while (1)
+            if (key_value_pairs_.size() < MIN_INDEXED_PAIRS_COUNT)
             {
-                element = qs_k2v(plus.c_str(), key_value_pairs_.data(), key_value_pairs_.size(), count++);
-                if (!element)
-                    break;
-                ret.push_back(element);
+                int count = 0;
+                while (char* element = qs_k2v(plus.c_str(), key_value_pairs_.data(), key_value_pairs_.size(), count++))
+                    ret.push_back(element);
+                return ret;
             }
+
+            std::string key;
+            uint32_t key_hash = index_key(plus, key);
+            size_t slot = key_hash;
+            while (const indexed_pair* pair = next_match(key, key_hash, slot))
+                ret.push_back(pair->value);
             return ret;
         }
 
@@ -425,6 +467,7 @@ namespace crow
                     if ((use_brackets ? (str_item.substr(0, name.size() + 3) == name + "[]=") : (str_item.substr(0, name.size() + 1) == name + '=')))
                     {
                         key_value_pairs_.erase(key_value_pairs_.begin() + i--);
+                        indexed_ = false;
                     }
                 }
             }
@@ -439,6 +482,7 @@ namespace crow
         /// if your query string has both empty brackets and ones with a key inside, use pop_list() to get all the values without a key before running this method.
         std::unordered_map<std::string, std::string> get_dict(const std::string& name) const
         {
+            parse();
             std::unordered_map<std::string, std::string> ret;
 
             int count = 0;
@@ -464,6 +508,7 @@ namespace crow
                     if (str_item.substr(0, name.size() + 1) == name + '[')
                     {
                         key_value_pairs_.erase(key_value_pairs_.begin() + i--);
+                        indexed_ = false;
                     }
                 }
             }
@@ -472,6 +517,7 @@ namespace crow
 
         std::vector<std::string> keys() const
         {
+            parse();
             std::vector<std::string> ret;
             for (auto element : key_value_pairs_)
             {
@@ -482,8 +528,154 @@ namespace crow
         }
 
     private:
-        std::string url_;
-        std::vector<char*> key_value_pairs_;
+        /// A parameter as it's found by \ref get() and \ref get_list().
+        struct indexed_pair
+        {
+            uint32_t key_hash;
+            uint32_t key_offset; ///< Where the decoded key starts in `decoded_keys_`.
+            uint32_t key_size;
+            char* value;
+        };
+
+        /// Append a key with its `+`s and percent-encoded characters decoded (the way `qs_strncmp()` compares them).
+        static void decode_key(const char* key, std::string& decoded)
+        {
+            for (; CROW_QS_ISQSCHR(*key); key++)
+            {
+                char c = *key;
+                if (c == '+')
+                {
+                    c = ' ';
+                }
+                else if (c == '%')
+                {
+                    if (!CROW_QS_ISHEX(key[1]) || !CROW_QS_ISHEX(key[2]))
+                        return;
+                    c = static_cast<char>(CROW_QS_HEX2DEC(key[1]) * 16 + CROW_QS_HEX2DEC(key[2]));
+                    key += 2;
+                }
+                if (c == '\0')
+                    return;
+                decoded += c;
+            }
+        }
+
+        /// Decode a key that's looked up, and index the parameters if that wasn't done yet.
+        uint32_t index_key(const std::string& name, std::string& key) const
+        {
+            key.reserve(name.size());
+            decode_key(name.c_str(), key);
+            if (!indexed_.load(std::memory_order_acquire))
+                index();
+            return static_cast<uint32_t>(utility::fnv1a(key.data(), key.size()));
+        }
+
+        /// Build a hash table of every parameter's decoded key, so a lookup doesn't compare the keys of all of them.
+        void index() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (indexed_.load(std::memory_order_relaxed))
+                return;
+            pairs_.clear();
+            decoded_keys_.clear();
+            for (char* kv : key_value_pairs_)
+            {
+                indexed_pair pair;
+                pair.key_offset = static_cast<uint32_t>(decoded_keys_.size());
+                decode_key(kv, decoded_keys_);
+                pair.key_size = static_cast<uint32_t>(decoded_keys_.size() - pair.key_offset);
+                pair.key_hash = static_cast<uint32_t>(utility::fnv1a(decoded_keys_.data() + pair.key_offset, pair.key_size));
+                size_t skip = strcspn(kv, "=");
+                pair.value = kv + skip + (kv[skip] == '=' ? 1 : 0);
+                pairs_.push_back(pair);
+            }
+
+            // Open addressing with linear probing, parameters with the same key are found in the order they're in the URL
+            size_t slots = 8;
+            while (slots < pairs_.size() * 2)
+                slots *= 2;
+            slots_.assign(slots, 0);
+            for (uint32_t i = 0; i < pairs_.size(); i++)
+            {
+                size_t slot = pairs_[i].key_hash & (slots - 1);
+                while (slots_[slot])
+                    slot = (slot + 1) & (slots - 1);
+                slots_[slot] = i + 1;
+            }
+            indexed_.store(true, std::memory_order_release);
+        }
+
+        /// The next parameter with this key, starting from a slot that's updated to continue the search from.
+        const indexed_pair* next_match(const std::string& key, uint32_t key_hash, size_t& slot) const
+        {
+            size_t mask = slots_.size() - 1;
+            for (slot &= mask; slots_[slot]; slot = (slot + 1) & mask)
+            {
+                const indexed_pair& pair = pairs_[slots_[slot] - 1];
+                if (pair.key_hash == key_hash && pair.key_size == key.size() && decoded_keys_.compare(pair.key_offset, pair.key_size, key) == 0)
+                {
+                    slot++;
+                    return &pair;
+                }
+            }
+            return nullptr;
+        }
+
+        /// Split the parameters into key-value pairs (decoding the values in place), unless that was already done (by any thread).
+        void parse() const
+        {
+            if (parsed_.load(std::memory_order_acquire))
+                return;
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (parsed_.load(std::memory_order_relaxed))
+                return;
+            split();
+            parsed_.store(true, std::memory_order_release);
+        }
+
+        /// Do the work of \ref parse(), with `mutex_` held.
+        void split() const
+        {
+            key_value_pairs_.clear();
+            if (url_.empty())
+                return;
+
+            char* pair = &url_[0];
+            if (parse_url_)
+            {
+                // The parameters start after the '?' (or the fragment after the '#')
+                pair += strcspn(pair, "?#");
+                if (pair[0] == '\0')
+                    return;
+                pair++;
+            }
+
+            while (pair)
+            {
+                key_value_pairs_.push_back(pair);
+                size_t length = strcspn(pair, "&");
+                char* next = pair[length] == '\0' ? nullptr : pair + length + 1;
+
+                // Only values are decoded, keys could contain an encoded '=' that would look like the end of the key
+                char* value = pair + strcspn(pair, "=&#");
+                if (value[0] == '&' || value[0] == '\0')
+                    value[0] = '\0';
+                else
+                    qs_decode(value + 1);
+                pair = next;
+            }
+        }
+
+        mutable std::string url_;
+        bool parse_url_ = true;
+        mutable std::atomic<bool> parsed_{false};
+        mutable std::vector<char*> key_value_pairs_;
+        mutable std::mutex mutex_; ///< Held while the parameters are parsed or indexed, so that only one thread does it.
+
+        mutable std::atomic<bool> indexed_{false};
+        mutable std::vector<indexed_pair> pairs_;
+        mutable std::vector<uint32_t> slots_; ///< The position + 1 of a parameter in `pairs_`, 0 for an empty slot.
+        mutable std::string decoded_keys_;
     };
 
 } // namespace crow
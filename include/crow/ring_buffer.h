@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace crow
+{
+    namespace detail
+    {
+        /// A bounded lock-free queue for many producers and a single consumer.
+
+        ///
+        /// Every slot carries a sequence number telling producers and the consumer whose turn it is, so pushing only costs a compare-and-swap on the shared position.
+        template<typename T>
+        class mpsc_ring_buffer
+        {
+        public:
+            /// \param capacity The number of values the buffer can hold, rounded up to a power of 2.
+            explicit mpsc_ring_buffer(size_t capacity)
+            {
+                size_t size = 2;
+                while (size < capacity)
+                    size <<= 1;
+                slots_.reset(new slot[size]);
+                mask_ = size - 1;
+                for (size_t i = 0; i < size; i++)
+                    slots_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+
+            /// Add a value to the buffer, `value` is only moved from if there was space for it.
+            bool try_push(T& value)
+            {
+                size_t pos = push_pos_.load(std::memory_order_relaxed);
+                slot* s;
+                while (true)
+                {
+                    s = &slots_[pos & mask_];
+                    size_t sequence = s->sequence.load(std::memory_order_acquire);
+                    if (sequence == pos)
+                    {
+                        if (push_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                            break;
+                    }
+                    else if (sequence < pos)
+                    {
+                        return false; // The consumer hasn't freed this slot yet, the buffer is full
+                    }
+                    else
+                    {
+                        pos = push_pos_.load(std::memory_order_relaxed);
+                    }
+                }
+                s->value = std::move(value);
+                s->sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+
+            /// Take the oldest value out of the buffer, only the consumer thread may call this.
+            bool try_pop(T& value)
+            {
+                slot& s = slots_[pop_pos_ & mask_];
+                if (s.sequence.load(std::memory_order_acquire) != pop_pos_ + 1)
+                    return false;
+                value = std::move(s.value);
+                s.sequence.store(pop_pos_ + mask_ + 1, std::memory_order_release);
+                pop_pos_++;
+                return true;
+            }
+
+            /// The number of values pushed so far (including ones still being written).
+            size_t push_count() const
+            {
+                return push_pos_.load(std::memory_order_acquire);
+            }
+
+        private:
+            struct slot
+            {
+                std::atomic<size_t> sequence;
+                T value;
+            };
+
+            std::unique_ptr<slot[]> slots_;
+            size_t mask_;
+            std::atomic<size_t> push_pos_{0};
+            size_t pop_pos_{0};
+        };
+    } // namespace detail
+} // namespace crow
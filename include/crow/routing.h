@@ -8,6 +8,9 @@
 #include <vector>
 #include <algorithm>
 #include <type_traits>
+#ifdef CROW_CAN_USE_CPP17
+#include <charconv>
+#endif
 
 #include "crow/common.h"
 #include "crow/http_response.h"
@@ -17,6 +20,7 @@
 #include "crow/websocket.h"
 #include "crow/mustache.h"
 #include "crow/middleware.h"
+#include "crow/metrics.h"
 
 namespace crow
 {
@@ -136,6 +140,15 @@ namespace crow
 
         const std::string& rule() { return rule_; }
 
+        /// Get a copy of the metrics collected for this rule (empty unless the app uses metrics).
+        metrics::route_snapshot metrics_snapshot() const
+        {
+            metrics::route_snapshot snapshot = metrics_.snapshot();
+            snapshot.rule = rule_;
+            snapshot.name = name_;
+            return snapshot;
+        }
+
     protected:
         uint32_t methods_{1 << static_cast<int>(HTTPMethod::Get)};
 
@@ -145,6 +158,12 @@ namespace crow
         std::unique_ptr<BaseRule> rule_to_upgrade_;
 
         detail::middleware_indices mw_indices_;
+        detail::middleware_plan mw_plan_;
+
+        metrics::route_metrics metrics_;
+        uint32_t id_{}; ///< Assigned when the router is validated, 0 is used for requests without a rule.
+        std::unique_ptr<request_limits> limits_; ///< Set by `limits()`, the app's limits are used otherwise.
+        expectation_handler expect_continue_; ///< Set by `expect_continue()`, the app's handler is used otherwise.
 
         friend class Router;
         friend class Blueprint;
@@ -217,6 +236,18 @@ namespace crow
                 }
             };
 
+#ifdef CROW_CAN_USE_CPP17
+            template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1, typename... Args2>
+            struct call<F, NInt, NUint, NDouble, NString, black_magic::S<std::string_view, Args1...>, black_magic::S<Args2...>>
+            {
+                void operator()(F cparams)
+                {
+                    using pushed = typename black_magic::S<Args2...>::template push_back<call_pair<std::string_view, NString>>;
+                    call<F, NInt, NUint, NDouble, NString + 1, black_magic::S<Args1...>, pushed>()(cparams);
+                }
+            };
+#endif
+
             template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1>
             struct call<F, NInt, NUint, NDouble, NString, black_magic::S<>, black_magic::S<Args1...>>
             {
@@ -325,7 +356,41 @@ namespace crow
             };
 
         } // namespace routing_handler_call_helper
-    }     // namespace detail
+
+        /// The type a routing parameter is handed to the user's handler as.
+        template<typename T>
+        struct handler_param
+        {
+            using type = T;
+        };
+
+#ifdef CROW_CAN_USE_CPP17
+        /// A `<string>` or `<path>` parameter, which the handler can accept as either `std::string` or `std::string_view`.
+
+        ///
+        /// Taking a `std::string_view` avoids any allocation, the view points into `request::url`.
+        struct string_param
+        {
+            std::string_view value;
+
+            operator std::string_view() const noexcept
+            {
+                return value;
+            }
+
+            operator std::string() const
+            {
+                return std::string(value);
+            }
+        };
+
+        template<>
+        struct handler_param<std::string_view>
+        {
+            using type = string_param;
+        };
+#endif
+    } // namespace detail
 
 
     class CatchallRule
@@ -551,6 +616,23 @@ namespace crow
             return static_cast<self_t&>(*this);
         }
 
+        /// Hold the requests routed here to different header and body limits than the app's.
+
+        ///
+        /// The URL is always held to the app's limit, since it's read before the request is routed.
+        self_t& limits(const request_limits& limits)
+        {
+            static_cast<self_t*>(this)->limits_.reset(new request_limits(limits));
+            return static_cast<self_t&>(*this);
+        }
+
+        /// Decide whether the requests routed here that are sent with `Expect: 100-continue` should send their body (instead of the app's handler).
+        self_t& expect_continue(expectation_handler handler)
+        {
+            static_cast<self_t*>(this)->expect_continue_ = std::move(handler);
+            return static_cast<self_t&>(*this);
+        }
+
         /// Enable local middleware for this handler
         template<typename App, typename... Middlewares>
         self_t& middlewares()
@@ -668,7 +750,7 @@ namespace crow
               [f]
 #endif
               (crow::request& req, crow::response& res, Args... args) {
-                  detail::wrapped_handler_call(req, res, f, std::forward<Args>(args)...);
+                  detail::wrapped_handler_call(req, res, f, typename detail::handler_param<Args>::type{std::forward<Args>(args)}...);
               });
         }
 
@@ -775,6 +857,93 @@ namespace crow
             }
         }
 
+#ifdef CROW_CAN_USE_CPP17
+        static std::string_view string_param_at(const std::string& req_url, size_t pos, size_t epos)
+        {
+            return std::string_view(req_url).substr(pos, epos - pos);
+        }
+
+        /// Parse the integer at `pos`, returning the position right after it (or `pos` if there's no valid integer).
+
+        ///
+        /// Unlike `strtoll` / `strtod`, `std::from_chars` doesn't depend on the locale and doesn't allocate.
+        template<typename T>
+        static typename std::enable_if<std::is_integral<T>::value, size_t>::type
+          parse_number(const std::string& req_url, size_t pos, T& value)
+        {
+            const char* begin = req_url.data() + pos;
+            const char* end = req_url.data() + req_url.size();
+            // from_chars doesn't accept an explicit '+' sign
+            if (*begin == '+' && ++begin != end && *begin == '-')
+                return pos;
+            auto result = std::from_chars(begin, end, value);
+            if (result.ec != std::errc())
+                return pos;
+            return result.ptr - req_url.data();
+        }
+
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+        static size_t parse_number(const std::string& req_url, size_t pos, double& value)
+        {
+            const char* begin = req_url.data() + pos;
+            const char* end = req_url.data() + req_url.size();
+            if (*begin == '+' && ++begin != end && *begin == '-')
+                return pos;
+            auto result = std::from_chars(begin, end, value);
+            if (result.ec != std::errc())
+                return pos;
+            return result.ptr - req_url.data();
+        }
+#else
+        // Floating point std::from_chars isn't available on every standard library yet.
+        static size_t parse_number(const std::string& req_url, size_t pos, double& value)
+        {
+            char* eptr;
+            errno = 0;
+            value = strtod(req_url.data() + pos, &eptr);
+            if (errno == ERANGE)
+                return pos;
+            return eptr - req_url.data();
+        }
+#endif
+#else
+        static std::string string_param_at(const std::string& req_url, size_t pos, size_t epos)
+        {
+            return req_url.substr(pos, epos - pos);
+        }
+
+        /// Parse the number at `pos`, returning the position right after it (or `pos` if there's no valid number).
+        static size_t parse_number(const std::string& req_url, size_t pos, int64_t& value)
+        {
+            char* eptr;
+            errno = 0;
+            value = strtoll(req_url.data() + pos, &eptr, 10);
+            if (errno == ERANGE)
+                return pos;
+            return eptr - req_url.data();
+        }
+
+        static size_t parse_number(const std::string& req_url, size_t pos, uint64_t& value)
+        {
+            char* eptr;
+            errno = 0;
+            value = strtoull(req_url.data() + pos, &eptr, 10);
+            if (errno == ERANGE)
+                return pos;
+            return eptr - req_url.data();
+        }
+
+        static size_t parse_number(const std::string& req_url, size_t pos, double& value)
+        {
+            char* eptr;
+            errno = 0;
+            value = strtod(req_url.data() + pos, &eptr);
+            if (errno == ERANGE)
+                return pos;
+            return eptr - req_url.data();
+        }
+#endif
+
         void debug_node_print(const Node& node, int level)
         {
             if (node.param != ParamType::MAX)
@@ -874,15 +1043,14 @@ namespace crow
                         char c = req_url[pos];
                         if ((c >= '0' && c <= '9') || c == '+' || c == '-')
                         {
-                            char* eptr;
-                            errno = 0;
-                            long long int value = strtoll(req_url.data() + pos, &eptr, 10);
-                            if (errno != ERANGE && eptr != req_url.data() + pos)
+                            int64_t value;
+                            size_t epos = parse_number(req_url, pos, value);
+                            if (epos != pos)
                             {
                                 found_fragment = true;
                                 params->int_params.push_back(value);
                                 if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
-                                auto ret = find(req_url, child, eptr - req_url.data(), params, blueprints);
+                                auto ret = find(req_url, child, epos, params, blueprints);
                                 update_found(ret);
                                 params->int_params.pop_back();
                                 if (!blueprints->empty()) blueprints->pop_back();
@@ -895,15 +1063,14 @@ namespace crow
                         char c = req_url[pos];
                         if ((c >= '0' && c <= '9') || c == '+')
                         {
-                            char* eptr;
-                            errno = 0;
-                            unsigned long long int value = strtoull(req_url.data() + pos, &eptr, 10);
-                            if (errno != ERANGE && eptr != req_url.data() + pos)
+                            uint64_t value;
+                            size_t epos = parse_number(req_url, pos, value);
+                            if (epos != pos)
                             {
                                 found_fragment = true;
                                 params->uint_params.push_back(value);
                                 if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
-                                auto ret = find(req_url, child, eptr - req_url.data(), params, blueprints);
+                                auto ret = find(req_url, child, epos, params, blueprints);
                                 update_found(ret);
                                 params->uint_params.pop_back();
                                 if (!blueprints->empty()) blueprints->pop_back();
@@ -916,15 +1083,14 @@ namespace crow
                         char c = req_url[pos];
                         if ((c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.')
                         {
-                            char* eptr;
-                            errno = 0;
-                            double value = strtod(req_url.data() + pos, &eptr);
-                            if (errno != ERANGE && eptr != req_url.data() + pos)
+                            double value;
+                            size_t epos = parse_number(req_url, pos, value);
+                            if (epos != pos)
                             {
                                 found_fragment = true;
                                 params->double_params.push_back(value);
                                 if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
-                                auto ret = find(req_url, child, eptr - req_url.data(), params, blueprints);
+                                auto ret = find(req_url, child, epos, params, blueprints);
                                 update_found(ret);
                                 params->double_params.pop_back();
                                 if (!blueprints->empty()) blueprints->pop_back();
@@ -944,7 +1110,7 @@ namespace crow
                         if (epos != pos)
                         {
                             found_fragment = true;
-                            params->string_params.push_back(req_url.substr(pos, epos - pos));
+                            params->string_params.push_back(string_param_at(req_url, pos, epos));
                             if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
                             auto ret = find(req_url, child, epos, params, blueprints);
                             update_found(ret);
@@ -960,7 +1126,7 @@ namespace crow
                         if (epos != pos)
                         {
                             found_fragment = true;
-                            params->string_params.push_back(req_url.substr(pos, epos - pos));
+                            params->string_params.push_back(string_param_at(req_url, pos, epos));
                             if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
                             auto ret = find(req_url, child, epos, params, blueprints);
                             update_found(ret);
@@ -987,7 +1153,7 @@ namespace crow
             if (!found_fragment)
                 found_BP = std::move(*blueprints);
 
-            return routing_handle_result{found, found_BP, match_params}; //Called after all the recursions have been done
+            return routing_handle_result{found, std::move(found_BP), std::move(match_params)}; //Called after all the recursions have been done
         }
 
         routing_handle_result find(const std::string& req_url) const
@@ -1275,6 +1441,13 @@ namespace crow
             }
 
             ruleObject->mw_indices_.pack();
+            ruleObject->mw_plan_.entries.clear();
+            for (int index : ruleObject->mw_indices_.indices())
+            {
+                if (index >= static_cast<int>(middleware_dispatch_table_.size()))
+                    throw std::runtime_error("Internal error: no dispatch entry for the local middleware of " + rule);
+                ruleObject->mw_plan_.entries.push_back(middleware_dispatch_table_[index]);
+            }
 
             ruleObject->foreach_method([&](int method) {
                 per_methods_[method].rules.emplace_back(ruleObject);
@@ -1289,6 +1462,31 @@ namespace crow
             });
         }
 
+        /// Set how each of the App's middleware is called, rules' local middleware is resolved using these when validating.
+        void middleware_dispatch_table(std::vector<detail::middleware_dispatch_entry> table)
+        {
+            middleware_dispatch_table_ = std::move(table);
+        }
+
+        /// Start collecting metrics on every validated rule, with one shard per server worker.
+        void enable_metrics(unsigned shards)
+        {
+            foreach_rule([shards](BaseRule* rule) {
+                rule->metrics_.shards(shards);
+            });
+        }
+
+        /// Get a copy of the metrics collected by every rule.
+        std::vector<metrics::route_snapshot> metrics_snapshot()
+        {
+            std::vector<metrics::route_snapshot> snapshots;
+            foreach_rule([&snapshots](BaseRule* rule) {
+                if (rule->metrics_.enabled())
+                    snapshots.emplace_back(rule->metrics_snapshot());
+            });
+            return snapshots;
+        }
+
         void register_blueprint(Blueprint& blueprint)
         {
             if (std::find(blueprints_.begin(), blueprints_.end(), &blueprint) == blueprints_.end())
@@ -1376,6 +1574,39 @@ namespace crow
             {
                 per_method.trie.validate();
             }
+
+            rule_names_.assign(1, std::string());
+            foreach_rule([this](BaseRule* rule) {
+                rule->id_ = static_cast<uint32_t>(rule_names_.size());
+                rule_names_.push_back(rule->rule_);
+            });
+        }
+
+        /// The rule of every rule id (the first one is empty and used for requests that didn't match a rule).
+        const std::vector<std::string>& rule_names() const
+        {
+            return rule_names_;
+        }
+
+        /// Get the limits set on the rule a request was routed to, `nullptr` if it has none.
+        const request_limits* rule_limits(const routing_handle_result& found) const
+        {
+            const BaseRule* rule = found_rule(found);
+            return rule ? rule->limits_.get() : nullptr;
+        }
+
+        /// Get the `Expect: 100-continue` handler set on the rule a request was routed to, `nullptr` if it has none.
+        const expectation_handler* rule_expect_continue(const routing_handle_result& found) const
+        {
+            const BaseRule* rule = found_rule(found);
+            return rule && rule->expect_continue_ ? &rule->expect_continue_ : nullptr;
+        }
+
+        /// Get the id of the rule a request was routed to.
+        uint32_t rule_id(const routing_handle_result& found) const
+        {
+            const BaseRule* rule = found_rule(found);
+            return rule ? rule->id_ : 0;
         }
 
         // TODO maybe add actual_method
@@ -1417,13 +1648,13 @@ namespace crow
                 res = response(301);
 
                 // TODO(ipkn) absolute url building
-                if (req.get_header_value("Host").empty())
+                if (req.get_header_value(known_header::host).empty())
                 {
-                    res.add_header("Location", req.url + "/");
+                    res.add_header(known_header::location, req.url + "/");
                 }
                 else
                 {
-                    res.add_header("Location", "http://" + req.get_header_value("Host") + req.url + "/");
+                    res.add_header(known_header::location, "http://" + req.get_header_value(known_header::host) + req.url + "/");
                 }
                 res.end();
                 return;
@@ -1577,7 +1808,7 @@ namespace crow
                     }
                     allow = allow.substr(0, allow.size() - 2);
                     res = response(204);
-                    res.set_header("Allow", allow);
+                    res.set_header(known_header::allow, allow);
                     res.end();
                     found->method = method_actual;
                     return found;
@@ -1601,7 +1832,7 @@ namespace crow
                     {
                         allow = allow.substr(0, allow.size() - 2);
                         res = response(204);
-                        res.set_header("Allow", allow);
+                        res.set_header(known_header::allow, allow);
                         res.end();
                         found->method = method_actual;
                         return found;
@@ -1660,13 +1891,13 @@ namespace crow
                 res = response(301);
 
                 // TODO(ipkn) absolute url building
-                if (req.get_header_value("Host").empty())
+                if (req.get_header_value(known_header::host).empty())
                 {
-                    res.add_header("Location", req.url + "/");
+                    res.add_header(known_header::location, req.url + "/");
                 }
                 else
                 {
-                    res.add_header("Location", "http://" + req.get_header_value("Host") + req.url + "/");
+                    res.add_header(known_header::location, "http://" + req.get_header_value(known_header::host) + req.url + "/");
                 }
                 res.end();
                 return;
@@ -1674,6 +1905,9 @@ namespace crow
 
             CROW_LOG_DEBUG << "Matched rule '" << rules[rule_index]->rule_ << "' " << static_cast<uint32_t>(req.method) << " / " << rules[rule_index]->get_methods();
 
+            if (rules[rule_index]->metrics_.enabled())
+                res.route_metrics_ = &rules[rule_index]->metrics_;
+
             // any uncaught exceptions become 500s
             try
             {
@@ -1700,34 +1934,26 @@ namespace crow
         typename std::enable_if<std::tuple_size<typename App::mw_container_t>::value != 0, void>::type
           handle_rule(BaseRule* rule, crow::request& req, crow::response& res, const crow::routing_params& rp)
         {
-            if (!rule->mw_indices_.empty())
+            const detail::middleware_plan& plan = rule->mw_plan_;
+            if (!plan.empty())
             {
-                auto& ctx = *reinterpret_cast<typename App::context_t*>(req.middleware_context);
-                auto& container = *reinterpret_cast<typename App::mw_container_t*>(req.middleware_container);
-                detail::middleware_call_criteria_dynamic<false> crit_fwd(rule->mw_indices_.indices());
-
+                // Completing the response from a local middleware shouldn't complete the request until its after handlers are done
                 auto glob_completion_handler = std::move(res.complete_request_handler_);
-                res.complete_request_handler_ = [] {};
+                res.complete_request_handler_ = nullptr;
 
-                detail::middleware_call_helper<decltype(crit_fwd),
-                                               0, typename App::context_t, typename App::mw_container_t>(crit_fwd, container, req, res, ctx);
+                bool completed = plan.before(req, res);
 
-                if (res.completed_)
+                res.complete_request_handler_ = std::move(glob_completion_handler);
+                if (completed)
                 {
-                    glob_completion_handler();
+                    if (res.complete_request_handler_)
+                        res.complete_request_handler_();
                     return;
                 }
 
-                res.complete_request_handler_ = [&rule, &ctx, &container, &req, &res, glob_completion_handler] {
-                    detail::middleware_call_criteria_dynamic<true> crit_bwd(rule->mw_indices_.indices());
-
-                    detail::after_handlers_call_helper<
-                      decltype(crit_bwd),
-                      std::tuple_size<typename App::mw_container_t>::value - 1,
-                      typename App::context_t,
-                      typename App::mw_container_t>(crit_bwd, container, ctx, req, res);
-                    glob_completion_handler();
-                };
+                // The response calls the after handlers once it's completed, before the completion handler
+                res.local_middleware_plan_ = &plan;
+                res.local_middleware_request_ = &req;
             }
             rule->handle(req, res, rp);
         }
@@ -1758,6 +1984,35 @@ namespace crow
         }
 
     private:
+        /// The rule a request was routed to, `nullptr` if there's none.
+        const BaseRule* found_rule(const routing_handle_result& found) const
+        {
+            if (found.method >= HTTPMethod::InternalMethodCount)
+                return nullptr;
+            auto& rules = per_methods_[static_cast<int>(found.method)].rules;
+            if (found.rule_index >= rules.size())
+                return nullptr;
+            return rules[found.rule_index];
+        }
+
+        /// Call `f` once for every validated rule (rules handling several methods are only visited once).
+        template<typename F>
+        void foreach_rule(F f)
+        {
+            std::vector<BaseRule*> visited;
+            for (auto& per_method : per_methods_)
+            {
+                for (BaseRule* rule : per_method.rules)
+                {
+                    if (rule && std::find(visited.begin(), visited.end(), rule) == visited.end())
+                    {
+                        visited.push_back(rule);
+                        f(rule);
+                    }
+                }
+            }
+        }
+
         CatchallRule catchall_rule_;
 
         struct PerMethod
@@ -1772,5 +2027,7 @@ namespace crow
         std::array<PerMethod, static_cast<int>(HTTPMethod::InternalMethodCount)> per_methods_;
         std::vector<std::unique_ptr<BaseRule>> all_rules_;
         std::vector<Blueprint*> blueprints_;
+        std::vector<detail::middleware_dispatch_entry> middleware_dispatch_table_;
+        std::vector<std::string> rule_names_;
     };
 } // namespace crow
@@ -25,6 +25,22 @@
 #define CROW_LOG_LEVEL 1
 #endif
 
+/* #define - specifies the lowest log level compiled in (same values as above) */
+/*
+    log statements below this level compile to nothing,
+    whatever the log level is set to at runtime.
+
+    default to Debug (everything is compiled in)
+*/
+#ifndef CROW_LOG_MIN_LEVEL
+#define CROW_LOG_MIN_LEVEL 0
+#endif
+
+/* #define - the largest request or response body (in bytes) whose storage a connection keeps for its next request */
+#ifndef CROW_REUSED_BODY_CAPACITY
+#define CROW_REUSED_BODY_CAPACITY 65536
+#endif
+
 #ifndef CROW_STATIC_DIRECTORY
 #define CROW_STATIC_DIRECTORY "static/"
 #endif
@@ -99,10 +99,9 @@ namespace crow
             return *ssl_socket_;
         }
 
-        tcp::socket::lowest_layer_type&
-          raw_socket()
+        tcp::socket& raw_socket()
         {
-            return ssl_socket_->lowest_layer();
+            return ssl_socket_->next_layer();
         }
 
         tcp::endpoint remote_endpoint()
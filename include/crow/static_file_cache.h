@@ -0,0 +1,181 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <sys/stat.h>
+
+#include "crow/mime_types.h"
+
+namespace crow
+{
+    /// Keeps the content and headers of recently served static files in memory.
+
+    ///
+    /// A hit is answered without touching the filesystem, files are only `stat()`ed again once their revalidation interval is over, and reloaded if they changed.<br>
+    /// The cache is bounded by the total size of the files it holds, the least recently used ones are evicted first.
+    class static_file_cache
+    {
+    public:
+        /// A cached file (or the fact that there's no file at that path).
+        struct entry
+        {
+            bool exists;
+            struct stat statbuf;
+            std::string content_type;
+            std::string content_length;
+            std::string etag;
+            std::string last_modified;
+            std::shared_ptr<const std::string> data; ///< Shared with the responses still sending it, so evicting the entry doesn't invalidate them.
+        };
+
+        /// \param max_bytes The total size of the files the cache can hold.
+        /// \param max_file_size Files larger than this are never cached.
+        /// \param revalidate_interval How long a cached file is used before checking whether it changed.
+        static_file_cache(size_t max_bytes, size_t max_file_size, std::chrono::milliseconds revalidate_interval):
+          max_bytes_(max_bytes), max_file_size_(max_file_size), revalidate_interval_(revalidate_interval)
+        {}
+
+        /// Get the cached version of a file, loading it if needed. `nullptr` means the file is too large to be cached.
+        std::shared_ptr<const entry> get(const std::string& path)
+        {
+            auto now = std::chrono::steady_clock::now();
+            std::shared_ptr<const entry> cached;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = entries_.find(path);
+                if (it != entries_.end())
+                {
+                    lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+                    cached = it->second.value;
+                    if (now < it->second.checked + revalidate_interval_)
+                        return cached;
+                    // Only the first request after the interval checks the file
+                    it->second.checked = now;
+                }
+            }
+
+            struct stat statbuf;
+            int stat_result = stat(path.c_str(), &statbuf);
+            if (cached && is_current(*cached, stat_result, statbuf))
+                return cached;
+
+            std::shared_ptr<const entry> loaded = load(path, stat_result, statbuf);
+            std::lock_guard<std::mutex> lock(mutex_);
+            remove(path);
+            if (loaded)
+            {
+                size_t size = entry_size(path, *loaded);
+                if (size <= max_bytes_)
+                {
+                    lru_.push_front(path);
+                    entries_.emplace(path, slot{loaded, now, lru_.begin()});
+                    bytes_ += size;
+                    while (bytes_ > max_bytes_)
+                        remove(lru_.back());
+                }
+            }
+            return loaded;
+        }
+
+        /// The total size of the cached files (including their paths and headers).
+        size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return bytes_;
+        }
+
+        /// Format a time as an HTTP date (`Sun, 06 Nov 1994 08:49:37 GMT`).
+        static std::string http_date(time_t time)
+        {
+            tm my_tm;
+#if defined(_MSC_VER) || defined(__MINGW32__)
+            gmtime_s(&my_tm, &time);
+#else
+            gmtime_r(&time, &my_tm);
+#endif
+            char date[64];
+            size_t size = strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &my_tm);
+            return std::string(date, size);
+        }
+
+        /// A validator that changes whenever the file's size or modification time does.
+        static std::string etag(const struct stat& statbuf)
+        {
+            char tag[48];
+            int size = snprintf(tag, sizeof(tag), "\"%llx-%llx\"", static_cast<unsigned long long>(statbuf.st_mtime), static_cast<unsigned long long>(statbuf.st_size));
+            return std::string(tag, size);
+        }
+
+    private:
+        struct slot
+        {
+            std::shared_ptr<const entry> value;
+            std::chrono::steady_clock::time_point checked;
+            std::list<std::string>::iterator lru_position;
+        };
+
+        static bool is_current(const entry& cached, int stat_result, const struct stat& statbuf)
+        {
+            if (!cached.exists)
+                return stat_result != 0 || !S_ISREG(statbuf.st_mode);
+            return stat_result == 0 && S_ISREG(statbuf.st_mode) && statbuf.st_mtime == cached.statbuf.st_mtime && statbuf.st_size == cached.statbuf.st_size;
+        }
+
+        std::shared_ptr<const entry> load(const std::string& path, int stat_result, const struct stat& statbuf)
+        {
+            std::shared_ptr<entry> loaded = std::make_shared<entry>();
+            loaded->exists = stat_result == 0 && S_ISREG(statbuf.st_mode);
+            if (!loaded->exists)
+                return loaded;
+            if (static_cast<size_t>(statbuf.st_size) > max_file_size_)
+                return nullptr;
+
+            std::ifstream is(path, std::ios::in | std::ios::binary);
+            std::shared_ptr<std::string> data = std::make_shared<std::string>(static_cast<size_t>(statbuf.st_size), '\0');
+            if (!data->empty() && !is.read(&(*data)[0], static_cast<std::streamsize>(data->size())))
+                return nullptr; // The file changed while it was read, it'll be served from disk this time
+
+            loaded->statbuf = statbuf;
+            size_t last_dot = path.find_last_of('.');
+            auto mime_type = last_dot == std::string::npos ? mime_types.end() : mime_types.find(path.substr(last_dot + 1));
+            loaded->content_type = mime_type != mime_types.end() ? mime_type->second : "text/plain";
+            loaded->content_length = std::to_string(data->size());
+            loaded->etag = etag(statbuf);
+            loaded->last_modified = http_date(statbuf.st_mtime);
+            loaded->data = std::move(data);
+            return loaded;
+        }
+
+        static size_t entry_size(const std::string& path, const entry& e)
+        {
+            return path.size() + sizeof(entry) + e.content_type.size() + e.content_length.size() + e.etag.size() + e.last_modified.size() + (e.data ? e.data->size() : 0);
+        }
+
+        void remove(const std::string& path)
+        {
+            auto it = entries_.find(path);
+            if (it == entries_.end())
+                return;
+            bytes_ -= entry_size(path, *it->second.value);
+            auto lru_position = it->second.lru_position;
+            entries_.erase(it);
+            lru_.erase(lru_position);
+        }
+
+        size_t max_bytes_;
+        size_t max_file_size_;
+        std::chrono::milliseconds revalidate_interval_;
+
+        mutable std::mutex mutex_;
+        std::unordered_map<std::string, slot> entries_;
+        std::list<std::string> lru_; ///< Most recently used first.
+        size_t bytes_ = 0;
+    };
+} // namespace crow
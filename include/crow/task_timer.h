@@ -89,6 +89,9 @@ namespace crow
             /// Get the default timeout. (Default: 5)
             std::uint8_t get_default_timeout() const { return default_timeout_; }
 
+            /// Set a function to be called on every tick with how late the tick ran (i.e. how long the io_service was busy with other work).
+            void set_tick_observer(std::function<void(std::chrono::nanoseconds)> observer) { tick_observer_ = std::move(observer); }
+
         private:
             void process_tasks()
             {
@@ -116,6 +119,9 @@ namespace crow
             {
                 if (ec) return;
 
+                if (tick_observer_)
+                    tick_observer_(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - timer_.expiry()));
+
                 process_tasks();
 
                 timer_.expires_after(std::chrono::seconds(1));
@@ -128,6 +134,7 @@ namespace crow
             asio::io_service& io_service_;
             asio::basic_waitable_timer<clock_type> timer_;
             std::map<identifier_type, std::pair<time_type, task_type>> tasks_;
+            std::function<void(std::chrono::nanoseconds)> tick_observer_;
 
             // A continuosly increasing number to be issued to threads to identify them.
             // If no tasks are scheduled, it will be reset to 0.
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
 #include <stdexcept>
 #include <tuple>
 #include <type_traits>
@@ -11,12 +15,24 @@
 #include <sstream>
 #include <unordered_map>
 #include <random>
+#include <vector>
 
 #include "crow/settings.h"
 
 #if defined(CROW_CAN_USE_CPP17) && !defined(CROW_FILESYSTEM_IS_EXPERIMENTAL)
 #include <filesystem>
 #endif
+#ifdef CROW_CAN_USE_CPP17
+#include <string_view>
+#endif
+#if !defined(CROW_CAN_USE_CPP17) || defined(CROW_FILESYSTEM_IS_EXPERIMENTAL)
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+#endif
 
 // TODO(EDev): Adding C++20's [[likely]] and [[unlikely]] attributes might be useful
 #if defined(__GNUG__) || defined(__clang__)
@@ -158,6 +174,9 @@ namespace crow
         CROW_INTERNAL_PARAMETER_TAG(unsigned long long, 2);
         CROW_INTERNAL_PARAMETER_TAG(double, 3);
         CROW_INTERNAL_PARAMETER_TAG(std::string, 4);
+#ifdef CROW_CAN_USE_CPP17
+        CROW_INTERNAL_PARAMETER_TAG(std::string_view, 4);
+#endif
 #undef CROW_INTERNAL_PARAMETER_TAG
         template<typename... Args>
         struct compute_parameter_tag_from_args_list;
@@ -340,6 +359,21 @@ namespace crow
             using type = double;
         };
 
+        // With C++17 string parameters are passed around as views into the request URL,
+        // handlers can still take them as `std::string` (see `detail::handler_param`).
+#ifdef CROW_CAN_USE_CPP17
+        template<>
+        struct single_tag_to_type<4>
+        {
+            using type = std::string_view;
+        };
+
+        template<>
+        struct single_tag_to_type<5>
+        {
+            using type = std::string_view;
+        };
+#else
         template<>
         struct single_tag_to_type<4>
         {
@@ -351,6 +385,7 @@ namespace crow
         {
             using type = std::string;
         };
+#endif
 
 
         template<uint64_t Tag>
@@ -897,5 +932,328 @@ namespace crow
 
             return v.substr(begin, end - begin);
         }
+
+        /// The content codings an `Accept-Encoding` header accepts, and how much (their `q` value).
+
+        ///
+        /// The header is parsed once, the codings refer to it instead of being copied (so it has to outlive this object).
+        class accept_encoding
+        {
+        public:
+            explicit accept_encoding(const std::string& header):
+              header_(header)
+            {
+                size_t pos = 0;
+                while (pos < header.size())
+                {
+                    size_t end = header.find(',', pos);
+                    if (end == std::string::npos)
+                        end = header.size();
+                    size_t name_end = header.find(';', pos);
+                    if (name_end > end)
+                        name_end = end;
+
+                    coding c{pos, name_end, 1.f};
+                    while (c.begin < c.end && std::isspace(static_cast<unsigned char>(header[c.begin])))
+                        c.begin++;
+                    while (c.end > c.begin && std::isspace(static_cast<unsigned char>(header[c.end - 1])))
+                        c.end--;
+
+                    // Parameters, only "q" means anything
+                    for (size_t param = name_end; param < end; param = header.find(';', param + 1))
+                    {
+                        size_t value = param + 1;
+                        while (value < end && std::isspace(static_cast<unsigned char>(header[value])))
+                            value++;
+                        if (value + 1 < end && (header[value] == 'q' || header[value] == 'Q') && header[value + 1] == '=')
+                            c.q = parse_qvalue(header, value + 2, std::min(header.find(';', value), end));
+                    }
+
+                    if (c.end - c.begin == 1 && header[c.begin] == '*')
+                        any_ = c.q;
+                    else if (c.end > c.begin)
+                        codings_.push_back(c);
+                    pos = end + 1;
+                }
+            }
+
+            /// The `q` value of a content coding, 0 if it's not acceptable.
+
+            ///
+            /// Codings the header doesn't list get the `q` value of `*`, if it's there.
+            float quality(const std::string& name) const
+            {
+                for (const coding& c : codings_)
+                {
+                    if (matches(c, name) || (name == "gzip" && matches(c, "x-gzip")))
+                        return c.q;
+                }
+                return any_;
+            }
+
+            /// Whether a content coding is acceptable at all.
+            bool accepts(const std::string& name) const
+            {
+                return quality(name) > 0;
+            }
+
+        private:
+            struct coding
+            {
+                size_t begin;
+                size_t end;
+                float q;
+            };
+
+            /// A `q` value (`0`, `0.5`, `1.000`...) between `begin` and `end`, 0 if it's anything else. It's parsed by hand since `strtod` depends on the locale.
+            static float parse_qvalue(const std::string& header, size_t begin, size_t end)
+            {
+                while (end > begin && std::isspace(static_cast<unsigned char>(header[end - 1])))
+                    end--;
+                if (begin == end || (header[begin] != '0' && header[begin] != '1'))
+                    return 0;
+                bool one = header[begin] == '1';
+                if (end - begin > 1 && (header[begin + 1] != '.' || end - begin > 5))
+                    return 0;
+
+                int thousandths = 0;
+                int scale = 100;
+                for (size_t i = begin + 2; i < end; i++, scale /= 10)
+                {
+                    char c = header[i];
+                    if (c < '0' || c > '9' || (one && c != '0'))
+                        return 0;
+                    thousandths += (c - '0') * scale;
+                }
+                return one ? 1.f : static_cast<float>(thousandths) / 1000.f;
+            }
+
+            bool matches(const coding& c, const std::string& name) const
+            {
+                if (c.end - c.begin != name.size())
+                    return false;
+                for (size_t i = 0; i < name.size(); i++)
+                {
+                    if (std::tolower(static_cast<unsigned char>(header_[c.begin + i])) != std::tolower(static_cast<unsigned char>(name[i])))
+                        return false;
+                }
+                return true;
+            }
+
+            const std::string& header_;
+            std::vector<coding> codings_;
+            float any_ = 0;
+        };
+
+        /// Whether an entity tag is listed in an `If-None-Match` header (`*` matches any tag).
+
+        ///
+        /// Uses the weak comparison, `W/"x"` and `"x"` match each other.
+        inline static bool etag_matches(const std::string& header, const std::string& etag)
+        {
+            size_t tag = etag.compare(0, 2, "W/") == 0 ? 2 : 0;
+            size_t tag_size = etag.size() - tag;
+
+            size_t pos = 0;
+            while (pos < header.size())
+            {
+                while (pos < header.size() && (std::isspace(static_cast<unsigned char>(header[pos])) || header[pos] == ','))
+                    pos++;
+                if (pos == header.size())
+                    break;
+                if (header[pos] == '*')
+                    return true;
+                if (header.compare(pos, 2, "W/") == 0)
+                    pos += 2;
+
+                // Tags are quoted and can't contain quotes, but they can contain commas
+                size_t end = header.find('"', pos + 1);
+                end = end == std::string::npos ? header.size() : end + 1;
+                if (end - pos == tag_size && header.compare(pos, tag_size, etag, tag, tag_size) == 0)
+                    return true;
+                pos = end;
+            }
+            return false;
+        }
+
+        /// Parse an HTTP date (`Sun, 06 Nov 1994 08:49:37 GMT`), returns false if it isn't one.
+        inline static bool parse_http_date(const std::string& date, time_t& time)
+        {
+            static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+            char month[4];
+            int day, year, hour, minute, second;
+            if (sscanf(date.c_str(), "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &day, month, &year, &hour, &minute, &second) != 6 || strlen(month) != 3)
+                return false;
+            const char* found = strstr(months, month);
+            if (!found || (found - months) % 3 != 0)
+                return false;
+
+            // Days since the epoch of a proleptic Gregorian date (timegm() isn't portable)
+            int m = static_cast<int>(found - months) / 3 + 1;
+            int y = year - (m <= 2 ? 1 : 0);
+            int era = (y >= 0 ? y : y - 399) / 400;
+            int year_of_era = y - era * 400;
+            int day_of_year = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + day - 1;
+            int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+            long long days = era * 146097LL + day_of_era - 719468;
+            time = static_cast<time_t>(days * 86400 + hour * 3600 + minute * 60 + second);
+            return true;
+        }
+
+        /// A range of bytes, both ends included.
+        struct byte_range
+        {
+            uint64_t first;
+            uint64_t last;
+        };
+
+        /// Parse a `Range` header for a representation of `size` bytes.
+
+        ///
+        /// Returns false if the header isn't a valid `bytes` range, or asks for more than `max_ranges` ranges (it should be ignored).<br>
+        /// Otherwise `ranges` holds the satisfiable ones, clamped to the size. None at all means the request can't be satisfied.
+        inline static bool parse_ranges(const std::string& header, uint64_t size, std::vector<byte_range>& ranges, size_t max_ranges = 16)
+        {
+            ranges.clear();
+            if (header.compare(0, 6, "bytes=") != 0)
+                return false;
+
+            auto parse_number = [&header](size_t begin, size_t end, uint64_t& value) {
+                if (begin == end || end - begin > 19)
+                    return false;
+                value = 0;
+                for (size_t i = begin; i < end; i++)
+                {
+                    if (header[i] < '0' || header[i] > '9')
+                        return false;
+                    value = value * 10 + static_cast<uint64_t>(header[i] - '0');
+                }
+                return true;
+            };
+
+            size_t specs = 0;
+            for (size_t pos = 6; pos <= header.size(); pos++)
+            {
+                size_t end = header.find(',', pos);
+                if (end == std::string::npos)
+                    end = header.size();
+                while (pos < end && std::isspace(static_cast<unsigned char>(header[pos])))
+                    pos++;
+                size_t spec_end = end;
+                while (spec_end > pos && std::isspace(static_cast<unsigned char>(header[spec_end - 1])))
+                    spec_end--;
+                if (pos == spec_end)
+                {
+                    pos = end;
+                    continue;
+                }
+                if (++specs > max_ranges)
+                    return false;
+
+                size_t dash = header.find('-', pos);
+                if (dash >= spec_end)
+                    return false;
+                byte_range range;
+                if (dash == pos)
+                {
+                    // The last N bytes
+                    uint64_t suffix;
+                    if (!parse_number(dash + 1, spec_end, suffix))
+                        return false;
+                    if (suffix > 0 && size > 0)
+                        ranges.push_back({suffix < size ? size - suffix : 0, size - 1});
+                }
+                else
+                {
+                    if (!parse_number(pos, dash, range.first))
+                        return false;
+                    if (dash + 1 == spec_end)
+                        range.last = size - 1;
+                    else if (!parse_number(dash + 1, spec_end, range.last) || range.last < range.first)
+                        return false;
+                    if (range.first < size)
+                        ranges.push_back({range.first, range.last < size ? range.last : size - 1});
+                }
+                pos = end;
+            }
+            return specs > 0;
+        }
+
+        /// A 64 bit FNV-1a hash, stable across processes and platforms.
+        inline static uint64_t fnv1a(const char* data, size_t size)
+        {
+            uint64_t hash = 14695981039346656037ULL;
+            for (size_t i = 0; i < size; i++)
+            {
+                hash ^= static_cast<unsigned char>(data[i]);
+                hash *= 1099511628211ULL;
+            }
+            return hash;
+        }
+
+        /// The path of every regular file in a directory and its subdirectories.
+        inline static std::vector<std::string> list_files(const std::string& directory)
+        {
+            std::vector<std::string> files;
+#if defined(CROW_CAN_USE_CPP17) && !defined(CROW_FILESYSTEM_IS_EXPERIMENTAL)
+            std::error_code ec;
+            for (std::filesystem::recursive_directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec))
+            {
+                if (it->is_regular_file(ec))
+                    files.push_back(it->path().string());
+            }
+#else
+            std::vector<std::string> directories{directory};
+            while (!directories.empty())
+            {
+                std::string current = std::move(directories.back());
+                directories.pop_back();
+#ifdef _WIN32
+                _finddata_t data;
+                intptr_t handle = _findfirst(join_path(current, "*").c_str(), &data);
+                if (handle == -1)
+                    continue;
+                do
+                {
+                    std::string name = data.name;
+                    if (name == "." || name == "..")
+                        continue;
+                    if (data.attrib & _A_SUBDIR)
+                        directories.push_back(join_path(current, name));
+                    else
+                        files.push_back(join_path(current, name));
+                } while (_findnext(handle, &data) == 0);
+                _findclose(handle);
+#else
+                DIR* dir = opendir(current.c_str());
+                if (!dir)
+                    continue;
+                while (dirent* entry = readdir(dir))
+                {
+                    std::string name = entry->d_name;
+                    if (name == "." || name == "..")
+                        continue;
+                    std::string path = join_path(current, name);
+                    struct stat statbuf;
+                    if (lstat(path.c_str(), &statbuf) != 0)
+                        continue;
+                    // Like std::filesystem, links to directories aren't followed (they could lead back to a parent), links to files are listed
+                    bool link = S_ISLNK(statbuf.st_mode);
+                    if (link && stat(path.c_str(), &statbuf) != 0)
+                        continue;
+                    if (S_ISDIR(statbuf.st_mode))
+                    {
+                        if (!link)
+                            directories.push_back(std::move(path));
+                    }
+                    else if (S_ISREG(statbuf.st_mode))
+                        files.push_back(std::move(path));
+                }
+                closedir(dir);
+#endif
+            }
+#endif
+            return files;
+        }
     } // namespace utility
 } // namespace crow
@@ -5,6 +5,7 @@
 #include "crow/http_request.h"
 #include "crow/TinySHA1.hpp"
 #include "crow/utility.h"
+#include "crow/metrics.h"
 
 namespace crow
 {
@@ -86,7 +87,7 @@ namespace crow
               error_handler_(std::move(error_handler)),
               accept_handler_(std::move(accept_handler))
             {
-                if (!utility::string_equals(req.get_header_value("upgrade"), "websocket"))
+                if (!utility::string_equals(req.get_header_value(known_header::upgrade), "websocket"))
                 {
                     adaptor_.close();
                     handler_->remove_websocket(this);
@@ -109,12 +110,16 @@ namespace crow
 
                 // Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==
                 // Sec-WebSocket-Version: 13
-                std::string magic = req.get_header_value("Sec-WebSocket-Key") + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+                std::string magic = req.get_header_value(known_header::sec_websocket_key) + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
                 sha1::SHA1 s;
                 s.processBytes(magic.data(), magic.size());
                 uint8_t digest[20];
                 s.getDigestBytes(digest);
 
+                server_metrics_ = handler_->server_metrics_collector();
+                if (server_metrics_)
+                    server_metrics_->websocket_opened();
+
                 start(crow::utility::base64encode((unsigned char*)digest, 20));
             }
 
@@ -130,6 +135,9 @@ namespace crow
                 {
                     std::this_thread::yield();
                 }
+
+                if (server_metrics_)
+                    server_metrics_->websocket_closed();
             }
 
             template<typename Callable>
@@ -709,6 +717,7 @@ namespace crow
         private:
             Adaptor adaptor_;
             Handler* handler_;
+            metrics::server_metrics* server_metrics_{}; ///< Only set once the handshake is accepted.
 
             std::vector<std::string> sending_buffers_;
             std::vector<std::string> write_buffers_;
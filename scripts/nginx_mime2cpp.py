@@ -24,6 +24,8 @@ def main():
     outLines = []
     outLines.append("// This file is generated from nginx/conf/mime.types using nginx_mime2cpp.py on " + date.today().strftime('%Y-%m-%d') + ".")
     outLines.extend([
+        "#pragma once",
+        "",
         "#include <unordered_map>",
         "#include <string>",
         "",
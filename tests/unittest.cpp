@@ -21,6 +21,22 @@ using namespace crow;
 
 #define LOCALHOST_ADDRESS "127.0.0.1"
 
+/// Send a request on a new connection, and read everything until the server closes it.
+std::string http_exchange(const std::string& request, uint16_t port = 45451)
+{
+    asio::io_service is;
+    asio::ip::tcp::socket c(is);
+    c.connect(asio::ip::tcp::endpoint(asio::ip::address::from_string(LOCALHOST_ADDRESS), port));
+    c.send(asio::buffer(request));
+    std::string response;
+    char buf[4096];
+    asio::error_code ec;
+    size_t n;
+    while ((n = c.read_some(asio::buffer(buf), ec)) > 0)
+        response.append(buf, n);
+    return response;
+}
+
 TEST_CASE("Rule")
 {
     TaggedRule<> r("/http/");
@@ -282,8 +298,103 @@ TEST_CASE("RoutingTest")
         CHECK("hello_there" == D);
         CHECK("a/b/c/d" == E);
     }
+    {
+        request req;
+        response res;
+
+        req.url = "/1/+7/+8";
+
+        app.handle_full(req, res);
+
+        CHECK(200 == res.code);
+
+        CHECK(7 == A);
+        CHECK(8 == B);
+    }
+    {
+        request req;
+        response res;
+
+        req.url = "/1/+-7/8";
+
+        app.handle_full(req, res);
+
+        CHECK(404 == res.code);
+    }
 } // RoutingTest
 
+#ifdef CROW_CAN_USE_CPP17
+TEST_CASE("RoutingTest_string_view")
+{
+    SimpleApp app;
+    std::string_view A{};
+    std::string_view B{};
+    std::string C{};
+    const char* url_data{};
+
+    CROW_ROUTE(app, "/sv/<string>/<path>")
+    ([&](std::string_view a, std::string_view b) {
+        A = a;
+        B = b;
+        return "OK";
+    });
+
+    CROW_ROUTE(app, "/s/<string>")
+    ([&](const crow::request&, std::string c) {
+        C = c;
+        return "OK";
+    });
+
+    app.route_dynamic("/dyn/<int>/<string>")([&](int, std::string_view a) {
+        A = a;
+        return "OK";
+    });
+
+    app.validate();
+
+    {
+        request req;
+        response res;
+
+        req.url = "/sv/hello/a/b/c";
+        url_data = req.url.data();
+
+        app.handle_full(req, res);
+
+        CHECK(200 == res.code);
+        CHECK("hello" == A);
+        CHECK("a/b/c" == B);
+        // The views point straight into the request's URL
+        CHECK(url_data + 4 == A.data());
+        CHECK(url_data + 10 == B.data());
+    }
+    {
+        request req;
+        response res;
+
+        req.url = "/s/world";
+
+        app.handle_full(req, res);
+
+        CHECK(200 == res.code);
+        CHECK("world" == C);
+    }
+    {
+        request req;
+        response res;
+
+        req.url = "/dyn/5/there";
+        url_data = req.url.data();
+
+        app.handle_full(req, res);
+
+        CHECK(200 == res.code);
+        CHECK("there" == A);
+        CHECK(url_data + 7 == A.data());
+    }
+} // RoutingTest_string_view
+#endif
+
 TEST_CASE("simple_response_routing_params")
 {
     CHECK(100 == response(100).code);
@@ -1618,6 +1729,63 @@ TEST_CASE("local_middleware")
     app.stop();
 } // local_middleware
 
+struct LocalCountingMiddleware : crow::ILocalMiddleware
+{
+    struct context
+    {};
+
+    static int after_calls;
+
+    void before_handle(request& /*req*/, response& /*res*/, context& /*ctx*/)
+    {}
+
+    void after_handle(request& /*req*/, response& /*res*/, context& /*ctx*/)
+    {
+        after_calls++;
+    }
+};
+
+int LocalCountingMiddleware::after_calls = 0;
+
+TEST_CASE("local_middleware_after_handle")
+{
+    App<LocalCountingMiddleware> app;
+
+    CROW_ROUTE(app, "/counted")
+      .middlewares<decltype(app), LocalCountingMiddleware>()([]() {
+          return "works!";
+      });
+
+    app.validate();
+
+    // Without a connection
+    {
+        decltype(app)::context_t ctx;
+        decltype(app)::mw_container_t container;
+        request req;
+        response res;
+        req.url = "/counted";
+        req.middleware_context = &ctx;
+        req.middleware_container = &container;
+        LocalCountingMiddleware::after_calls = 0;
+
+        app.handle_full(req, res);
+
+        CHECK(res.code == 200);
+        CHECK(LocalCountingMiddleware::after_calls == 1);
+    }
+
+    // Through a connection
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+    LocalCountingMiddleware::after_calls = 0;
+
+    CHECK(http_exchange("GET /counted HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n").find("200 OK") != std::string::npos);
+    CHECK(LocalCountingMiddleware::after_calls == 1);
+
+    app.stop();
+} // local_middleware_after_handle
+
 struct OnlyMoveConstructor
 {
     OnlyMoveConstructor(int) {}
@@ -2071,6 +2239,39 @@ TEST_CASE("bug_quick_repeated_request")
     app.stop();
 } // bug_quick_repeated_request
 
+TEST_CASE("parser_long_lines")
+{
+    SimpleApp app;
+    CROW_ROUTE(app, "/<path>")
+    ([](const request& req, const std::string&) {
+        return req.url + '|' + req.url_params.get("key") + '|' + req.get_header_value("X-A-Rather-Long-Header-Name-To-Scan-Through") + '|' + req.get_header_value("X-Tab");
+    });
+
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    // Long enough for the vectorized loops, with stop characters at every offset of a block
+    std::string path = "/";
+    for (int i = 0; i < 100; i++)
+        path += std::string(i % 37, 'p') + '/';
+    std::string value;
+    for (int i = 0; i < 100; i++)
+        value += std::string(i % 41 + 1, 'v') + (i % 2 ? "\t" : " ") + "\xc3\xa9";
+    std::string query = "?x=" + std::string(57, 'q') + "&key=" + std::string(93, 'k') + "?/";
+
+    std::string response = http_exchange("GET " + path + query + " HTTP/1.1\r\nHost: localhost\r\nX-A-Rather-Long-Header-Name-To-Scan-Through: " + value +
+                                "\r\nX-Tab:\t" + std::string(70, 't') + "\r\nConnection: close\r\n\r\n");
+    CHECK(response.find("200 OK") != std::string::npos);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == path + '|' + std::string(93, 'k') + "?/|" + value + '|' + std::string(70, 't'));
+
+    // Invalid characters are still caught past the first blocks (the connection is closed without a response)
+    CHECK(http_exchange("GET /ok HTTP/1.1\r\nHost: localhost\r\nX-Bad: " + std::string(100, 'v') + '\x01' + "\r\n\r\n").empty());
+    CHECK(http_exchange("GET /ok HTTP/1.1\r\nHost: localhost\r\nX-Bad" + std::string(100, 'n') + "\"x: v\r\n\r\n").empty());
+    CHECK(http_exchange("GET /" + std::string(100, 'u') + "\x7f HTTP/1.1\r\nHost: localhost\r\n\r\n").empty());
+
+    app.stop();
+} // parser_long_lines
+
 TEST_CASE("simple_url_params")
 {
     static char buf[2048];
@@ -2236,6 +2437,105 @@ TEST_CASE("simple_url_params")
     app.stop();
 } // simple_url_params
 
+TEST_CASE("lazy_url_params")
+{
+    // Parameters are parsed when first read, a copy of unparsed parameters parses its own
+    query_string params("/search?q=a%20b&empty=&flag&x=1#fragment");
+    query_string copy(params);
+    CHECK(string(params.get("q")) == "a b");
+    CHECK(string(params.get("empty")).empty());
+    CHECK(params.get("flag") != nullptr);
+    CHECK(string(copy.get("x")) == "1");
+    CHECK(copy.keys() == std::vector<std::string>{"q", "empty", "flag", "x"});
+
+    params.assign("/other?q=c");
+    CHECK(string(params.get("q")) == "c");
+    CHECK(params.get("x") == nullptr);
+
+    // There's no limit on the number of parameters
+    std::string url = "/many?";
+    for (int i = 0; i < 1000; i++)
+        url += "k" + std::to_string(i) + "=" + std::to_string(i) + "&";
+    url += "list[]=a&list[]=b";
+    query_string many(url);
+    CHECK(string(many.get("k999")) == "999");
+    CHECK(many.get_list("list").size() == 2);
+    CHECK(many.keys().size() == 1002);
+
+    query_string body("a=1&b=2", false);
+    CHECK(string(body.get("b")) == "2");
+
+    // Const reads can come from several threads, only one of them parses the parameters
+    const query_string shared("/shared?a=1&b=2");
+    std::atomic<int> found{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+        readers.emplace_back([&shared, &found] {
+            const char* value = shared.get("b");
+            if (value && string(value) == "2")
+                found++;
+        });
+    for (auto& reader : readers)
+        reader.join();
+    CHECK(found == 4);
+}
+
+TEST_CASE("indexed_url_params")
+{
+    std::string url = "/search?";
+    for (int i = 0; i < 150; i++)
+        url += "p" + std::to_string(i) + "=v" + std::to_string(i) + "&";
+    url += "dup=1&first%20name=John+Smith&tag[]=a&dup=2&tag[]=b&empty&tag%5B%5D=c";
+    query_string params(url);
+
+    for (int i = 0; i < 150; i += 7)
+        CHECK(string(params.get("p" + std::to_string(i))) == "v" + std::to_string(i));
+    CHECK(params.get("p150") == nullptr);
+    CHECK(params.get("p1") != params.get("p10"));
+
+    // Keys are compared decoded, on either side
+    CHECK(string(params.get("first name")) == "John Smith");
+    CHECK(string(params.get("first+name")) == "John Smith");
+    CHECK(string(params.get("first%20name")) == "John Smith");
+    CHECK(string(params.get("empty")).empty());
+
+    // Duplicates are found in the order they're in the URL
+    std::vector<char*> tags = params.get_list("tag");
+    REQUIRE(tags.size() == 3);
+    CHECK(string(tags[0]) == "a");
+    CHECK(string(tags[1]) == "b");
+    CHECK(string(tags[2]) == "c");
+    CHECK(params.get_list("dup", false).size() == 2);
+
+    // Only one of the threads reading a const query string indexes it
+    const query_string shared(url);
+    std::atomic<int> found{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+        readers.emplace_back([&shared, &found, i] {
+            const char* value = shared.get("p" + std::to_string(i * 30));
+            if (value && string(value) == "v" + std::to_string(i * 30) && shared.get_list("tag").size() == 3)
+                found++;
+        });
+    for (auto& reader : readers)
+        reader.join();
+    CHECK(found == 4);
+
+    // Popping a parameter updates the index
+    CHECK(string(params.pop("dup")) == "1");
+    CHECK(string(params.get("dup")) == "2");
+    CHECK(params.pop_list("dup", false).size() == 1);
+    CHECK(params.get("dup") == nullptr);
+    CHECK(string(params.get("p42")) == "v42");
+
+#ifdef CROW_CAN_USE_CPP17
+    CHECK(params.get_view("first name") == "John Smith");
+    CHECK(params.get_view("empty").empty());
+    CHECK(params.get_view("empty").data() != nullptr);
+    CHECK(params.get_view("missing").data() == nullptr);
+#endif
+}
+
 TEST_CASE("route_dynamic")
 {
     SimpleApp app;
@@ -2459,6 +2759,256 @@ TEST_CASE("send_file")
     }
 } // send_file
 
+TEST_CASE("static_file_cache")
+{
+    std::ofstream("static_cache_a.txt", std::ios::binary) << std::string(1000, 'a');
+    std::ofstream("static_cache_b.txt", std::ios::binary) << std::string(1000, 'b');
+    std::ofstream("static_cache_c.txt", std::ios::binary) << std::string(1000, 'c');
+    std::ofstream("static_cache_large.txt", std::ios::binary) << std::string(2500, 'l');
+    std::remove("static_cache_missing.txt");
+
+    {
+        static_file_cache cache(3500, 2000, std::chrono::milliseconds(100));
+        auto a = cache.get("static_cache_a.txt");
+        REQUIRE(a);
+        CHECK(a->exists);
+        CHECK(*a->data == std::string(1000, 'a'));
+        CHECK(a->content_type == "text/plain");
+        CHECK(a->content_length == "1000");
+        CHECK(a->etag == static_file_cache::etag(a->statbuf));
+        CHECK(a->last_modified == static_file_cache::http_date(a->statbuf.st_mtime));
+        CHECK(cache.get("static_cache_a.txt") == a);
+
+        auto missing = cache.get("static_cache_missing.txt");
+        REQUIRE(missing);
+        CHECK_FALSE(missing->exists);
+        CHECK(cache.get("static_cache_large.txt") == nullptr);
+
+        // b is the least recently used file when c doesn't fit
+        auto b = cache.get("static_cache_b.txt");
+        cache.get("static_cache_a.txt");
+        cache.get("static_cache_c.txt");
+        CHECK(cache.size() <= 3500);
+        CHECK(cache.get("static_cache_a.txt") == a);
+        CHECK(cache.get("static_cache_b.txt") != b);
+
+        // Changes are only noticed once the file is revalidated
+        std::ofstream("static_cache_a.txt", std::ios::binary) << std::string(500, 'A');
+        CHECK(cache.get("static_cache_a.txt") == a);
+        std::this_thread::sleep_for(std::chrono::milliseconds(150));
+        auto changed = cache.get("static_cache_a.txt");
+        CHECK(*changed->data == std::string(500, 'A'));
+        CHECK(changed->etag != a->etag);
+        // Responses still sending the old content keep it alive
+        CHECK(*a->data == std::string(1000, 'a'));
+    }
+
+    SimpleApp app;
+    Blueprint bp("cached", ".", ".");
+    app.register_blueprint(bp);
+    app.use_static_cache();
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    auto get = [](const std::string& path) {
+        return http_exchange("GET " + path + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    };
+
+    struct stat statbuf;
+    stat("static_cache_b.txt", &statbuf);
+    for (int i = 0; i < 2; i++)
+    {
+        std::string response = get("/cached/static/static_cache_b.txt");
+        CHECK(response.find("200 OK") != std::string::npos);
+        CHECK(response.find("Content-Length: 1000\r\n") != std::string::npos);
+        CHECK(response.find("ETag: " + static_file_cache::etag(statbuf) + "\r\n") != std::string::npos);
+        CHECK(response.find("Last-Modified: " + static_file_cache::http_date(statbuf.st_mtime) + "\r\n") != std::string::npos);
+        CHECK(response.substr(response.find("\r\n\r\n") + 4) == std::string(1000, 'b'));
+    }
+    CHECK(app.static_cache()->size() > 1000);
+
+    // Files that are too large are read from disk
+    std::string response = get("/cached/static/static_cache_large.txt");
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == std::string(2500, 'l'));
+    CHECK(get("/cached/static/static_cache_missing.txt").find("404 Not Found") != std::string::npos);
+
+    app.stop();
+    std::remove("static_cache_a.txt");
+    std::remove("static_cache_b.txt");
+    std::remove("static_cache_c.txt");
+    std::remove("static_cache_large.txt");
+} // static_file_cache
+
+TEST_CASE("conditional_get")
+{
+    time_t time;
+    CHECK(utility::parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT", time));
+    CHECK(time == 784111777);
+    CHECK(static_file_cache::http_date(time) == "Sun, 06 Nov 1994 08:49:37 GMT");
+    CHECK_FALSE(utility::parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT", time));
+    CHECK_FALSE(utility::parse_http_date("Sun, 06 Now 1994 08:49:37 GMT", time));
+
+    CHECK(utility::etag_matches("\"a\", \"b\"", "\"b\""));
+    CHECK(utility::etag_matches("W/\"a\"", "\"a\""));
+    CHECK(utility::etag_matches("\"a\"", "W/\"a\""));
+    CHECK(utility::etag_matches("*", "\"a\""));
+    CHECK_FALSE(utility::etag_matches("\"a,b\"", "\"a\""));
+    CHECK_FALSE(utility::etag_matches("\"ab\"", "\"a\""));
+
+    std::ofstream("conditional_test.txt", std::ios::binary) << "some static content";
+    struct stat statbuf;
+    stat("conditional_test.txt", &statbuf);
+    std::string etag = static_file_cache::etag(statbuf);
+    std::string last_modified = static_file_cache::http_date(statbuf.st_mtime);
+
+    SimpleApp app;
+    app.use_dynamic_etags();
+    CROW_ROUTE(app, "/file")
+    ([](response& res) {
+        res.set_static_file_info("conditional_test.txt");
+        res.end();
+    });
+    int calls = 0;
+    CROW_ROUTE(app, "/dynamic")
+    ([&calls] {
+        calls++;
+        return "some dynamic content";
+    });
+    CROW_ROUTE(app, "/post").methods("POST"_method)([] {
+        return "not cacheable";
+    });
+
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    auto request = [](const std::string& request_line, const std::string& headers) {
+        return http_exchange(request_line + " HTTP/1.1\r\nHost: localhost\r\n" + headers + "Connection: close\r\n\r\n");
+    };
+
+    std::string response = request("GET /file", "");
+    CHECK(response.find("200 OK") != std::string::npos);
+    CHECK(response.find("ETag: " + etag + "\r\n") != std::string::npos);
+    CHECK(response.find("Last-Modified: " + last_modified + "\r\n") != std::string::npos);
+
+    response = request("GET /file", "If-None-Match: \"other\", " + etag + "\r\n");
+    CHECK(response.find("304 Not Modified") != std::string::npos);
+    CHECK(response.find("ETag: " + etag + "\r\n") != std::string::npos);
+    CHECK(response.find("Content-Length") == std::string::npos);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4).empty());
+
+    response = request("GET /file", "If-Modified-Since: " + last_modified + "\r\n");
+    CHECK(response.find("304 Not Modified") != std::string::npos);
+    response = request("GET /file", "If-Modified-Since: " + static_file_cache::http_date(statbuf.st_mtime - 1) + "\r\n");
+    CHECK(response.find("200 OK") != std::string::npos);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == "some static content");
+    // If-None-Match wins over If-Modified-Since
+    response = request("GET /file", "If-None-Match: \"other\"\r\nIf-Modified-Since: " + last_modified + "\r\n");
+    CHECK(response.find("200 OK") != std::string::npos);
+
+    response = request("GET /dynamic", "");
+    size_t etag_start = response.find("ETag: W/\"");
+    REQUIRE(etag_start != std::string::npos);
+    std::string dynamic_etag = response.substr(etag_start + 6, response.find("\r\n", etag_start) - etag_start - 6);
+    response = request("GET /dynamic", "If-None-Match: " + dynamic_etag + "\r\n");
+    CHECK(response.find("304 Not Modified") != std::string::npos);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4).empty());
+    CHECK(calls == 2);
+
+    response = request("POST /post", "Content-Length: 0\r\nIf-None-Match: *\r\n");
+    CHECK(response.find("200 OK") != std::string::npos);
+    CHECK(response.find("ETag") == std::string::npos);
+
+    app.stop();
+    std::remove("conditional_test.txt");
+} // conditional_get
+
+TEST_CASE("range_requests")
+{
+    std::vector<utility::byte_range> ranges;
+    CHECK(utility::parse_ranges("bytes=0-9, 20-, -5", 100, ranges));
+    REQUIRE(ranges.size() == 3);
+    CHECK((ranges[0].first == 0 && ranges[0].last == 9));
+    CHECK((ranges[1].first == 20 && ranges[1].last == 99));
+    CHECK((ranges[2].first == 95 && ranges[2].last == 99));
+    CHECK(utility::parse_ranges("bytes=50-1000", 100, ranges));
+    CHECK((ranges.size() == 1 && ranges[0].last == 99));
+    CHECK(utility::parse_ranges("bytes=100-", 100, ranges));
+    CHECK(ranges.empty());
+    CHECK_FALSE(utility::parse_ranges("bytes=9-0", 100, ranges));
+    CHECK_FALSE(utility::parse_ranges("items=0-9", 100, ranges));
+    CHECK_FALSE(utility::parse_ranges("bytes=a-9", 100, ranges));
+    CHECK_FALSE(utility::parse_ranges("bytes=0-0,1-1,2-2", 100, ranges, 2));
+
+    std::string content;
+    for (int i = 0; i < 3000; i++)
+        content += static_cast<char>('a' + i % 26);
+    std::ofstream("range_test.txt", std::ios::binary) << content;
+
+    SimpleApp app;
+    Blueprint bp("cached", ".", ".");
+    app.register_blueprint(bp);
+    app.use_static_cache();
+    CROW_ROUTE(app, "/file")
+    ([](response& res) {
+        res.set_static_file_info("range_test.txt");
+        res.end();
+    });
+    CROW_ROUTE(app, "/dynamic")
+    ([&content] {
+        return content;
+    });
+
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    auto get = [](const std::string& path, const std::string& headers) {
+        return http_exchange("GET " + path + " HTTP/1.1\r\nHost: localhost\r\n" + headers + "Connection: close\r\n\r\n");
+    };
+    auto body = [](const std::string& response) {
+        return response.substr(response.find("\r\n\r\n") + 4);
+    };
+
+    for (std::string path : {"/file", "/cached/static/range_test.txt", "/dynamic"})
+    {
+        std::string response = get(path, "Range: bytes=100-199\r\n");
+        CHECK(response.find("206 Partial Content") != std::string::npos);
+        CHECK(response.find("Content-Range: bytes 100-199/3000\r\n") != std::string::npos);
+        CHECK(response.find("Content-Length: 100\r\n") != std::string::npos);
+        CHECK(body(response) == content.substr(100, 100));
+
+        response = get(path, "Range: bytes=-10\r\n");
+        CHECK(body(response) == content.substr(2990));
+
+        response = get(path, "Range: bytes=0-1,2990-\r\n");
+        CHECK(response.find("206 Partial Content") != std::string::npos);
+        size_t boundary_start = response.find("multipart/byteranges; boundary=");
+        REQUIRE(boundary_start != std::string::npos);
+        std::string boundary = response.substr(boundary_start + 31, response.find("\r\n", boundary_start) - boundary_start - 31);
+        std::string content_type = path == "/dynamic" ? "" : "\r\nContent-Type: text/plain";
+        CHECK(body(response) == "--" + boundary + content_type + "\r\nContent-Range: bytes 0-1/3000\r\n\r\n" + content.substr(0, 2) +
+                                  "\r\n--" + boundary + content_type + "\r\nContent-Range: bytes 2990-2999/3000\r\n\r\n" + content.substr(2990) +
+                                  "\r\n--" + boundary + "--\r\n");
+        CHECK(response.find("Content-Length: " + std::to_string(body(response).size()) + "\r\n") != std::string::npos);
+
+        response = get(path, "Range: bytes=3000-\r\n");
+        CHECK(response.find("416 Range Not Satisfiable") != std::string::npos);
+        CHECK(response.find("Content-Range: bytes */3000\r\n") != std::string::npos);
+
+        // Invalid ranges and outdated If-Range validators get the whole body
+        CHECK(body(get(path, "Range: bytes=5-1\r\n")) == content);
+        CHECK(body(get(path, "Range: bytes=0-9\r\nIf-Range: \"outdated\"\r\n")) == content);
+    }
+
+    struct stat statbuf;
+    stat("range_test.txt", &statbuf);
+    std::string response = get("/file", "Range: bytes=0-9\r\nIf-Range: " + static_file_cache::etag(statbuf) + "\r\n");
+    CHECK(response.find("Accept-Ranges: bytes\r\n") != std::string::npos);
+    CHECK(body(response) == content.substr(0, 10));
+
+    app.stop();
+    std::remove("range_test.txt");
+} // range_requests
+
 TEST_CASE("stream_response")
 {
     SimpleApp app;
@@ -2830,9 +3380,6 @@ TEST_CASE("websocket_max_payload")
 #ifdef CROW_ENABLE_COMPRESSION
 TEST_CASE("zlib_compression")
 {
-    static char buf_deflate[2048];
-    static char buf_gzip[2048];
-
     SimpleApp app_deflate, app_gzip;
 
     std::string expected_string = "Although moreover mistaken kindness me feelings do be marianne. Son over own nay with tell they cold upon are. "
@@ -2915,6 +3462,17 @@ TEST_CASE("zlib_compression")
         return inflated_string;
     };
 
+    // The response can arrive in several parts
+    auto receive_response = [](asio::ip::tcp::socket& socket) {
+        std::string response;
+        char buf[2048];
+        size_t header_end;
+        while ((header_end = response.find("\r\n\r\n")) == std::string::npos ||
+               response.size() < header_end + 4 + std::stoul(response.substr(response.find("Content-Length: ") + 16)))
+            response.append(buf, socket.receive(asio::buffer(buf)));
+        return response;
+    };
+
     asio::io_service is;
     {
         // Compression
@@ -2926,57 +3484,8 @@ TEST_CASE("zlib_compression")
             socket[0].send(asio::buffer(test_compress_msg));
             socket[1].send(asio::buffer(test_compress_msg));
 
-            socket[0].receive(asio::buffer(buf_deflate, 2048));
-            socket[1].receive(asio::buffer(buf_gzip, 2048));
-
-            std::string response_deflate;
-            std::string response_gzip;
-
-            for (unsigned i{0}; i < 2048; i++)
-            {
-                if (buf_deflate[i] == 0)
-                {
-                    bool end = true;
-                    for (unsigned j = i; j < 2048; j++)
-                    {
-                        if (buf_deflate[j] != 0)
-                        {
-                            end = false;
-                            break;
-                        }
-                    }
-                    if (end)
-                    {
-                        response_deflate.push_back(0);
-                        response_deflate.push_back(0);
-                        break;
-                    }
-                }
-                response_deflate.push_back(buf_deflate[i]);
-            }
-
-            for (unsigned i{0}; i < 2048; i++)
-            {
-                if (buf_gzip[i] == 0)
-                {
-                    bool end = true;
-                    for (unsigned j = i; j < 2048; j++)
-                    {
-                        if (buf_gzip[j] != 0)
-                        {
-                            end = false;
-                            break;
-                        }
-                    }
-                    if (end)
-                    {
-                        response_deflate.push_back(0);
-                        response_deflate.push_back(0);
-                        break;
-                    }
-                }
-                response_gzip.push_back(buf_gzip[i]);
-            }
+            std::string response_deflate = receive_response(socket[0]);
+            std::string response_gzip = receive_response(socket[1]);
 
             response_deflate = inflate_string(response_deflate.substr(response_deflate.find("\r\n\r\n") + 4));
             response_gzip = inflate_string(response_gzip.substr(response_gzip.find("\r\n\r\n") + 4));
@@ -2995,13 +3504,13 @@ TEST_CASE("zlib_compression")
             socket[0].send(asio::buffer(test_compress_no_header_msg));
             socket[1].send(asio::buffer(test_compress_no_header_msg));
 
-            socket[0].receive(asio::buffer(buf_deflate, 2048));
-            socket[1].receive(asio::buffer(buf_gzip, 2048));
-
-            std::string response_deflate(buf_deflate);
-            std::string response_gzip(buf_gzip);
-            response_deflate = response_deflate.substr(98);
-            response_gzip = response_gzip.substr(98);
+            std::string response_deflate = receive_response(socket[0]);
+            std::string response_gzip = receive_response(socket[1]);
+            // The response varies on Accept-Encoding even when it isn't compressed
+            CHECK(response_deflate.find("Vary: Accept-Encoding\r\n") != std::string::npos);
+            CHECK(response_gzip.find("Vary: Accept-Encoding\r\n") != std::string::npos);
+            response_deflate = response_deflate.substr(response_deflate.find("\r\n\r\n") + 4);
+            response_gzip = response_gzip.substr(response_gzip.find("\r\n\r\n") + 4);
 
             socket[0].close();
             socket[1].close();
@@ -3017,13 +3526,10 @@ TEST_CASE("zlib_compression")
             socket[0].send(asio::buffer(test_none_msg));
             socket[1].send(asio::buffer(test_none_msg));
 
-            socket[0].receive(asio::buffer(buf_deflate, 2048));
-            socket[1].receive(asio::buffer(buf_gzip, 2048));
-
-            std::string response_deflate(buf_deflate);
-            std::string response_gzip(buf_gzip);
-            response_deflate = response_deflate.substr(98);
-            response_gzip = response_gzip.substr(98);
+            std::string response_deflate = receive_response(socket[0]);
+            std::string response_gzip = receive_response(socket[1]);
+            response_deflate = response_deflate.substr(response_deflate.find("\r\n\r\n") + 4);
+            response_gzip = response_gzip.substr(response_gzip.find("\r\n\r\n") + 4);
 
             socket[0].close();
             socket[1].close();
@@ -3035,6 +3541,370 @@ TEST_CASE("zlib_compression")
     app_deflate.stop();
     app_gzip.stop();
 } // zlib_compression
+
+TEST_CASE("compression_options")
+{
+    compression::options opts;
+    CHECK(compression::should_compress("", 10, opts));
+    CHECK(compression::should_compress("application/json; charset=utf-8", 10, opts));
+    CHECK_FALSE(compression::should_compress("application/json", 0, opts));
+    CHECK_FALSE(compression::should_compress("image/PNG", 10, opts));
+    CHECK_FALSE(compression::should_compress("video/mp4", 10, opts));
+
+    opts.min_size = 64;
+    opts.allowed_types = {"text/*", "application/json"};
+    CHECK_FALSE(compression::should_compress("text/html", 63, opts));
+    CHECK(compression::should_compress("text/html", 64, opts));
+    CHECK(compression::should_compress("Application/JSON ; charset=utf-8", 64, opts));
+    CHECK_FALSE(compression::should_compress("application/javascript", 64, opts));
+    CHECK_FALSE(compression::should_compress("", 64, opts));
+
+    // The same thread's stream is reused, including after the options change
+    std::string original(4096, 'a');
+    for (int level : {1, 1, 9})
+    {
+        opts.level = level;
+        std::string body = original;
+        REQUIRE(compression::deflater::this_thread().compress(body, compression::algorithm::GZIP, opts));
+        CHECK(body.size() < original.size());
+        CHECK(compression::decompress_string(body) == original);
+    }
+    CHECK(compression::decompress_string(compression::compress_string(original, compression::algorithm::DEFLATE)) == original);
+
+    SimpleApp app;
+    compression::options app_options;
+    app_options.min_size = 16;
+    CROW_ROUTE(app, "/small")
+    ([] {
+        return "tiny";
+    });
+    CROW_ROUTE(app, "/image")
+    ([] {
+        return response("png", std::string(100, 'x'));
+    });
+    CROW_ROUTE(app, "/text")
+    ([] {
+        return std::string(100, 'x');
+    });
+
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).use_compression(compression::algorithm::GZIP, app_options).run_async();
+    app.wait_for_server_start();
+
+    auto get = [](const std::string& url) {
+        return http_exchange("GET " + url + " HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip\r\nConnection: close\r\n\r\n");
+    };
+
+    std::string small = get("/small");
+    CHECK(small.find("200 OK") != std::string::npos);
+    CHECK(small.find("Content-Encoding") == std::string::npos);
+    std::string image = get("/image");
+    CHECK(image.find("200 OK") != std::string::npos);
+    CHECK(image.find("Content-Encoding") == std::string::npos);
+    std::string text = get("/text");
+    CHECK(text.find("Content-Encoding: gzip") != std::string::npos);
+    CHECK(compression::decompress_string(text.substr(text.find("\r\n\r\n") + 4)) == std::string(100, 'x'));
+
+    app.stop();
+} // compression_options
+
+TEST_CASE("streaming_compression")
+{
+    SimpleApp app;
+    std::string body;
+    for (int i = 0; body.size() < 200000; i++)
+        body += "line " + std::to_string(i) + " of a large export\n";
+
+    CROW_ROUTE(app, "/export")
+    ([&body] {
+        return body;
+    });
+    CROW_ROUTE(app, "/flushed")
+    ([&body](const request&, response& res) {
+        res.flush_compressed_chunks = true;
+        res.end(body);
+    });
+    // The flag is kept when the handler returns the response
+    CROW_ROUTE(app, "/returned")
+    ([&body] {
+        response res(body);
+        res.flush_compressed_chunks = true;
+        return res;
+    });
+
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).stream_threshold(1024).use_compression(compression::algorithm::GZIP).run_async();
+    app.wait_for_server_start();
+
+    auto get = [](const std::string& url, const std::string& version) {
+        return http_exchange("GET " + url + " HTTP/" + version + "\r\nHost: localhost\r\nAccept-Encoding: gzip\r\nConnection: close\r\n\r\n");
+    };
+    auto dechunk = [](const std::string& chunked, size_t& chunks) {
+        std::string result;
+        chunks = 0;
+        size_t pos = 0;
+        while (true)
+        {
+            size_t line_end = chunked.find("\r\n", pos);
+            size_t size = std::stoul(chunked.substr(pos, line_end - pos), nullptr, 16);
+            if (size == 0)
+                break;
+            result += chunked.substr(line_end + 2, size);
+            pos = line_end + 2 + size + 2;
+            chunks++;
+        }
+        return result;
+    };
+
+    for (std::string url : {"/export", "/flushed", "/returned"})
+    {
+        std::string response = get(url, "1.1");
+        std::string headers = response.substr(0, response.find("\r\n\r\n"));
+        CHECK(headers.find("Content-Encoding: gzip") != std::string::npos);
+        CHECK(headers.find("Transfer-Encoding: chunked") != std::string::npos);
+        CHECK(headers.find("Content-Length") == std::string::npos);
+
+        size_t chunks;
+        std::string compressed = dechunk(response.substr(headers.size() + 4), chunks);
+        CHECK(compression::decompress_string(compressed) == body);
+        // Every 16KB piece of a flushed body is sent as soon as it's compressed
+        if (url != "/export")
+            CHECK(chunks == (body.size() + 16383) / 16384);
+    }
+
+    // HTTP/1.0 clients don't support chunked bodies, they get the whole body compressed instead
+    std::string response = get("/export", "1.0");
+    std::string headers = response.substr(0, response.find("\r\n\r\n"));
+    CHECK(headers.find("Transfer-Encoding") == std::string::npos);
+    CHECK(compression::decompress_string(response.substr(headers.size() + 4)) == body);
+
+    app.stop();
+} // streaming_compression
+
+TEST_CASE("precompressed_static")
+{
+    std::string script;
+    for (int i = 0; i < 200; i++)
+        script += "console.log(" + std::to_string(i) + ");\n";
+    std::ofstream("precompressed_test.js", std::ios::binary) << script;
+    std::ofstream("precompressed_test.png", std::ios::binary) << script;
+    std::remove("precompressed_test.js.gz");
+    std::remove("precompressed_test.png.gz");
+
+    // Only compressible types get a compressed copy, and only once
+    CHECK(compression::precompress_files({"precompressed_test.js", "precompressed_test.png"}) == 1);
+    CHECK(compression::precompress_files({"precompressed_test.js", "precompressed_test.js.gz"}) == 0);
+    std::ifstream gz("precompressed_test.js.gz", std::ios::binary);
+    std::string compressed((std::istreambuf_iterator<char>(gz)), std::istreambuf_iterator<char>());
+    CHECK(compression::decompress_string(compressed) == script);
+
+
+    SimpleApp app;
+    CROW_ROUTE(app, "/script")
+    ([](response& res) {
+        res.set_static_file_info("precompressed_test.js");
+        res.end();
+    });
+    CHECK_THROWS(app.use_precompressed_static({"lzma"}));
+    app.use_precompressed_static({"br", "gzip", "zstd"});
+
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    auto get = [](const std::string& accept_encoding) {
+        return http_exchange("GET /script HTTP/1.1\r\nHost: localhost\r\n" + accept_encoding + "Connection: close\r\n\r\n");
+    };
+
+    // There's no .br file, so gzip is used
+    std::string response = get("Accept-Encoding: br, gzip\r\n");
+    CHECK(response.find("Content-Encoding: gzip\r\n") != std::string::npos);
+    CHECK(response.find("Vary: Accept-Encoding\r\n") != std::string::npos);
+    CHECK(response.find("Content-Length: " + std::to_string(compressed.size()) + "\r\n") != std::string::npos);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == compressed);
+
+    response = get("");
+    CHECK(response.find("Content-Encoding") == std::string::npos);
+    CHECK(response.find("Vary: Accept-Encoding\r\n") != std::string::npos);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == script);
+
+    // gzip is refused
+    response = get("Accept-Encoding: gzip;q=0, *\r\n");
+    CHECK(response.find("Content-Encoding") == std::string::npos);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == script);
+
+    app.stop();
+    std::remove("precompressed_test.js");
+    std::remove("precompressed_test.js.gz");
+    std::remove("precompressed_test.png");
+} // precompressed_static
+
+TEST_CASE("request_decompression")
+{
+    SimpleApp app;
+    app.use_request_decompression(1000);
+    CROW_ROUTE(app, "/echo").methods("POST"_method)([](const request& req) {
+        return req.body + (req.get_header_value("Content-Encoding").empty() ? "" : " (still compressed)");
+    });
+
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    asio::io_service is;
+    asio::ip::tcp::socket c(is);
+    c.connect(asio::ip::tcp::endpoint(asio::ip::address::from_string(LOCALHOST_ADDRESS), 45451));
+    // Every request is sent on the same connection, to make sure rejected bodies are fully read
+    auto post = [&c](const std::string& encoding, const std::string& body) {
+        c.send(asio::buffer("POST /echo HTTP/1.1\r\nHost: localhost\r\nContent-Encoding: " + encoding + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body));
+        std::string response;
+        char buf[2048];
+        size_t header_end;
+        while ((header_end = response.find("\r\n\r\n")) == std::string::npos ||
+               response.size() < header_end + 4 + std::stoul(response.substr(response.find("Content-Length: ") + 16)))
+            response.append(buf, c.receive(asio::buffer(buf)));
+        return response;
+    };
+
+    std::string text = "a body that was compressed by the client";
+    std::string response = post("gzip", compression::compress_string(text, compression::algorithm::GZIP));
+    CHECK(response.find("200 OK") != std::string::npos);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == text);
+
+    response = post("deflate", compression::compress_string(text, compression::algorithm::DEFLATE));
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == text);
+
+    // Other encodings are left to the handler
+    response = post("br", "not really brotli");
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == "not really brotli (still compressed)");
+
+    // A small body that inflates beyond the limit
+    std::string bomb = compression::compress_string(std::string(100000, '\0'), compression::algorithm::GZIP);
+    CHECK(bomb.size() < 1000);
+    CHECK(post("gzip", bomb).find("413 Payload Too Large") != std::string::npos);
+
+    CHECK(post("gzip", "definitely not gzip").find("400 Bad Request") != std::string::npos);
+    std::string truncated = compression::compress_string(text, compression::algorithm::GZIP);
+    truncated.resize(truncated.size() - 4);
+    CHECK(post("gzip", truncated).find("400 Bad Request") != std::string::npos);
+
+    response = post("gzip", compression::compress_string(text, compression::algorithm::GZIP));
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == text);
+
+    app.stop();
+
+    using compression::inflater;
+    inflater stream;
+    auto inflate = [&stream](const std::vector<std::string>& parts, std::string& out) {
+        out.clear();
+        inflater::result result = inflater::result::invalid;
+        if (stream.begin())
+        {
+            for (const std::string& part : parts)
+                result = stream.write(part.data(), part.size(), out, 100000);
+        }
+        return result;
+    };
+    std::string out;
+
+    // Bodies that fill the output buffer exactly
+    for (size_t size : {16383, 16384, 16385, 32768})
+    {
+        std::string body(size, 'b');
+        CHECK(inflate({compression::compress_string(body, compression::algorithm::GZIP)}, out) == inflater::result::finished);
+        CHECK(out == body);
+    }
+
+    // Concatenated gzip members, in one piece or split between them
+    std::string first = compression::compress_string("first ", compression::algorithm::GZIP);
+    std::string second = compression::compress_string("second", compression::algorithm::GZIP);
+    CHECK(inflate({first + second}, out) == inflater::result::finished);
+    CHECK(out == "first second");
+    CHECK(inflate({first, second}, out) == inflater::result::finished);
+    CHECK(out == "first second");
+    CHECK(inflate({first, second.substr(0, 10)}, out) == inflater::result::ok);
+    CHECK_FALSE(stream.finished());
+
+    // Only gzip streams can have more than one member
+    std::string zlib = compression::compress_string(text, compression::algorithm::DEFLATE);
+    CHECK(inflate({zlib + zlib}, out) == inflater::result::invalid);
+    CHECK(inflate({first + "garbage"}, out) == inflater::result::invalid);
+} // request_decompression
+
+TEST_CASE("accept_encoding_negotiation")
+{
+    std::string header = " deflate ;q=0.5, GZIP, br;q=0 , *;q=0.1";
+    utility::accept_encoding accepted(header);
+    CHECK(accepted.quality("gzip") == 1.f);
+    CHECK(accepted.quality("deflate") == 0.5f);
+    CHECK_FALSE(accepted.accepts("br"));
+    CHECK(accepted.quality("zstd") == 0.1f);
+
+    // q values follow the grammar exactly, anything else refuses the coding
+    std::string qvalues = "a;q=1.000, b;q=0.001 , c;q=0., d;q=1.5, e;q=0.1234, f;q=.5, g;q=0,5, h;q=2, i;q=-1, j;q=1.";
+    utility::accept_encoding weighted(qvalues);
+    CHECK(weighted.quality("a") == 1.f);
+    CHECK(weighted.quality("b") == 0.001f);
+    CHECK(weighted.quality("c") == 0.f);
+    CHECK_FALSE(weighted.accepts("d"));
+    CHECK_FALSE(weighted.accepts("e"));
+    CHECK_FALSE(weighted.accepts("f"));
+    CHECK_FALSE(weighted.accepts("g"));
+    CHECK_FALSE(weighted.accepts("h"));
+    CHECK_FALSE(weighted.accepts("i"));
+    CHECK(weighted.quality("j") == 1.f);
+
+    std::string x_gzip = "x-gzip";
+    CHECK(utility::accept_encoding(x_gzip).accepts("gzip"));
+    std::string empty;
+    CHECK_FALSE(utility::accept_encoding(empty).accepts("gzip"));
+
+    using compression::algorithm;
+    auto negotiate = [](const std::string& header, const std::vector<algorithm>& available) -> int {
+        algorithm chosen = algorithm::DEFLATE;
+        if (!compression::negotiate(utility::accept_encoding(header), available, chosen))
+            return -1;
+        return chosen;
+    };
+    std::vector<algorithm> both{algorithm::GZIP, algorithm::DEFLATE};
+    CHECK(negotiate("gzip, deflate", both) == algorithm::GZIP);
+    CHECK(negotiate("deflate, gzip", {algorithm::DEFLATE, algorithm::GZIP}) == algorithm::DEFLATE);
+    CHECK(negotiate("gzip;q=0.5, deflate", both) == algorithm::DEFLATE);
+    CHECK(negotiate("gzip;q=0, deflate;q=0.2", both) == algorithm::DEFLATE);
+    CHECK(negotiate("gzip;q=0", both) == -1);
+    CHECK(negotiate("*", both) == algorithm::GZIP);
+    CHECK(negotiate("*;q=0.1, deflate;q=0.5", both) == algorithm::DEFLATE);
+    CHECK(negotiate("identity", both) == -1);
+    CHECK(negotiate("", both) == -1);
+#ifdef CROW_ENABLE_ZSTD
+    std::vector<algorithm> all{algorithm::ZSTD, algorithm::GZIP, algorithm::DEFLATE};
+    CHECK(negotiate("gzip, deflate, zstd", all) == algorithm::ZSTD);
+    CHECK(negotiate("zstd;q=0.5, gzip", all) == algorithm::GZIP);
+    CHECK(negotiate("zstd", both) == -1);
+#endif
+
+    algorithm chosen = algorithm::GZIP;
+    CHECK_FALSE(compression::negotiate(utility::accept_encoding(empty), {algorithm::DEFLATE, algorithm::GZIP}, chosen));
+    CHECK(chosen == algorithm::DEFLATE);
+
+    SimpleApp app;
+    CROW_ROUTE(app, "/")
+    ([] {
+        return std::string(1000, 'x');
+    });
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).use_compression({algorithm::GZIP, algorithm::DEFLATE}).run_async();
+    app.wait_for_server_start();
+
+    auto get = [](const std::string& accept_encoding) {
+        return http_exchange("GET / HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: " + accept_encoding + "\r\nConnection: close\r\n\r\n");
+    };
+
+    std::string response = get("deflate;q=1, gzip;q=0.9");
+    CHECK(response.find("Content-Encoding: deflate\r\n") != std::string::npos);
+    CHECK(compression::decompress_string(response.substr(response.find("\r\n\r\n") + 4)) == std::string(1000, 'x'));
+    CHECK(get("gzip, deflate").find("Content-Encoding: gzip\r\n") != std::string::npos);
+    response = get("gzip;q=0");
+    CHECK(response.find("Content-Encoding") == std::string::npos);
+    CHECK(response.find("Vary: Accept-Encoding\r\n") != std::string::npos);
+
+    app.stop();
+} // accept_encoding_negotiation
 #endif
 
 TEST_CASE("catchall")
@@ -3287,6 +4157,28 @@ TEST_CASE("sanitize_filename")
     CHECK(sanitize_filename("/abc/") == "_abc/");
 }
 
+#ifndef _WIN32
+TEST_CASE("list_files")
+{
+    // A link back to a parent directory isn't followed, a link to a file is listed
+    mkdir("list_files_test", 0755);
+    mkdir("list_files_test/sub", 0755);
+    std::ofstream("list_files_test/sub/a.txt") << "a";
+    CHECK(symlink("..", "list_files_test/sub/loop") == 0);
+    CHECK(symlink("a.txt", "list_files_test/sub/b.txt") == 0);
+
+    std::vector<std::string> files = utility::list_files("list_files_test");
+    std::sort(files.begin(), files.end());
+    CHECK(files == std::vector<std::string>{"list_files_test/sub/a.txt", "list_files_test/sub/b.txt"});
+
+    unlink("list_files_test/sub/loop");
+    unlink("list_files_test/sub/b.txt");
+    unlink("list_files_test/sub/a.txt");
+    rmdir("list_files_test/sub");
+    rmdir("list_files_test");
+} // list_files
+#endif
+
 TEST_CASE("get_port")
 {
     SimpleApp app;
@@ -3370,6 +4262,131 @@ TEST_CASE("timeout")
     test_timeout(5);
 } // timeout
 
+TEST_CASE("log_level")
+{
+    LogLevel previous = logger::get_current_log_level();
+    int evaluated = 0;
+    auto message = [&evaluated] {
+        evaluated++;
+        return "log_level test";
+    };
+
+    logger::setLogLevel(LogLevel::Error);
+    CROW_LOG_INFO << message();
+    CHECK(evaluated == 0);
+    CROW_LOG_CRITICAL << message();
+    CHECK(evaluated == 1);
+
+    // The macros shouldn't capture a following else
+    if (evaluated == 0)
+        CROW_LOG_CRITICAL << message();
+    else
+        evaluated = 10;
+    CHECK(evaluated == 10);
+
+    logger::setLogLevel(previous);
+} // log_level
+
+TEST_CASE("async_log_handler")
+{
+    auto count_lines = [](const std::string& text, const std::string& needle) {
+        size_t count = 0;
+        for (size_t pos = text.find(needle); pos != std::string::npos; pos = text.find(needle, pos + 1))
+            count++;
+        return count;
+    };
+
+    {
+        std::ostringstream out;
+        AsyncLogHandler handler(out, 16, AsyncLogHandler::overflow_policy::block);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++)
+        {
+            threads.emplace_back([&handler] {
+                for (int i = 0; i < 100; i++)
+                    handler.log("message", LogLevel::Warning);
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        handler.flush();
+
+        CHECK(handler.dropped() == 0);
+        CHECK(count_lines(out.str(), "[WARNING ] message\n") == 400);
+        CHECK(out.str().front() == '(');
+    }
+
+    {
+        std::ostringstream out;
+        {
+            AsyncLogHandler handler(out, 4, AsyncLogHandler::overflow_policy::drop);
+            for (int i = 0; i < 100; i++)
+                handler.log("message", LogLevel::Info);
+            handler.flush();
+            CHECK(count_lines(out.str(), "[INFO    ] message\n") + handler.dropped() == 100);
+            handler.log("last", LogLevel::Error);
+        }
+        // Destroying the handler writes whatever is left
+        CHECK(count_lines(out.str(), "[ERROR   ] last\n") == 1);
+    }
+} // async_log_handler
+
+TEST_CASE("access_log")
+{
+    static char buf[2048];
+
+    std::ostringstream text_out, json_out;
+    SimpleApp text_app, json_app;
+    text_app.use_access_log(text_out);
+    json_app.use_access_log(json_out, crow::access_log::format::json);
+
+    CROW_ROUTE(text_app, "/logged/<int>")
+    ([](int code) {
+        return response(code, "body");
+    });
+    CROW_ROUTE(json_app, "/json")
+    ([] {
+        return "hello";
+    });
+
+    auto _ = text_app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    auto _j = json_app.bindaddr(LOCALHOST_ADDRESS).port(45452).run_async();
+    text_app.wait_for_server_start();
+    json_app.wait_for_server_start();
+
+    asio::io_service is;
+    auto send = [&](uint16_t port, const std::string& sendmsg) {
+        asio::ip::tcp::socket c(is);
+        c.connect(asio::ip::tcp::endpoint(
+          asio::ip::address::from_string(LOCALHOST_ADDRESS), port));
+        c.send(asio::buffer(sendmsg));
+        c.receive(asio::buffer(buf, 2048));
+        c.close();
+    };
+
+    send(45451, "GET /logged/201 HTTP/1.0\r\n\r\n");
+    send(45451, "POST /nowhere HTTP/1.0\r\nContent-Length: 3\r\n\r\nabc");
+    send(45452, "GET /json HTTP/1.0\r\n\r\n");
+
+    text_app.access_logger()->flush();
+    json_app.access_logger()->flush();
+
+    std::string text = text_out.str();
+    CHECK(std::count(text.begin(), text.end(), '\n') == 2);
+    CHECK(text.find(" 127.0.0.1:") != std::string::npos);
+    CHECK(text.find(" GET /logged/<int> 201 0 4 ") != std::string::npos);
+    CHECK(text.find(" POST - 404 0 ") != std::string::npos);
+
+    std::string json = json_out.str();
+    CHECK(json.find("\"peer\":\"127.0.0.1:") != std::string::npos);
+    CHECK(json.find("\"method\":\"GET\",\"route\":\"/json\",\"status\":200,\"bytes_in\":0,\"bytes_out\":5,") != std::string::npos);
+    CHECK(text_app.access_logger()->dropped() == 0);
+
+    text_app.stop();
+    json_app.stop();
+} // access_log
+
 TEST_CASE("task_timer")
 {
     using work_guard_type = asio::executor_work_guard<asio::io_service::executor_type>;
@@ -3410,6 +4427,153 @@ TEST_CASE("task_timer")
     io_thread.join();
 } // task_timer
 
+TEST_CASE("latency_histogram")
+{
+    using crow::metrics::latency_histogram;
+
+    // Every value falls between its bucket's bounds, and buckets are contiguous
+    for (uint64_t value : {0ull, 1ull, 7ull, 8ull, 15ull, 16ull, 17ull, 31ull, 32ull, 1000ull, 123456789ull})
+    {
+        unsigned index = latency_histogram::bucket_index(value);
+        CHECK(latency_histogram::bucket_lower_bound(index) <= value);
+        CHECK(value < latency_histogram::bucket_upper_bound(index));
+    }
+    for (unsigned i = 0; i + 1 < latency_histogram::bucket_count; i++)
+        CHECK(latency_histogram::bucket_upper_bound(i) == latency_histogram::bucket_lower_bound(i + 1));
+    CHECK(latency_histogram::bucket_index(~0ull) == latency_histogram::bucket_count - 1);
+
+    latency_histogram histogram;
+    for (uint64_t i = 1; i <= 100; i++)
+        histogram.record(i * 1000);
+    CHECK(histogram.count() == 100);
+    CHECK(histogram.sum() == 5050000);
+    // within the 12.5% bucket precision
+    CHECK(histogram.value_at_quantile(0.5) >= 50000);
+    CHECK(histogram.value_at_quantile(0.5) < 50000 * 1.125);
+    CHECK(histogram.value_at_quantile(0.99) >= 99000);
+    CHECK(histogram.value_at_quantile(0.99) < 99000 * 1.125);
+    CHECK(histogram.count_at_or_below(0) == 0);
+    CHECK(histogram.count_at_or_below(1000000) == 100);
+} // latency_histogram
+
+TEST_CASE("route_metrics")
+{
+    SimpleApp app;
+    app.metrics_endpoint();
+
+    CROW_ROUTE(app, "/metered/<int>")
+    ([](int code) {
+        return response(code, "body");
+    });
+
+    CROW_ROUTE(app, "/echo")
+      .methods("POST"_method)([](const request& req) {
+          return req.body;
+      });
+
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    // HTTP/1.0 connections are closed once the response is sent
+    http_exchange("GET /metered/200 HTTP/1.0\r\n\r\n");
+    http_exchange("GET /metered/200 HTTP/1.0\r\n\r\n");
+    http_exchange("GET /metered/404 HTTP/1.0\r\n\r\n");
+    http_exchange("POST /echo HTTP/1.0\r\nContent-Length: 5\r\n\r\nhello");
+
+    bool checked_metered = false, checked_echo = false;
+    for (auto& route : app.route_metrics())
+    {
+        if (route.rule == "/metered/<int>")
+        {
+            checked_metered = true;
+            CHECK(route.requests == 3);
+            CHECK(route.status_classes[2] == 2);
+            CHECK(route.status_classes[4] == 1);
+            CHECK(route.bytes_in == 0);
+            CHECK(route.bytes_out == 12);
+            CHECK(route.latency.count() == 3);
+        }
+        else if (route.rule == "/echo")
+        {
+            checked_echo = true;
+            CHECK(route.requests == 1);
+            CHECK(route.bytes_in == 5);
+            CHECK(route.bytes_out == 5);
+        }
+    }
+    CHECK(checked_metered);
+    CHECK(checked_echo);
+
+    std::string exposition = http_exchange("GET /metrics HTTP/1.0\r\n\r\n");
+    CHECK(exposition.find("text/plain; version=0.0.4") != std::string::npos);
+    CHECK(exposition.find("crow_route_requests_total{route=\"/metered/<int>\"} 3") != std::string::npos);
+    CHECK(exposition.find("crow_route_responses_total{route=\"/metered/<int>\",code=\"4xx\"} 1") != std::string::npos);
+    CHECK(exposition.find("crow_route_latency_seconds_count{route=\"/echo\"} 1") != std::string::npos);
+
+    app.stop();
+} // route_metrics
+
+TEST_CASE("server_metrics")
+{
+    static char buf[2048];
+
+    SimpleApp app;
+    app.metrics_endpoint();
+
+    CROW_ROUTE(app, "/")
+    ([] {
+        return "hello";
+    });
+
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    asio::io_service is;
+    {
+        asio::ip::tcp::socket c(is);
+        c.connect(asio::ip::tcp::endpoint(
+          asio::ip::address::from_string(LOCALHOST_ADDRESS), 45451));
+        std::string sendmsg = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        for (int i = 0; i < 2; i++)
+        {
+            c.send(asio::buffer(sendmsg));
+            c.receive(asio::buffer(buf, 2048));
+        }
+
+        auto snapshot = app.server_metrics();
+        REQUIRE(snapshot.active_connections.size() == 1);
+        CHECK(snapshot.active_connections[0] == 1);
+        CHECK(snapshot.loop_lag.size() == 1);
+        CHECK(snapshot.accepts == 1);
+        CHECK(snapshot.requests == 2);
+        CHECK(snapshot.keep_alive_requests == 1);
+        CHECK(snapshot.bytes_read == 2 * sendmsg.size());
+        c.close();
+    }
+    {
+        asio::ip::tcp::socket c(is);
+        c.connect(asio::ip::tcp::endpoint(
+          asio::ip::address::from_string(LOCALHOST_ADDRESS), 45451));
+        c.send(asio::buffer("G@T / HTTP/1.1\r\n\r\n"));
+        asio::error_code ec;
+        c.read_some(asio::buffer(buf, 2048), ec);
+        CHECK(ec == asio::error::eof);
+        c.close();
+    }
+
+    auto snapshot = app.server_metrics();
+    CHECK(snapshot.accepts == 2);
+    CHECK(snapshot.parser_errors[CHPE_INVALID_METHOD] == 1);
+    CHECK(snapshot.bytes_written > 0);
+
+    std::ostringstream exposition;
+    metrics::write_prometheus(exposition, snapshot);
+    CHECK(exposition.str().find("crow_keep_alive_requests_total 1") != std::string::npos);
+    CHECK(exposition.str().find("crow_parser_errors_total{error=\"CHPE_INVALID_METHOD\"} 1") != std::string::npos);
+
+    app.stop();
+} // server_metrics
+
 
 TEST_CASE("trim")
 {
@@ -3437,6 +4601,442 @@ TEST_CASE("string_equals")
     CHECK(utility::string_equals("ABC", "abc", true) == false);
 }
 
+TEST_CASE("ci_map")
+{
+    ci_map headers{{"Content-Type", "text/plain"}, {"Set-Cookie", "a=1"}, {"X-Custom", "x"}};
+    headers.emplace("set-cookie", "b=2");
+
+    CHECK(headers.size() == 4);
+    CHECK(headers.count("SET-COOKIE") == 2);
+    CHECK(headers.find("content-type")->second == "text/plain");
+    CHECK(headers.find("Content-Length") == headers.end());
+    CHECK(get_header_value(headers, "x-custom") == "x");
+    CHECK(ci_hash()("Content-Type") == ci_hash()("cONTENT-tYPE"));
+
+    std::vector<std::string> values;
+    auto range = headers.equal_range("SET-COOKIE");
+    for (auto it = range.first; it != range.second; ++it)
+        values.push_back(it->second);
+    CHECK(values == std::vector<std::string>{"a=1", "b=2"});
+    const ci_map& const_headers = headers;
+    auto missing = const_headers.equal_range("Content-Length");
+    CHECK(missing.first == missing.second);
+
+    // Headers keep the order they were added in
+    CHECK(headers.erase("Set-Cookie") == 2);
+    headers.erase(headers.find("content-type"));
+    headers.emplace("Vary", "Accept-Encoding");
+    std::vector<std::string> keys;
+    for (const auto& header : headers)
+        keys.push_back(header.first);
+    CHECK(keys == std::vector<std::string>{"X-Custom", "Vary"});
+
+    headers.clear();
+    CHECK(headers.empty());
+    CHECK(headers.find("X-Custom") == headers.end());
+    headers.emplace("Host", "localhost");
+    CHECK(get_header_value(headers, "host") == "localhost");
+    CHECK(headers.size() == 1);
+}
+
+TEST_CASE("known_headers")
+{
+    ci_map headers{{"X-Custom", "x"}, {"set-cookie", "a=1"}, {"CONTENT-TYPE", "text/plain"}, {"Set-Cookie", "b=2"}};
+
+    CHECK(headers.find(known_header::content_type)->second == "text/plain");
+    CHECK(headers.find(known_header::set_cookie)->second == "a=1");
+    CHECK(headers.count(known_header::set_cookie) == 2);
+    auto cookies = headers.equal_range(known_header::set_cookie);
+    CHECK(std::distance(cookies.first, cookies.second) == 2);
+    CHECK((++cookies.first)->second == "b=2");
+    auto const_cookies = static_cast<const ci_map&>(headers).equal_range(known_header::set_cookie);
+    CHECK(const_cookies.first->first == "set-cookie");
+    CHECK(headers.find(known_header::host) == headers.end());
+    CHECK(get_header_value(headers, known_header::content_type) == "text/plain");
+    CHECK(std::string(known_header_name(known_header::etag)) == "ETag");
+
+    // Known headers are still found after the ones before them are removed
+    headers.erase(headers.find("X-Custom"));
+    CHECK(headers.find(known_header::content_type)->second == "text/plain");
+    headers.erase(headers.find(known_header::set_cookie));
+    CHECK(headers.find(known_header::set_cookie)->second == "b=2");
+    CHECK(headers.erase(known_header::set_cookie) == 1);
+    CHECK(headers.count("Set-Cookie") == 0);
+
+    // Headers added by name are found by their enum value, and the other way around
+    headers.emplace("location", "/a");
+    headers.emplace("Location", "/b");
+    headers.set(known_header::location, "/c");
+    CHECK(headers.count("LOCATION") == 1);
+    CHECK(headers.find("Location")->second == "/c");
+    headers.set("content-type", "application/json");
+    CHECK(headers.find(known_header::content_type)->second == "application/json");
+    CHECK(headers.size() == 2);
+
+    headers.clear();
+    CHECK(headers.find(known_header::location) == headers.end());
+
+    response res;
+    res.set_header("Vary", "Origin");
+    res.set_header(known_header::vary, "Accept-Encoding");
+    res.add_header(known_header::set_cookie, "c=3");
+    CHECK(res.get_header_value("vary") == "Accept-Encoding");
+    CHECK(res.get_header_value(known_header::set_cookie) == "c=3");
+    CHECK(res.headers.size() == 2);
+}
+
+TEST_CASE("request_storage_reuse")
+{
+    request req;
+    req.raw_url = "/a/rather/long/path/to/some/resource?with=a&query=string";
+    req.url = "/a/rather/long/path/to/some/resource";
+    req.url_params.assign(req.raw_url);
+    req.headers.emplace("X-Some-Rather-Long-Header-Name", "and a value that doesn't fit in a small string");
+    req.body = std::string(1024, 'b');
+    const char* raw_url = req.raw_url.data();
+    const char* body = req.body.data();
+
+    req.clear();
+    CHECK(req.raw_url.empty());
+    CHECK(req.url.empty());
+    CHECK(req.url_params.get("with") == nullptr);
+    CHECK(req.headers.empty());
+    CHECK(req.body.empty());
+    req.raw_url = "/another/path";
+    req.body = "short";
+    CHECK(req.raw_url.data() == raw_url);
+    CHECK(req.body.data() == body);
+
+    // Large bodies aren't kept
+    req.body = std::string(CROW_REUSED_BODY_CAPACITY + 1, 'b');
+    req.clear();
+    CHECK(req.body.capacity() <= CROW_REUSED_BODY_CAPACITY);
+
+    req.url_params.assign("?a=1&b=2");
+    CHECK(req.url_params.get("b") == std::string("2"));
+
+    // A response assigned to another keeps the other's header storage
+    response res;
+    res.add_header("X-Some-Rather-Long-Header-Name", "and a value that doesn't fit in a small string");
+    const ci_map::value_type* first_header = &*res.headers.begin();
+    res.clear();
+    res = response(404, "text/plain", "Not found");
+    CHECK(&*res.headers.begin() == first_header);
+    CHECK(res.get_header_value("Content-Type") == "text/plain");
+    CHECK(res.code == 404);
+
+    response moved(std::move(res));
+    CHECK(moved.headers.size() == 1);
+    CHECK(res.headers.empty());
+}
+
+TEST_CASE("request_limits")
+{
+    SimpleApp app;
+    request_limits limits;
+    limits.max_url_size = 64;
+    limits.max_header_count = 4;
+    limits.max_header_bytes = 256;
+    limits.max_body_size = 16;
+    app.limits(limits);
+    CROW_ROUTE(app, "/echo").methods("POST"_method)([](const request& req) {
+        return req.body;
+    });
+    limits.max_body_size = 1000;
+    CROW_ROUTE(app, "/upload").methods("POST"_method).limits(limits)([](const request& req) {
+        return std::to_string(req.body.size());
+    });
+
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    // Rejected requests don't ask for the connection to be closed, the server closes it anyway
+    auto post = [](const std::string& url, const std::string& headers, const std::string& body) {
+        return "POST " + url + " HTTP/1.1\r\nHost: localhost\r\nContent-Length: " + std::to_string(body.size()) + "\r\n" + headers + "\r\n" + body;
+    };
+
+    std::string response = http_exchange(post("/echo", "Connection: close\r\n", "within limits"));
+    CHECK(response.find("200 OK") != std::string::npos);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == "within limits");
+
+    CHECK(http_exchange(post("/echo?" + std::string(64, 'a'), "", "")).find("414 URI Too Long") != std::string::npos);
+    CHECK(http_exchange(post("/echo", "A: 1\r\nB: 2\r\nC: 3\r\n", "")).find("431 Request Header Fields Too Large") != std::string::npos);
+    CHECK(http_exchange(post("/echo", "X-Large: " + std::string(256, 'x') + "\r\n", "")).find("431 Request Header Fields Too Large") != std::string::npos);
+
+    // Announced bodies are rejected before they're sent
+    CHECK(http_exchange("POST /echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: 17\r\n\r\n").find("413 Payload Too Large") != std::string::npos);
+    CHECK(http_exchange("POST /echo HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n10\r\n" + std::string(16, 'a') + "\r\n1\r\na\r\n0\r\n\r\n").find("413 Payload Too Large") != std::string::npos);
+
+    // The route's own limits
+    response = http_exchange(post("/upload", "Connection: close\r\n", std::string(1000, 'a')));
+    CHECK(response.find("200 OK") != std::string::npos);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == "1000");
+    CHECK(http_exchange(post("/upload", "", std::string(1001, 'a'))).find("413 Payload Too Large") != std::string::npos);
+    CHECK(http_exchange(post("/upload?" + std::string(64, 'a'), "", "")).find("414 URI Too Long") != std::string::npos);
+
+    app.stop();
+} // request_limits
+
+TEST_CASE("expect_continue")
+{
+    SimpleApp app;
+    app.expect_continue([](const request& req, expectation expect) {
+        if (req.get_header_value("Authorization").empty())
+            expect.reject(response(401, "log in first"));
+        else
+            expect.accept();
+    });
+    CROW_ROUTE(app, "/echo").methods("POST"_method)([](const request& req) {
+        return req.body;
+    });
+    CROW_ROUTE(app, "/deferred").methods("POST"_method).expect_continue([](const request&, expectation expect) {
+        std::thread([expect]() mutable {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            expect.accept();
+        }).detach();
+    })([](const request& req) {
+        return req.body;
+    });
+    CROW_ROUTE(app, "/unanswered").methods("POST"_method).expect_continue([](const request&, expectation) {})([](const request& req) {
+        return req.body;
+    });
+
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    asio::io_service is;
+    auto connect = [&is]() {
+        std::unique_ptr<asio::ip::tcp::socket> c(new asio::ip::tcp::socket(is));
+        c->connect(asio::ip::tcp::endpoint(asio::ip::address::from_string(LOCALHOST_ADDRESS), 45451));
+        return c;
+    };
+    // Read a response with a body, or an interim one
+    auto receive = [](asio::ip::tcp::socket& c) {
+        std::string response;
+        char buf[2048];
+        size_t header_end;
+        while ((header_end = response.find("\r\n\r\n")) == std::string::npos ||
+               (response.find("Content-Length: ") != std::string::npos && response.size() < header_end + 4 + std::stoul(response.substr(response.find("Content-Length: ") + 16))))
+            response.append(buf, c.receive(asio::buffer(buf)));
+        return response;
+    };
+    auto headers = [](const std::string& url, const std::string& extra) {
+        return "POST " + url + " HTTP/1.1\r\nHost: localhost\r\nExpect: 100-continue\r\nContent-Length: 5\r\n" + extra + "\r\n";
+    };
+
+    auto c = connect();
+    c->send(asio::buffer(headers("/echo", "Authorization: yes\r\n")));
+    CHECK(receive(*c) == "HTTP/1.1 100 Continue\r\n\r\n");
+    c->send(asio::buffer("hello", 5));
+    std::string response = receive(*c);
+    CHECK(response.find("200 OK") != std::string::npos);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == "hello");
+
+    // The connection can still be used
+    c->send(asio::buffer(headers("/echo", "Authorization: yes\r\n")));
+    CHECK(receive(*c) == "HTTP/1.1 100 Continue\r\n\r\n");
+    c->send(asio::buffer("again", 5));
+    CHECK(receive(*c).find("again") != std::string::npos);
+
+    // Rejected requests are answered without reading the body, and the connection is closed
+    c = connect();
+    c->send(asio::buffer(headers("/echo", "")));
+    response = receive(*c);
+    CHECK(response.find("401 Unauthorized") == 9);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == "log in first");
+    char buf[16];
+    asio::error_code ec;
+    c->read_some(asio::buffer(buf), ec);
+    CHECK(ec == asio::error::eof);
+
+    // The route's handler answers later, from another thread
+    c = connect();
+    c->send(asio::buffer(headers("/deferred", "")));
+    CHECK(receive(*c) == "HTTP/1.1 100 Continue\r\n\r\n");
+    c->send(asio::buffer("later", 5));
+    CHECK(receive(*c).find("later") != std::string::npos);
+
+    // The body is sent without waiting, the request is only handled once the body is accepted
+    c = connect();
+    c->send(asio::buffer(headers("/deferred", "") + "early"));
+    response = receive(*c);
+    CHECK(response.find("200 OK") == 9);
+    CHECK(response.substr(response.find("\r\n\r\n") + 4) == "early");
+
+    c = connect();
+    c->send(asio::buffer(headers("/unanswered", "")));
+    CHECK(receive(*c) == "HTTP/1.1 100 Continue\r\n\r\n");
+
+    app.stop();
+} // expect_continue
+
+TEST_CASE("proxy_protocol")
+{
+    using proxy_protocol::result;
+    auto decode = [](const std::string& data, proxy_protocol::header& header) {
+        return proxy_protocol::decode(data.data(), data.size(), header);
+    };
+    proxy_protocol::header header;
+
+    std::string v1 = "PROXY TCP4 203.0.113.7 192.0.2.1 56324 443\r\nGET /";
+    CHECK(decode(v1, header) == result::complete);
+    CHECK(header.size == v1.find('\n') + 1);
+    CHECK(header.proxied);
+    CHECK(header.source == asio::ip::tcp::endpoint(asio::ip::address::from_string("203.0.113.7"), 56324));
+    CHECK(decode("PROXY TCP6 2001:db8::1 2001:db8::2 1 65535\r\n", header) == result::complete);
+    CHECK(header.source.address().to_string() == "2001:db8::1");
+    CHECK(decode("PROXY UNKNOWN ffff::1 ffff::2 1 2\r\n", header) == result::complete);
+    CHECK_FALSE(header.proxied);
+
+    CHECK(decode("PROX", header) == result::incomplete);
+    CHECK(decode("PROXY TCP4 203.0.113.7 192.0.", header) == result::incomplete);
+    CHECK(decode("GET / HTTP/1.1\r\n", header) == result::invalid);
+    CHECK(decode("PROXY TCP4 203.0.113.7 192.0.2.1 56324 443\n", header) == result::invalid);
+    CHECK(decode("PROXY TCP4 203.0.113.7  192.0.2.1 56324 443\r\n", header) == result::invalid);
+    CHECK(decode("PROXY TCP4 203.0.113.7 192.0.2.1 56324\r\n", header) == result::invalid);
+    CHECK(decode("PROXY TCP4 203.0.113.7 192.0.2.1 56324 65536\r\n", header) == result::invalid);
+    CHECK(decode("PROXY TCP4 203.0.113.7 192.0.2.1 056324 443\r\n", header) == result::invalid);
+    CHECK(decode("PROXY TCP4 2001:db8::1 192.0.2.1 56324 443\r\n", header) == result::invalid);
+    CHECK(decode("PROXY TCP6 fe80::1%1 2001:db8::2 1 2\r\n", header) == result::invalid);
+    CHECK(decode("PROXY TCP5 203.0.113.7 192.0.2.1 56324 443\r\n", header) == result::invalid);
+    CHECK(decode("PROXY UNKNOWN" + std::string(100, ' '), header) == result::invalid);
+
+    // Signature, version 2 PROXY, TCP over IPv4, 12 bytes of addresses and 7 of TLVs
+    std::string v2("\r\n\r\n\0\r\nQUIT\n\x21\x11\x00\x13", 16);
+    v2 += std::string("\xcb\x00\x71\x07\xc0\x00\x02\x01\xdc\x04\x01\xbb", 12);
+    v2 += std::string("\x04\x00\x04test", 7);
+    CHECK(decode(v2 + "GET /", header) == result::complete);
+    CHECK(header.size == v2.size());
+    CHECK(header.source == asio::ip::tcp::endpoint(asio::ip::address::from_string("203.0.113.7"), 56324));
+    // TLVs aren't needed to decode the header
+    CHECK(decode(v2.substr(0, 28), header) == result::complete);
+    CHECK(decode(v2.substr(0, 20), header) == result::incomplete);
+    CHECK(decode(v2.substr(0, 8), header) == result::incomplete);
+
+    std::string local("\r\n\r\n\0\r\nQUIT\n\x20\x00\x00\x00", 16);
+    CHECK(decode(local, header) == result::complete);
+    CHECK_FALSE(header.proxied);
+    std::string wrong_version = v2;
+    wrong_version[12] = '\x11';
+    CHECK(decode(wrong_version, header) == result::invalid);
+    std::string udp = v2;
+    udp[13] = '\x12';
+    CHECK(decode(udp, header) == result::invalid);
+    std::string short_addresses = v2;
+    short_addresses[15] = '\x08';
+    CHECK(decode(short_addresses, header) == result::invalid);
+
+    SimpleApp app;
+    app.use_proxy_protocol();
+    CROW_ROUTE(app, "/")
+    ([](const request& req) {
+        return req.remote_ip_address;
+    });
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    // Stands in for the load balancer
+    asio::io_service is;
+    auto body = [](const std::string& response) {
+        return response.substr(response.find("\r\n\r\n") + 4);
+    };
+    std::string request = "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+
+    CHECK(body(http_exchange("PROXY TCP4 203.0.113.7 192.0.2.1 56324 443\r\n" + request)) == "203.0.113.7");
+    CHECK(body(http_exchange(v2 + request)) == "203.0.113.7");
+    std::string v6("\r\n\r\n\0\r\nQUIT\n\x21\x21\x00\x24", 16);
+    v6 += std::string("\x20\x01\x0d\xb8", 4) + std::string(11, '\0') + "\x01" + std::string(16, '\0') + "\x01\x02\x01\xbb";
+    CHECK(body(http_exchange(v6 + request)) == "2001:db8::1");
+    CHECK(body(http_exchange(local + request)) == LOCALHOST_ADDRESS);
+
+    // The address is the same for every request on the connection
+    {
+        asio::ip::tcp::socket c(is);
+        c.connect(asio::ip::tcp::endpoint(asio::ip::address::from_string(LOCALHOST_ADDRESS), 45451));
+        c.send(asio::buffer(std::string("PROXY TCP4 203.0.113.7 192.0.2.1 56324 443\r\nGET / HTTP/1.1\r\nHost: localhost\r\n\r\n")));
+        std::string response;
+        char buf[2048];
+        while (response.size() < 11 || response.compare(response.size() - 11, 11, "203.0.113.7") != 0)
+            response.append(buf, c.receive(asio::buffer(buf)));
+        c.send(asio::buffer(request));
+        asio::error_code ec;
+        size_t n;
+        response.clear();
+        while ((n = c.read_some(asio::buffer(buf), ec)) > 0)
+            response.append(buf, n);
+        CHECK(body(response) == "203.0.113.7");
+    }
+
+    // A header sent in several pieces is waited for
+    for (const std::string& header : {std::string("PROXY TCP4 203.0.113.7 192.0.2.1 56324 443\r\n"), v2})
+    {
+        asio::ip::tcp::socket c(is);
+        c.connect(asio::ip::tcp::endpoint(asio::ip::address::from_string(LOCALHOST_ADDRESS), 45451));
+        c.send(asio::buffer(header.substr(0, 20)));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        c.send(asio::buffer(header.substr(20) + request));
+        std::string response;
+        char buf[2048];
+        asio::error_code ec;
+        size_t n;
+        while ((n = c.read_some(asio::buffer(buf), ec)) > 0)
+            response.append(buf, n);
+        CHECK(body(response) == "203.0.113.7");
+    }
+
+    CHECK(http_exchange(request).empty());
+    CHECK(http_exchange("PROXY TCP4 203.0.113.7 192.0.2.1 56324 443\n" + request).empty());
+
+    app.stop();
+} // proxy_protocol
+
+struct ForwardedFor
+{
+    struct context
+    {};
+
+    void before_handle(request& req, response&, context&)
+    {
+        if (!req.get_header_value("X-Forwarded-For").empty())
+            req.remote_ip_address = req.get_header_value("X-Forwarded-For");
+    }
+
+    void after_handle(request&, response&, context&)
+    {}
+};
+
+TEST_CASE("remote_ip_address")
+{
+    App<ForwardedFor> app;
+    CROW_ROUTE(app, "/")
+    ([](const request& req) {
+        return req.remote_ip_address;
+    });
+    auto _ = app.bindaddr(LOCALHOST_ADDRESS).port(45451).run_async();
+    app.wait_for_server_start();
+
+    asio::io_service is;
+    asio::ip::tcp::socket c(is);
+    c.connect(asio::ip::tcp::endpoint(asio::ip::address::from_string(LOCALHOST_ADDRESS), 45451));
+    auto get = [&c](const std::string& headers) {
+        c.send(asio::buffer("GET / HTTP/1.1\r\nHost: localhost\r\n" + headers + "\r\n"));
+        std::string response;
+        char buf[2048];
+        size_t header_end;
+        while ((header_end = response.find("\r\n\r\n")) == std::string::npos ||
+               response.size() < header_end + 4 + std::stoul(response.substr(response.find("Content-Length: ") + 16)))
+            response.append(buf, c.receive(asio::buffer(buf)));
+        return response.substr(header_end + 4);
+    };
+
+    // The address is looked up once for the connection, a middleware changing it only changes it for its request
+    CHECK(get("") == LOCALHOST_ADDRESS);
+    CHECK(get("X-Forwarded-For: 203.0.113.7\r\n") == "203.0.113.7");
+    CHECK(get("") == LOCALHOST_ADDRESS);
+
+    app.stop();
+} // remote_ip_address
+
 TEST_CASE("lexical_cast")
 {
     CHECK(utility::lexical_cast<int>(4) == 4);